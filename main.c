@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "SDL.h"
 #include "SDL2/SDL_vulkan.h"
@@ -28,13 +30,65 @@ static uint32_t window_height = 720;
 #include "cgltf/cgltf.h"
 
 #include "vk_rt_mesh.h"
+#include "vk_rt_anim.h"
+#include "vk_rt_skin.h"
+#include "vk_rt_host_build.h"
+#include "vk_rt_instances.h"
+#include "vk_rt_scene.h"
+#include "vk_rt_lights.h"
+#include "vk_rt_env.h"
+#include "vk_rt_sampler.h"
+#include "vk_rt_tiles.h"
+#include "vk_rt_budget.h"
+#include "vk_rt_bench.h"
+#include "vk_rt_denoise.h"
+#include "vk_rt_temporal.h"
+#include "vk_rt_adaptive.h"
+#include "vk_rt_pipelines.h"
+#include "vk_rt_wavefront.h"
+#include "vk_rt_display.h"
 
 typedef struct {
   float e[4];
   float view[16];
   float proj[16];
   uint32_t frame_no;
+  uint32_t stats_slot;
+  uint32_t ray_flags;
+  uint32_t count_any_hits; // makes the any-hit shader count its invocations
+  uint32_t nee; // next event estimation, a shadow ray to a light at every hit
+  uint32_t seed_offset;
+  uint32_t rr_min_depth; // russian roulette from this depth, off if >= max_depth
+  uint32_t sampler_mode; // vkrt_sampler_mode
+  uint32_t tile_offset[2]; // where the launch starts in the image
+  uint32_t reproject; // the camera moved, see vk_rt_temporal.h
+  uint32_t history_max;
+  uint32_t adaptive; // trace the pixels listed by vkrt_adaptive_record
+  vkrt_wave_push_constants wave; // only read by the wavefront passes
+  uint32_t pad; // launch_size is a uvec2 in the shaders, 8 byte aligned
+  uint32_t launch_size[2]; // compute tracers only, see vkrt_tracer
 } push_constants_t;
+// the offsets the std430 push constant block in shaders/push_constants.glsl has
+_Static_assert(offsetof(push_constants_t, launch_size) == 216,
+	       "launch_size has to sit where the shaders read it");
+_Static_assert(sizeof(push_constants_t) == 224,
+	       "push_constants_t has to match the shaders' push constant block");
+
+// how alpha masked geometry is traced, only hits on geometry that isn't
+// opaque run the any-hit shader (shaders/alpha_test.rahit)
+typedef enum {
+  alpha_test_masked, // only masked primitives are built non-opaque
+  alpha_test_off,    // everything is forced opaque, masks render as solid quads
+  alpha_test_all,    // everything is forced non-opaque, the naive way
+  alpha_test_mode_count,
+} alpha_test_mode;
+
+const char *alpha_test_mode_names[alpha_test_mode_count] = {
+  "masked", "off", "all",
+};
+
+// gl_RayFlagsNoneEXT, gl_RayFlagsOpaqueEXT and gl_RayFlagsNoOpaqueEXT
+const uint32_t alpha_test_ray_flags[alpha_test_mode_count] = { 0, 1, 2 };
 
 typedef struct {
   v3 pos;
@@ -159,14 +213,647 @@ vkrt_geom_data load_gltf_mesh(const char *fp, uint32_t mesh_idx) {
 }
 
 typedef struct {
-  uint64_t vertex_buffer_address;
-  uint64_t index_buffer_address;
-  uint32_t material_index;
-} geometry_node;
+  const char *asset_path;
+  const char *env_path; // NULL leaves the environment black
+  float env_strength;
+  vkrt_blas_policy blas_policy;
+  vkrt_as_profiles as_profiles;
+  uint32_t tlas_rebuild_interval;
+  uint32_t host_build_threads; // 0 builds blases on the device
+  bool cpu_instances; // write tlas instances on the host instead of the gpu
+  bool detect_spheres; // trace tessellated spheres as analytic ones
+  alpha_test_mode alpha_test;
+  bool no_nee;
+  uint32_t max_depth;
+  uint32_t rr_min_depth;
+  vkrt_sampler_mode sampler;
+  uint32_t spp;
+  uint32_t tile_size; // 0 traces the whole image at once
+  uint32_t tiles_per_frame;
+  vkrt_tile_order tile_order;
+  float frame_budget_ms; // 0 traces a fixed amount per frame
+  bool denoise;
+  uint32_t denoise_iterations;
+  vkrt_tonemap_op tonemap;
+  float exposure;
+  bool no_temporal;
+  uint32_t history_frames;
+  bool adaptive;
+  float adaptive_error;
+  uint32_t adaptive_min_frames;
+  vkrt_backend backend;
+  bool wavefront; // trace with vk_rt_wavefront.h instead of the path loop
+  bool wavefront_sort;
+  bool bench_blas;
+  bool bench_alpha;
+  bool bench_nee;
+  bool bench_roulette;
+  bool bench_sampler;
+  bool bench_adaptive;
+  bool bench_wavefront;
+  uint32_t bench_reference_frames;
+  uint32_t bench_frames;
+  // instance scaling benchmark, one run per count
+  uint32_t bench_instance_counts[16];
+  uint32_t bench_instance_runs;
+  vkrt_bench_layout bench_layout;
+  float bench_spacing; // 0 spaces copies by the size of the asset
+} options_t;
+
+void print_usage(const char *exe) {
+  fprintf(stderr,
+	  "usage: %s [options]\n"
+	  "  --asset <path>        gltf/glb file to load\n"
+	  "  --env <path>          lat-long .hdr environment map lighting the scene\n"
+	  "  --env-strength <f>    scale of its radiance (default 1)\n"
+	  "  --blas-policy <name>  blas grouping: primitive, mesh, material, spatial, scene\n"
+	  "  --blas-profile <flags>          build flags for static blases\n"
+	  "  --dynamic-blas-profile <flags>  build flags for skinned/animated blases\n"
+	  "  --tlas-profile <flags>          build flags for the tlas\n"
+	  "  --backend <pipeline|ray-query>  trace with a ray tracing pipeline or with\n"
+	  "                        ray queries from a compute shader\n"
+	  "                        flags are joined with '+' from: fast-trace,\n"
+	  "                        fast-build, low-memory, allow-update, allow-compaction\n"
+	  "  --tlas-rebuild-interval <n>     rebuild the tlas every n updates (default 60)\n"
+	  "  --host-build-threads <n|all>    build blases on the cpu with n threads\n"
+	  "                                  (default 0, build them on the gpu)\n"
+	  "  --cpu-instances                 write tlas instances on the cpu rather\n"
+	  "                                  than generating them with a compute pass\n"
+	  "  --detect-spheres      trace static meshes that are spheres as analytic\n"
+	  "                        spheres (meshes tagged vkrt_sphere always are)\n"
+	  "  --alpha-test <masked|off|all>   which geometry runs the any-hit alpha test\n"
+	  "                        (default masked, only alpha masked primitives)\n"
+	  "  --bench-blas          build and trace the asset with every blas policy,\n"
+	  "                        print the results as csv and exit\n"
+	  "  --no-nee              only find lights by hitting them, no shadow rays\n"
+	  "  --bench-nee           compare the noise (rmse against a reference) of\n"
+	  "                        tracing with and without shadow rays over time,\n"
+	  "                        print it as csv and exit\n"
+	  "  --bench-reference-frames <n>    frames in that reference (default 4096)\n"
+	  "  --max-depth <n>       most bounces a path can take (default 5)\n"
+	  "  --rr-min-depth <n>    bounces before russian roulette can end paths\n"
+	  "                        (default 3, >= max depth turns it off)\n"
+	  "  --sampler <random|sobol|blue-noise>  where paths get their random\n"
+	  "                        numbers from (default sobol)\n"
+	  "  --spp <n>             samples per pixel per launch (default 1)\n"
+	  "  --tile-size <n>       trace the image in n*n tiles over several frames\n"
+	  "                        (default 0, the whole image every frame)\n"
+	  "  --tiles-per-frame <n> tiles traced per frame (default 4)\n"
+	  "  --tile-order <scanline|center|mouse>  order tiles are traced in\n"
+	  "  --frame-budget-ms <f> trace as many frames (or tiles) per presented\n"
+	  "                        frame as fit in f ms of gpu time (default 0, off)\n"
+	  "  --denoise             show the image through an edge-aware a-trous filter\n"
+	  "  --denoise-iterations <n>        filter passes, 1-5 (default 5)\n"
+	  "  --tonemap <clamp|reinhard|aces> curve the image is shown through\n"
+	  "                        (default clamp)\n"
+	  "  --exposure <f>        scale applied before it (default 1)\n"
+	  "  --no-temporal         restart accumulation when the camera moves instead\n"
+	  "                        of reprojecting what's there\n"
+	  "  --history-frames <n>  frames reprojected history is worth at most\n"
+	  "                        (default 32)\n"
+	  "  --adaptive            only trace pixels whose relative error is above\n"
+	  "                        the target, stop once none are left\n"
+	  "  --adaptive-error <f>  that target (default 0.02)\n"
+	  "  --adaptive-min-frames <n>       frames every pixel gets first (default 16)\n"
+	  "  --bench-adaptive      compare the noise (rmse against a reference) and\n"
+	  "                        gpu time of uniform and adaptive sampling, print\n"
+	  "                        it as csv and exit\n"
+	  "  --bench-sampler       compare the noise (rmse against a reference) of\n"
+	  "                        every sampler over time, print it as csv and exit\n"
+	  "  --bench-roulette      trace with and without russian roulette, print\n"
+	  "                        rays per pixel and throughput as csv and exit\n"
+	  "  --bench-alpha         trace with each alpha test mode, print the any-hit\n"
+	  "                        cost as csv and exit\n"
+	  "  --bench-frames <n>    frames traced per benchmark run (default 64)\n"
+	  "  --bench-instances <n,n,...>     build and trace tlases over n instances of\n"
+	  "                        the asset, print the results as csv and exit\n"
+	  "  --bench-layout <grid|scatter>   how the instances are placed (default grid)\n"
+	  "  --bench-spacing <f>   distance between instances (default asset size)\n",
+	  exe);
+}
+
+options_t parse_options(int argc, char **argv) {
+  options_t opts = {
+    .asset_path = "./assets/sponza/Sponza.gltf",
+    .env_strength = 1.0f,
+    .blas_policy = vkrt_blas_per_primitive,
+    .as_profiles = vkrt_as_profiles_default(),
+    .tlas_rebuild_interval = 60,
+    .bench_frames = 64,
+    .bench_reference_frames = 4096,
+    .max_depth = 5,
+    .rr_min_depth = 3,
+    .sampler = vkrt_sampler_sobol,
+    .spp = 1,
+    .tiles_per_frame = 4,
+    .denoise_iterations = 5,
+    .exposure = 1.0f,
+    .history_frames = 32,
+    .adaptive_error = 0.02f,
+    .adaptive_min_frames = 16,
+  };
+  for (int i = 1; i < argc; ++i) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--asset") == 0 && has_value) {
+      opts.asset_path = argv[++i];
+    } else if (strcmp(argv[i], "--env") == 0 && has_value) {
+      opts.env_path = argv[++i];
+    } else if (strcmp(argv[i], "--env-strength") == 0 && has_value) {
+      opts.env_strength = strtof(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--blas-policy") == 0 && has_value) {
+      opts.blas_policy = vkrt_blas_policy_from_name(argv[++i]);
+      if (opts.blas_policy == vkrt_blas_policy_count) {
+	fprintf(stderr, "Unknown blas policy %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if ((strcmp(argv[i], "--blas-profile") == 0 ||
+		strcmp(argv[i], "--dynamic-blas-profile") == 0 ||
+		strcmp(argv[i], "--tlas-profile") == 0) && has_value) {
+      VkBuildAccelerationStructureFlagsKHR *flags =
+	argv[i][2] == 'b' ? &opts.as_profiles.static_blas :
+	argv[i][2] == 'd' ? &opts.as_profiles.dynamic_blas : &opts.as_profiles.tlas;
+      if (!vkrt_as_flags_from_string(argv[++i], flags)) {
+	fprintf(stderr, "Invalid build profile %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--tlas-rebuild-interval") == 0 && has_value) {
+      opts.tlas_rebuild_interval = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--host-build-threads") == 0 && has_value) {
+      i++;
+      opts.host_build_threads = strcmp(argv[i], "all") == 0 ?
+	sysconf(_SC_NPROCESSORS_ONLN) : strtoul(argv[i], NULL, 10);
+    } else if (strcmp(argv[i], "--cpu-instances") == 0) {
+      opts.cpu_instances = true;
+    } else if (strcmp(argv[i], "--detect-spheres") == 0) {
+      opts.detect_spheres = true;
+    } else if (strcmp(argv[i], "--alpha-test") == 0 && has_value) {
+      i++;
+      opts.alpha_test = alpha_test_mode_count;
+      for (uint32_t m = 0; m < alpha_test_mode_count; ++m) {
+	if (strcmp(argv[i], alpha_test_mode_names[m]) == 0) { opts.alpha_test = m; }
+      }
+      if (opts.alpha_test == alpha_test_mode_count) {
+	fprintf(stderr, "Unknown alpha test mode %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--bench-blas") == 0) {
+      opts.bench_blas = true;
+    } else if (strcmp(argv[i], "--bench-alpha") == 0) {
+      opts.bench_alpha = true;
+    } else if (strcmp(argv[i], "--no-nee") == 0) {
+      opts.no_nee = true;
+    } else if (strcmp(argv[i], "--bench-nee") == 0) {
+      opts.bench_nee = true;
+    } else if (strcmp(argv[i], "--max-depth") == 0 && has_value) {
+      opts.max_depth = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--rr-min-depth") == 0 && has_value) {
+      opts.rr_min_depth = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--sampler") == 0 && has_value) {
+      i++;
+      opts.sampler = vkrt_sampler_count;
+      for (uint32_t m = 0; m < vkrt_sampler_count; ++m) {
+	if (strcmp(argv[i], vkrt_sampler_names[m]) == 0) { opts.sampler = m; }
+      }
+      if (opts.sampler == vkrt_sampler_count) {
+	fprintf(stderr, "Unknown sampler %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--spp") == 0 && has_value) {
+      opts.spp = strtoul(argv[++i], NULL, 10);
+      if (opts.spp < 1) { opts.spp = 1; }
+    } else if (strcmp(argv[i], "--tile-size") == 0 && has_value) {
+      opts.tile_size = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--tiles-per-frame") == 0 && has_value) {
+      opts.tiles_per_frame = strtoul(argv[++i], NULL, 10);
+      if (opts.tiles_per_frame < 1) { opts.tiles_per_frame = 1; }
+    } else if (strcmp(argv[i], "--frame-budget-ms") == 0 && has_value) {
+      opts.frame_budget_ms = strtof(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--denoise") == 0) {
+      opts.denoise = true;
+    } else if (strcmp(argv[i], "--denoise-iterations") == 0 && has_value) {
+      opts.denoise_iterations = strtoul(argv[++i], NULL, 10);
+      if (opts.denoise_iterations < 1) { opts.denoise_iterations = 1; }
+      if (opts.denoise_iterations > 5) { opts.denoise_iterations = 5; }
+    } else if (strcmp(argv[i], "--tonemap") == 0 && has_value) {
+      i++;
+      opts.tonemap = vkrt_tonemap_count;
+      for (uint32_t t = 0; t < vkrt_tonemap_count; ++t) {
+	if (strcmp(argv[i], vkrt_tonemap_names[t]) == 0) { opts.tonemap = t; }
+      }
+      if (opts.tonemap == vkrt_tonemap_count) {
+	fprintf(stderr, "Unknown tonemap %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--exposure") == 0 && has_value) {
+      opts.exposure = strtof(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--no-temporal") == 0) {
+      opts.no_temporal = true;
+    } else if (strcmp(argv[i], "--history-frames") == 0 && has_value) {
+      opts.history_frames = strtoul(argv[++i], NULL, 10);
+      if (opts.history_frames < 1) { opts.history_frames = 1; }
+    } else if (strcmp(argv[i], "--adaptive") == 0) {
+      opts.adaptive = true;
+    } else if (strcmp(argv[i], "--adaptive-error") == 0 && has_value) {
+      opts.adaptive_error = strtof(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--adaptive-min-frames") == 0 && has_value) {
+      opts.adaptive_min_frames = strtoul(argv[++i], NULL, 10);
+      if (opts.adaptive_min_frames < 2) { opts.adaptive_min_frames = 2; }
+    } else if (strcmp(argv[i], "--bench-adaptive") == 0) {
+      opts.bench_adaptive = true;
+    } else if (strcmp(argv[i], "--backend") == 0 && has_value) {
+      i++;
+      opts.backend = vkrt_backend_count;
+      for (uint32_t b = 0; b < vkrt_backend_count; ++b) {
+	if (strcmp(argv[i], vkrt_backend_names[b]) == 0) { opts.backend = b; }
+      }
+      if (opts.backend == vkrt_backend_count) {
+	fprintf(stderr, "Unknown backend %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--wavefront") == 0) {
+      opts.wavefront = true;
+    } else if (strcmp(argv[i], "--wavefront-sort") == 0) {
+      opts.wavefront = true;
+      opts.wavefront_sort = true;
+    } else if (strcmp(argv[i], "--bench-wavefront") == 0) {
+      opts.bench_wavefront = true;
+    } else if (strcmp(argv[i], "--tile-order") == 0 && has_value) {
+      i++;
+      opts.tile_order = vkrt_tile_order_count;
+      for (uint32_t o = 0; o < vkrt_tile_order_count; ++o) {
+	if (strcmp(argv[i], vkrt_tile_order_names[o]) == 0) { opts.tile_order = o; }
+      }
+      if (opts.tile_order == vkrt_tile_order_count) {
+	fprintf(stderr, "Unknown tile order %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--bench-sampler") == 0) {
+      opts.bench_sampler = true;
+    } else if (strcmp(argv[i], "--bench-roulette") == 0) {
+      opts.bench_roulette = true;
+    } else if (strcmp(argv[i], "--bench-reference-frames") == 0 && has_value) {
+      opts.bench_reference_frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--bench-frames") == 0 && has_value) {
+      opts.bench_frames = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--bench-instances") == 0 && has_value) {
+      char *p = argv[++i];
+      while (*p && opts.bench_instance_runs < 16) {
+	uint32_t n = strtoul(p, &p, 10);
+	if (n > 0) { opts.bench_instance_counts[opts.bench_instance_runs++] = n; }
+	if (*p == ',') { p++; } else { break; }
+      }
+    } else if (strcmp(argv[i], "--bench-layout") == 0 && has_value) {
+      i++;
+      opts.bench_layout = vkrt_bench_layout_count;
+      for (uint32_t l = 0; l < vkrt_bench_layout_count; ++l) {
+	if (strcmp(argv[i], vkrt_bench_layout_names[l]) == 0) { opts.bench_layout = l; }
+      }
+      if (opts.bench_layout == vkrt_bench_layout_count) {
+	fprintf(stderr, "Unknown layout %s\n", argv[i]);
+	print_usage(argv[0]);
+	exit(1);
+      }
+    } else if (strcmp(argv[i], "--bench-spacing") == 0 && has_value) {
+      opts.bench_spacing = strtof(argv[++i], NULL);
+    } else {
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+  return opts;
+}
+
+void update_camera(push_constants_t *pcs, HMM_Vec3 camera_pos, float theta,
+		   float phi, VkExtent2D extent) {
+  HMM_Mat4 view = HMM_Translate(camera_pos);
+  view = HMM_MulM4(view, HMM_Rotate_RH(theta, (HMM_Vec3){0, 1, 0}));
+  view = HMM_MulM4(view, HMM_Rotate_RH(phi, (HMM_Vec3){1, 0, 0}));    
+  HMM_Mat4 proj = HMM_Perspective_RH_ZO(90.f * M_PI / 180.f,
+					(float)extent.width/extent.height,
+					100.f, 0.1f);
+  
+  HMM_Mat4 inv_proj = HMM_InvPerspective_RH(proj);
+  view.Elements[1][1] *= -1;
+
+  memcpy(&pcs->view, &view, 16*sizeof(float));
+  memcpy(&pcs->proj, &inv_proj, 16*sizeof(float));
+}
+
+typedef struct {
+  vkrt_tracer *tracer;
+  push_constants_t *pcs;
+  VkImage image;
+  VkExtent2D extent;
+  uint32_t first_frame; // frames carry on accumulating from here
+  vkrt_adaptive *adaptive; // only trace the pixels it lists, if set
+  vkrt_wavefront *wavefront; // trace with it instead of the path loop, if set
+  vkrt_pipeline_variant *variant; // the wavefront's passes
+} trace_bench_state;
+
+void record_trace_bench(VkCommandBuffer cmd, uint32_t frame, void *user) {
+  trace_bench_state *st = user;
+  // keeps consecutive frames (separate submissions) ordered on the image
+  vkh_transition_image(cmd, st->image, VK_IMAGE_LAYOUT_GENERAL,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  st->pcs->frame_no = st->first_frame + frame;
+  st->pcs->stats_slot = 0;
+  st->pcs->adaptive = st->adaptive && st->pcs->frame_no >= st->adaptive->min_frames;
+  if (st->pcs->adaptive) {
+    vkrt_adaptive_record(cmd, st->adaptive, 0);
+    vkrt_tracer_record_indirect(cmd, st->tracer, st->pcs, sizeof(*st->pcs),
+				st->adaptive->pixels.device_address);
+    return;
+  }
+  if (st->wavefront) {
+    vkrt_wavefront_record(cmd, st->wavefront, st->variant, st->pcs, sizeof(*st->pcs),
+			  &st->pcs->wave);
+    return;
+  }
+  vkrt_tracer_record(cmd, st->tracer, st->pcs, sizeof(*st->pcs),
+		     st->extent.width, st->extent.height);
+}
+
+typedef struct {
+  vkrt_scene *scene;
+  vkrt_instanced_tlas *tlas;
+  bool update;
+} tlas_bench_state;
+
+void record_tlas_bench(VkCommandBuffer cmd, uint32_t frame, void *user) {
+  tlas_bench_state *st = user;
+  vkrt_instanced_tlas_record_build(cmd, st->scene, st->tlas, st->update);
+}
+
+// builds, refits and traces tlases over more and more copies of the scene,
+// printing one csv row per instance count
+void run_instance_bench(VkDevice device, VmaAllocator allocator, VkDescriptorSet rt_set,
+			vkrt_scene *scene, vkrt_model *model, vkrt_bench *bench,
+			trace_bench_state *trace, options_t opts) {
+  HMM_Vec3 lo, hi;
+  vkrt_model_bounds(model, &lo, &hi);
+  HMM_Vec3 size = HMM_SubV3(hi, lo);
+  float extent = fmaxf(size.X, fmaxf(size.Y, size.Z));
+  float spacing = opts.bench_spacing > 0 ? opts.bench_spacing : extent * 1.25f;
+
+  char tlas_profile[128];
+  vkrt_as_flags_to_string(scene->tlas.flags, tlas_profile, sizeof(tlas_profile));
+  bool can_update =
+    scene->tlas.flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+
+  printf("asset,layout,instances,blases,tlas_profile,instance_gen,build_ms,update_ms,"
+	 "tlas_mb,frames,gpu_ms_per_frame,mrays_per_s\n");
+  for (uint32_t run = 0; run < opts.bench_instance_runs; ++run) {
+    uint32_t count = opts.bench_instance_counts[run];
+    uint32_t copies = (count + scene->blas_count - 1) / scene->blas_count;
+    VkTransformMatrixKHR *transforms = calloc(sizeof(*transforms), copies);
+    float width = vkrt_bench_layout_transforms(opts.bench_layout, copies, spacing,
+					       HMM_MulV3F(HMM_AddV3(lo, hi), 0.5f),
+					       transforms);
+    vkrt_instanced_tlas tlas =
+      vkrt_instanced_tlas_create(device, allocator, scene, count, transforms);
+    free(transforms);
+
+    tlas_bench_state st = { .scene = scene, .tlas = &tlas };
+    vkrt_bench_run(bench, 2, record_tlas_bench, &st);
+    vkrt_bench_result build = vkrt_bench_run(bench, 8, record_tlas_bench, &st);
+    vkrt_bench_result update = {};
+    if (can_update) {
+      st.update = true;
+      update = vkrt_bench_run(bench, 8, record_tlas_bench, &st);
+    }
+
+    // look across the field from one edge, slightly from above
+    vkrt_ds_writer writer = vkrt_ds_writer_create(1, rt_set);
+    vkrt_ds_writer_add_as(&writer, 0, &tlas.tlas.as);
+    vkrt_ds_writer_write(device, writer);
+    vkrt_ds_writer_free(&writer);
+    update_camera(trace->pcs, (HMM_Vec3){ 0, extent, width / 2 + extent }, 0, -0.3f,
+		  trace->extent);
+    vkrt_bench_run(bench, 4, record_trace_bench, trace);
+    vkrt_bench_result r = vkrt_bench_run(bench, opts.bench_frames,
+					 record_trace_bench, trace);
+
+    printf("%s,%s,%u,%u,%s,%s,%.3f,%.3f,%.3f,%u,%.3f,%.2f\n", opts.asset_path,
+	   vkrt_bench_layout_names[opts.bench_layout], count, scene->blas_count,
+	   tlas_profile, scene->instance_gen ? "gpu" : "cpu",
+	   vkrt_bench_ms_per_frame(build), vkrt_bench_ms_per_frame(update),
+	   tlas.tlas.size / (1024.0 * 1024.0), r.frames, vkrt_bench_ms_per_frame(r),
+	   vkrt_bench_mrays(r));
+    fflush(stdout);
+
+    vkrt_instanced_tlas_destroy(device, allocator, &tlas);
+  }
+  vkrt_scene_write_descriptors(device, rt_set, scene, 0, 2);
+}
+
+// traces the scene with each alpha test mode, timing it without counting and
+// then counting the any-hit invocations separately (the counter's atomics
+// would otherwise be part of the overhead)
+void run_alpha_bench(vkrt_bench *bench, trace_bench_state *trace, options_t opts) {
+  alpha_test_mode order[] = { alpha_test_off, alpha_test_masked, alpha_test_all };
+  double base_ms = 0;
+  printf("asset,alpha_test,frames,gpu_ms_per_frame,mrays_per_s,any_hits_per_ray,"
+	 "overhead_pct\n");
+  for (uint32_t i = 0; i < alpha_test_mode_count; ++i) {
+    alpha_test_mode m = order[i];
+    trace->pcs->ray_flags = alpha_test_ray_flags[m];
+    trace->pcs->count_any_hits = 0;
+    vkrt_bench_run(bench, 4, record_trace_bench, trace);
+    vkrt_bench_result r = vkrt_bench_run(bench, opts.bench_frames,
+					 record_trace_bench, trace);
+    trace->pcs->count_any_hits = 1;
+    vkrt_bench_result c = vkrt_bench_run(bench, 4, record_trace_bench, trace);
+
+    double ms = vkrt_bench_ms_per_frame(r);
+    if (m == alpha_test_off) { base_ms = ms; }
+    printf("%s,%s,%u,%.3f,%.2f,%.3f,%.1f\n", opts.asset_path, alpha_test_mode_names[m],
+	   r.frames, ms, vkrt_bench_mrays(r),
+	   c.rays + c.shadow_rays ? (double)c.any_hits / (c.rays + c.shadow_rays) : 0,
+	   base_ms > 0 ? (ms - base_ms) / base_ms * 100.0 : 0);
+    fflush(stdout);
+  }
+  trace->pcs->ray_flags = alpha_test_ray_flags[opts.alpha_test];
+  trace->pcs->count_any_hits = 0;
+}
+
+// traces with every path running to the maximum depth, then with russian
+// roulette from the minimum depth, printing rays per pixel and both the ray and
+// path throughput (ending paths early lowers the first, not the second)
+void run_roulette_bench(vkrt_bench *bench, trace_bench_state *trace, options_t opts) {
+  uint64_t pixels = (uint64_t)trace->extent.width * trace->extent.height;
+  printf("asset,roulette,min_depth,max_depth,frames,gpu_ms_per_frame,mrays_per_s,"
+	 "rays_per_pixel,mpaths_per_s\n");
+  for (uint32_t rr = 0; rr < 2; ++rr) {
+    trace->pcs->rr_min_depth = rr ? opts.rr_min_depth : opts.max_depth;
+    vkrt_bench_run(bench, 4, record_trace_bench, trace);
+    vkrt_bench_result r = vkrt_bench_run(bench, opts.bench_frames,
+					 record_trace_bench, trace);
+    printf("%s,%s,%u,%u,%u,%.3f,%.2f,%.3f,%.2f\n", opts.asset_path, rr ? "on" : "off",
+	   trace->pcs->rr_min_depth, opts.max_depth, r.frames,
+	   vkrt_bench_ms_per_frame(r), vkrt_bench_mrays(r),
+	   (double)(r.rays + r.shadow_rays) / ((double)pixels * r.frames),
+	   r.gpu_ms > 0 ? pixels * r.frames / (r.gpu_ms * 1000.0) : 0);
+    fflush(stdout);
+  }
+  trace->pcs->rr_min_depth = opts.rr_min_depth;
+}
+
+// traces with the path loop, then with the wavefront passes, unsorted and
+// sorted by material. the same rays are traced either way, only the time
+// taken differs. the images are checked against the path loop's too: both
+// follow the same paths with the same random numbers, so the rmse should only
+// be float rounding, whatever the max depth and samples per pixel. the
+// wavefront records max_depth rounds per sample whether or not paths are left
+// (see vkrt_wavefront_record), the warm up counts how many of them were empty
+void run_wavefront_bench(vkrt_bench *bench, trace_bench_state *trace,
+			 vkrt_wavefront *wavefront, options_t opts) {
+  const char *modes[] = { "megakernel", "wavefront", "wavefront_sorted" };
+  uint64_t pixels = (uint64_t)trace->extent.width * trace->extent.height;
+  vkrt_memory readback =
+    vkrt_allocate_memory(bench->device, bench->allocator, pixels * 4 * sizeof(float),
+			 NULL, VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+			 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  float *megakernel = calloc(sizeof(float), pixels * 4);
+  printf("asset,mode,frames,gpu_ms_per_frame,mrays_per_s,rmse_vs_megakernel,"
+	 "rounds_per_sample,empty_rounds\n");
+  uint32_t max_depth = trace->variant->spec.max_depth;
+  for (uint32_t m = 0; m < 3; ++m) {
+    trace->wavefront = m > 0 ? wavefront : NULL;
+    wavefront->sort_materials = m == 2;
+    // kept out of the timed frames, the counts are copied every round
+    wavefront->count_depths = true;
+    vkrt_bench_run(bench, 4, record_trace_bench, trace);
+    wavefront->count_depths = false;
+    uint32_t empty = m > 0 ?
+      vkrt_wavefront_empty_rounds(bench->allocator, wavefront, max_depth) : 0;
+    vkrt_bench_result r = vkrt_bench_run(bench, opts.bench_frames,
+					 record_trace_bench, trace);
+    vkrt_bench_read_image(bench, trace->image, trace->extent, readback);
+    if (m == 0) {
+      memcpy(megakernel, readback.info.pMappedData, pixels * 4 * sizeof(float));
+    }
+    printf("%s,%s,%u,%.3f,%.2f,%.6f,%u,%u\n", opts.asset_path, modes[m], r.frames,
+	   vkrt_bench_ms_per_frame(r), vkrt_bench_mrays(r),
+	   vkrt_bench_rmse(readback.info.pMappedData, megakernel, pixels),
+	   m > 0 ? max_depth : 0, empty);
+    fflush(stdout);
+  }
+  trace->wavefront = opts.wavefront ? wavefront : NULL;
+  wavefront->sort_materials = opts.wavefront_sort;
+  free(megakernel);
+  vkrt_memory_free(bench->allocator, readback);
+}
+
+// a converged render that noisier ones are measured against, see run_nee_bench
+// and run_sampler_bench
+typedef struct {
+  uint64_t pixels;
+  vkrt_memory readback;
+  float *reference;
+} convergence_bench;
+
+// renders the reference with next event estimation and the random sampler,
+// seeded apart so its noise isn't shared with the runs compared to it
+convergence_bench convergence_bench_create(VkDevice device, VmaAllocator allocator,
+					   vkrt_bench *bench, trace_bench_state *trace,
+					   options_t opts) {
+  convergence_bench c = {
+    .pixels = (uint64_t)trace->extent.width * trace->extent.height,
+  };
+  c.readback = vkrt_allocate_memory(device, allocator, c.pixels * 4 * sizeof(float), NULL,
+				    VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+				    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  c.reference = calloc(sizeof(float), c.pixels * 4);
+
+  push_constants_t saved = *trace->pcs;
+  trace->pcs->nee = 1;
+  trace->pcs->sampler_mode = vkrt_sampler_random;
+  trace->pcs->seed_offset = 1 << 20;
+  trace->first_frame = 0;
+  vkrt_bench_run(bench, opts.bench_reference_frames, record_trace_bench, trace);
+  vkrt_bench_read_image(bench, trace->image, trace->extent, c.readback);
+  memcpy(c.reference, c.readback.info.pMappedData, c.pixels * 4 * sizeof(float));
+  *trace->pcs = saved;
+  return c;
+}
+
+// accumulates with the current push constants, printing the gpu time spent
+// and the rmse against the reference at every power of two frame count
+void convergence_bench_print(convergence_bench *c, vkrt_bench *bench,
+			     trace_bench_state *trace, options_t opts,
+			     const char *variant) {
+  double gpu_ms = 0;
+  uint32_t frames = 0;
+  for (uint32_t next = 1; next <= opts.bench_frames; next *= 2) {
+    trace->first_frame = frames;
+    gpu_ms += vkrt_bench_run(bench, next - frames, record_trace_bench, trace).gpu_ms;
+    frames = next;
+    vkrt_bench_read_image(bench, trace->image, trace->extent, c->readback);
+    printf("%s,%s,%u,%.3f,%.6f\n", opts.asset_path, variant, frames, gpu_ms,
+	   vkrt_bench_rmse(c->readback.info.pMappedData, c->reference, c->pixels));
+    fflush(stdout);
+  }
+  trace->first_frame = 0;
+}
+
+void convergence_bench_destroy(VmaAllocator allocator, convergence_bench *c) {
+  free(c->reference);
+  vkrt_memory_free(allocator, c->readback);
+  *c = (convergence_bench){};
+}
+
+// accumulates with and without next event estimation
+void run_nee_bench(VkDevice device, VmaAllocator allocator, vkrt_bench *bench,
+		   trace_bench_state *trace, options_t opts) {
+  convergence_bench c = convergence_bench_create(device, allocator, bench, trace, opts);
+  printf("asset,integrator,frames,gpu_ms,rmse\n");
+  for (uint32_t nee = 0; nee < 2; ++nee) {
+    trace->pcs->nee = nee;
+    convergence_bench_print(&c, bench, trace, opts, nee ? "nee" : "brute_force");
+  }
+  trace->pcs->nee = !opts.no_nee;
+  convergence_bench_destroy(allocator, &c);
+}
+
+// accumulates with every sampler, a better one gets to the same rmse in
+// fewer frames
+void run_sampler_bench(VkDevice device, VmaAllocator allocator, vkrt_bench *bench,
+		       trace_bench_state *trace, options_t opts) {
+  convergence_bench c = convergence_bench_create(device, allocator, bench, trace, opts);
+  printf("asset,sampler,frames,gpu_ms,rmse\n");
+  for (uint32_t m = 0; m < vkrt_sampler_count; ++m) {
+    trace->pcs->sampler_mode = m;
+    convergence_bench_print(&c, bench, trace, opts, vkrt_sampler_names[m]);
+  }
+  trace->pcs->sampler_mode = opts.sampler;
+  convergence_bench_destroy(allocator, &c);
+}
+
+// accumulates tracing every pixel, then only the ones above the error target.
+// adaptive sampling wins if it gets to the same rmse in less gpu time
+void run_adaptive_bench(VkDevice device, VmaAllocator allocator, vkrt_bench *bench,
+			trace_bench_state *trace, vkrt_adaptive *adaptive,
+			options_t opts) {
+  convergence_bench c = convergence_bench_create(device, allocator, bench, trace, opts);
+  printf("asset,sampling,frames,gpu_ms,rmse\n");
+  convergence_bench_print(&c, bench, trace, opts, "uniform");
+  trace->adaptive = adaptive;
+  convergence_bench_print(&c, bench, trace, opts, "adaptive");
+  trace->adaptive = NULL;
+  trace->pcs->adaptive = 0;
+  convergence_bench_destroy(allocator, &c);
+}
 
 vki_swapchain build_swapchain(VkDevice device,
 			      VkPhysicalDevice physical_device,
-			      VkSurfaceKHR surface) {
+			      VkSurfaceKHR surface, bool storage) {
   vki_swapchain_builder builder = {
     .physical_device = physical_device,
     .device = device,
@@ -182,11 +869,20 @@ vki_swapchain build_swapchain(VkDevice device,
   vki_set_desired_present_mode(&builder, VK_PRESENT_MODE_FIFO_KHR);
   //vki_set_desired_present_mode(&builder, VK_PRESENT_MODE_IMMEDIATE_KHR);  
   vki_add_image_usage_flags(&builder, VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+  // written by the tonemap pass, see vk_rt_display.h
+  if (storage) {
+    vki_add_image_usage_flags(&builder, VK_IMAGE_USAGE_STORAGE_BIT);
+  }
 
   return vki_swapchain_build(builder);
 }
 
-int main(void) {  
+int main(int argc, char **argv) {
+  options_t opts = parse_options(argc, argv);
+  bool headless = opts.bench_blas || opts.bench_alpha || opts.bench_nee ||
+    opts.bench_roulette || opts.bench_sampler || opts.bench_adaptive ||
+    opts.bench_wavefront || opts.bench_instance_runs > 0;
+
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
     printf("Failed to initialize SDL");
     exit(1);
@@ -195,7 +891,8 @@ int main(void) {
   SDL_Window *win = SDL_CreateWindow("window", SDL_WINDOWPOS_UNDEFINED,
 				     SDL_WINDOWPOS_UNDEFINED, window_width,
 				     window_height,
-				     SDL_WINDOW_VULKAN | SDL_WINDOW_RESIZABLE);
+				     SDL_WINDOW_VULKAN | SDL_WINDOW_RESIZABLE |
+				     (headless ? SDL_WINDOW_HIDDEN : 0));
 
 
   uint32_t sdl_extension_count = 0;
@@ -229,6 +926,7 @@ int main(void) {
 
   uint32_t graphics_queue_family;
   VkQueue graphics_queue;
+  bool host_build_supported;
   {
     vki_physical_device pd = vki_physical_device_init(instance,
 						      VK_API_VERSION_1_3);
@@ -253,8 +951,23 @@ int main(void) {
   
     vki_physical_device_select(&pd);
 
+    // host builds are optional, only turn them on where they exist
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR pd_as_support = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
+    };
+    vkGetPhysicalDeviceFeatures2(pd.physical_device, &(VkPhysicalDeviceFeatures2) {
+	.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+	.pNext = &pd_as_support,
+      });
+    host_build_supported = pd_as_support.accelerationStructureHostCommands;
+
     vki_enable_device_extension(&pd, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME);
-    vki_enable_device_extension(&pd, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME);
+    // the ray query backend doesn't need ray tracing pipelines, so it runs
+    // where they aren't supported
+    bool ray_query = opts.backend == vkrt_backend_ray_query;
+    if (ray_query) { vkrt_trace_stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT; }
+    vki_enable_device_extension(&pd, ray_query ? VK_KHR_RAY_QUERY_EXTENSION_NAME :
+				VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME);
     // required by acceleration_structure extension
     vki_enable_device_extension(&pd, VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME);
     vki_enable_device_extension(&pd, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME);
@@ -266,11 +979,18 @@ int main(void) {
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR pd_rt_pipeline_features = {
       .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
       .rayTracingPipeline = VK_TRUE,
+      // adaptive sampling sizes its launches on the gpu
+      .rayTracingPipelineTraceRaysIndirect = VK_TRUE,
+    };
+    VkPhysicalDeviceRayQueryFeaturesKHR pd_ray_query_features = {
+      .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR,
+      .rayQuery = VK_TRUE,
     };
     VkPhysicalDeviceAccelerationStructureFeaturesKHR pd_as_features = {
       .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
       .accelerationStructure = VK_TRUE,
-      .pNext = &pd_rt_pipeline_features
+      .accelerationStructureHostCommands = host_build_supported,
+      .pNext = ray_query ? (void *)&pd_ray_query_features : &pd_rt_pipeline_features
     };
 
     vki_enable_features_pnext(&pd, &pd_as_features);
@@ -300,7 +1020,14 @@ int main(void) {
     vmaCreateAllocator(&allocator_info, &allocator);
   }
 
-  vki_swapchain swapchain = build_swapchain(device, physical_device, surface);
+  // without storage swapchain images the shown image is blitted, untonemapped
+  bool display_compute = vkrt_display_supported(physical_device, surface,
+						VK_FORMAT_B8G8R8A8_UNORM);
+  if (!display_compute) {
+    fprintf(stderr, "Swapchain images can't be storage images, blitting without tonemapping\n");
+  }
+  vki_swapchain swapchain = build_swapchain(device, physical_device, surface,
+					    display_compute);
 
   VkExtent2D draw_extent = { window_width, window_height };
   VkExtent3D draw_extent3 = { window_width, window_height, 1 };
@@ -314,7 +1041,7 @@ int main(void) {
   
   // make a descriptor allocator
   vkw_pool_size_ratio ratios[1] = {
-    (vkw_pool_size_ratio) { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1}
+    (vkw_pool_size_ratio) { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2}
   };
   vkw_descriptor_allocator ds_alloc =
     vkw_descriptor_allocator_init(device, 10, 1, ratios);
@@ -381,9 +1108,14 @@ int main(void) {
     .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
   };
 
+  // the ray query backend may run where ray tracing pipelines aren't supported
+  VkPhysicalDeviceAccelerationStructurePropertiesKHR as_props = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR,
+    .pNext = opts.backend == vkrt_backend_pipeline ? &rt_pipeline_props : NULL,
+  };
   VkPhysicalDeviceProperties2 dev_props = {
     .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
-    .pNext = &rt_pipeline_props,
+    .pNext = &as_props,
   };
   vkGetPhysicalDeviceProperties2(physical_device, &dev_props);
     
@@ -394,76 +1126,58 @@ int main(void) {
 
   vkGetPhysicalDeviceFeatures2(physical_device, &dev_features);
 
-  //const char *asset_path = "./assets/spheres_cube_material.glb";
-  //const char *asset_path = "./assets/sponza/Sponza.gltf";
-  //const char *asset_path = "./assets/structure.glb";
-  const char *asset_path = "./assets/sponza_glb.glb";
   vkrt_model model = vkrt_load_gltf_model(device, allocator, graphics_queue,
-					  immediate_buf, asset_path);
-  
-  size_t geom_count = 0;
-  for (size_t i = 0; i < model.mesh_count; ++i) {
-    geom_count += model.meshes[i].primitive_count;
-  }
-
-  geometry_node *geom_nodes = calloc(sizeof(geometry_node), geom_count);
+					  immediate_buf, opts.asset_path, opts.detect_spheres);
 
-  size_t idx = 0;
-  for (uint32_t i = 0; i < model.mesh_count; ++i) {
-    vkrt_mesh mesh = model.meshes[i];
-    for (uint32_t j = 0; j < mesh.primitive_count; ++j) {      
-      geom_nodes[idx++] = (geometry_node) {
-	mesh.primitives[j].vertex_buffer.device_address,
-	mesh.primitives[j].index_buffer.device_address,
-	mesh.primitives[j].material_index,
-      };
-    }
+  if (opts.host_build_threads > 0 && !host_build_supported) {
+    fprintf(stderr, "Host acceleration structure builds aren't supported, "
+	    "building on the device\n");
+    opts.host_build_threads = 0;
   }
-
-  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-  
-  vkrt_memory geometry_nodes =
-    vkrt_allocate_memory(device, allocator, geom_count * sizeof(*geom_nodes),
-			 geom_nodes, usage);
-      
-  printf("Loaded: %lu meshes\n", geom_count);
+  // before the scene, which copies the light indices into its geometry nodes
+  // an environment map lights the scene by itself, no stand in light needed
+  vkrt_lights lights = vkrt_lights_build(device, allocator, &model, opts.env_path == NULL);
+  printf("%u light triangles, %.2f total power\n", lights.count, lights.total_power);
+  if (lights.fallback) {
+    printf("No material emits, using material %d as the light\n", VKRT_LIGHT_MATERIAL);
+  }
+  vkrt_env env = vkrt_env_load(device, allocator, immediate_buf, graphics_queue,
+			       opts.env_path, opts.env_strength);
+  if (opts.env_path) {
+    printf("Environment map: %ux%u\n", env.width, env.height);
+  }
+  vkrt_instance_generator instance_gen = vkrt_instance_generator_create(device);
+  vkrt_scene scene = vkrt_scene_build(device, allocator, graphics_queue,
+				      immediate_buf, &model, opts.blas_policy,
+				      opts.as_profiles, opts.host_build_threads,
+				      opts.cpu_instances ? NULL : &instance_gen,
+				      as_props.minAccelerationStructureScratchOffsetAlignment);
+  printf("Loaded: %u geometries into %u blases (%s) in %.1f ms on the %s\n",
+	 scene.geom_count, scene.blas_count, vkrt_blas_policy_names[scene.policy],
+	 scene.build_ms, scene.host_threads ? "host" : "device");
   fflush(stdout);
 
-  free(geom_nodes);
-  
-  vkrt_as *blases = calloc(sizeof(vkrt_as), geom_count);
-
-  idx = 0;
-  for (uint32_t i = 0; i < model.mesh_count; ++i) {
-    vkrt_mesh mesh = model.meshes[i];
-    vkrt_memory transform_buffer = mesh.transform_buffer;
-    for (uint32_t j = 0; j < mesh.primitive_count; ++j) {
-      vkrt_primitive p = mesh.primitives[j];
-      blases[idx++] = vkrt_create_blas3(device, allocator, graphics_queue,
-      					immediate_buf, p.vertex_buffer,
-      					p.index_buffer, p.primitive_count,
-					p.vertex_count, transform_buffer);
-    }
-  }
-
-  // create tlas
-  vkrt_as tlas;
-
-  VkTransformMatrixKHR transform = {
-    .matrix = {
-      1, 0, 0, 0,
-      0, 1, 0, 0,
-      0, 0, 1, 0,
-    },
-  };
-
-  tlas = vkrt_create_tlas(device, allocator, graphics_queue, immediate_buf,
-			  geom_count, blases, transform);
+  // rays traced per frame slot, written by the ray generation shader
+  vkrt_memory ray_stats =
+    vkrt_allocate_memory(device, allocator, FRAME_OVERLAP * sizeof(vkrt_ray_stats), NULL,
+			 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  memset(ray_stats.info.pMappedData, 0, FRAME_OVERLAP * sizeof(vkrt_ray_stats));
+  VK_CHECK(vmaFlushAllocation(allocator, ray_stats.allocation, 0, VK_WHOLE_SIZE));
+  vkrt_memory blue_noise = vkrt_blue_noise_create(device, allocator);
+  vkrt_aux_images aux = vkrt_aux_images_create(device, allocator, draw_extent);
+  vkrt_history history = vkrt_history_create(device, allocator, immediate_buf,
+					     graphics_queue, draw_extent, FRAME_OVERLAP);
+  vkrt_adaptive adaptive = vkrt_adaptive_create(device, allocator, immediate_buf,
+						graphics_queue, &ds_alloc, draw_image,
+						ray_stats);
+  adaptive.max_error = opts.adaptive_error;
+  adaptive.min_frames = opts.adaptive_min_frames;
 
   // descriptor set layout
   VkDescriptorSetLayout rt_layout;
   VkDescriptorSet rt_set;
+  vkrt_wavefront wavefront;
   {
     vkw_descriptor_layout_builder b = {};
     vkw_descriptor_layout_builder_add(&b, 0, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR);
@@ -472,31 +1186,80 @@ int main(void) {
     vkw_descriptor_layout_builder_add(&b, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
     vkw_descriptor_layout_builder_add2(&b, 4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
 				       model.texture_count);
-    rt_layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_RAYGEN_BIT_KHR
-					    | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+    vkw_descriptor_layout_builder_add(&b, 5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 7, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 8, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    vkw_descriptor_layout_builder_add(&b, 9, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    vkw_descriptor_layout_builder_add(&b, 10, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 11, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    vkw_descriptor_layout_builder_add(&b, 12, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    vkw_descriptor_layout_builder_add(&b, 13, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    vkw_descriptor_layout_builder_add(&b, 14, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 15, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 16, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    vkw_descriptor_layout_builder_add(&b, 17, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    vkw_descriptor_layout_builder_add(&b, 18, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    // the wavefront passes are compute shaders on the same set, and so is
+    // everything with the ray query backend
+    rt_layout = vkw_descriptor_layout_build(&b, device,
+					    opts.backend == vkrt_backend_ray_query ?
+					    VK_SHADER_STAGE_COMPUTE_BIT :
+					    VK_SHADER_STAGE_RAYGEN_BIT_KHR
+					    | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
+					    | VK_SHADER_STAGE_ANY_HIT_BIT_KHR
+					    | VK_SHADER_STAGE_INTERSECTION_BIT_KHR
+					    | VK_SHADER_STAGE_COMPUTE_BIT);
 
     rt_set = 
       vkw_descriptor_allocator_alloc(&ds_alloc, device, rt_layout);
+    wavefront = vkrt_wavefront_create(device, allocator, rt_set, draw_extent,
+				      model.material_count);
+    wavefront.sort_materials = opts.wavefront_sort;
 
     // HACK
-    // since we only want to write 5 things, but need auxilliary space for
-    // 4 + model.texture_count items, this is the only way to do this with the
+    // since we only want to write 19 things, but need auxilliary space for
+    // 18 + model.texture_count items, this is the only way to do this with the
     // current, naive api
     // TODO FIXME
-    vkrt_ds_writer writer = vkrt_ds_writer_create(4 + model.texture_count, rt_set);
-    writer.ds_count = 5;
-    vkrt_ds_writer_add_as(&writer, 0, &tlas.as);
+    vkrt_ds_writer writer = vkrt_ds_writer_create(19 + model.texture_count, rt_set);
+    writer.ds_count = 19;
     vkrt_ds_writer_add_image(&writer, 1, draw_image.view);
-    vkrt_ds_writer_add_buffer(&writer, 2, geometry_nodes.buffer, 0, VK_WHOLE_SIZE);
     vkrt_ds_writer_add_buffer(&writer, 3, model.materials_buffer.buffer, 0, VK_WHOLE_SIZE);
     vkrt_ds_writer_add_sampled_images(&writer, 4, model.texture_count, model.textures);
+    vkrt_ds_writer_add_buffer(&writer, 5, ray_stats.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_buffer(&writer, 6, lights.buffer.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_buffer(&writer, 7, blue_noise.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_image(&writer, 8, aux.albedo.view);
+    vkrt_ds_writer_add_image(&writer, 9, aux.normal_depth.view);
+    vkrt_ds_writer_add_buffer(&writer, 10, history.cameras.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_image(&writer, 11, history.colour.view);
+    vkrt_ds_writer_add_image(&writer, 12, history.normal_depth.view);
+    vkrt_ds_writer_add_image(&writer, 13, adaptive.moments.view);
+    vkrt_ds_writer_add_buffer(&writer, 14, adaptive.pixels.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_buffer(&writer, 15, wavefront.paths.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_buffer(&writer, 16, wavefront.queues.buffer, 0, VK_WHOLE_SIZE);
+    vkrt_ds_writer_add_sampled_images(&writer, 17, 1, &env.image);
+    vkrt_ds_writer_add_buffer(&writer, 18, env.buffer.buffer, 0, VK_WHOLE_SIZE);
 
     vkrt_ds_writer_write(device, writer);
 
     vkrt_ds_writer_free(&writer);
+
+    vkrt_scene_write_descriptors(device, rt_set, &scene, 0, 2);
   }
+  // also moves the aux images into the general layout the tracer writes them in
+  vkrt_denoiser denoiser = vkrt_denoiser_create(device, allocator, immediate_buf,
+						graphics_queue, &ds_alloc, draw_image, aux);
+  vkrt_display display = vkrt_display_create(device, &ds_alloc, FRAME_OVERLAP);
+  display.op = opts.tonemap;
+  display.exposure = opts.exposure;
   // pipeline layout
   VkPipelineLayout rt_pipeline_layout;
+  VkShaderStageFlags rt_push_constant_stages = opts.backend == vkrt_backend_ray_query ?
+    VK_SHADER_STAGE_COMPUTE_BIT :
+    VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR | VK_SHADER_STAGE_ANY_HIT_BIT_KHR |
+    VK_SHADER_STAGE_RAYGEN_BIT_KHR;
   {
     VkPipelineLayoutCreateInfo pipeline_layout_info = {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
@@ -506,168 +1269,57 @@ int main(void) {
       .pPushConstantRanges = &(VkPushConstantRange) {
 	.offset = 0,
 	.size = sizeof(push_constants_t),
-	.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR
-	| VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+	.stageFlags = rt_push_constant_stages,
       }
     };
 
     VK_CHECK(vkCreatePipelineLayout(device, &pipeline_layout_info, NULL,
 				    &rt_pipeline_layout));
   }
-  // pipeline
-  VkPipeline rt_pipeline;
-  {
-    VkShaderModule raygen_sh;
-    VkShaderModule closest_hit_sh;
-    VkShaderModule miss_sh;
-    if (!vkh_load_shader_module("./shaders/ray_gen.spv",     device, &raygen_sh) ||
-	!vkh_load_shader_module("./shaders/closest_hit.spv", device, &closest_hit_sh) ||
-	!vkh_load_shader_module("./shaders/miss.spv",        device, &miss_sh)) {
-      fprintf(stderr, "Failed to load a raytracing shader - please check they exist\n");
-      exit(1);
-    }
-	
-    VkPipelineShaderStageCreateInfo rgen_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-      .stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
-      .module = raygen_sh,
-      .pName = "main",
-    };
-
-    VkPipelineShaderStageCreateInfo rchit_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-      .stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
-      .module = closest_hit_sh,
-      .pName = "main",
-    };
-
-    VkPipelineShaderStageCreateInfo rmiss_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-      .stage = VK_SHADER_STAGE_MISS_BIT_KHR,
-      .module = miss_sh,
-      .pName = "main",
-    };
-
-    VkPipelineShaderStageCreateInfo stages[3] = {rgen_info, rmiss_info, rchit_info};
-
-    VkRayTracingShaderGroupCreateInfoKHR rgen_group = {
-      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
-      .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
-      .generalShader = 0, // index into stages
-      .closestHitShader = VK_SHADER_UNUSED_KHR,
-      .anyHitShader = VK_SHADER_UNUSED_KHR,
-      .intersectionShader = VK_SHADER_UNUSED_KHR,
-    };
-
-    VkRayTracingShaderGroupCreateInfoKHR rmiss_group = {
-      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
-      .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
-      .generalShader = 1, // index into stages
-      .closestHitShader = VK_SHADER_UNUSED_KHR,
-      .anyHitShader = VK_SHADER_UNUSED_KHR,
-      .intersectionShader = VK_SHADER_UNUSED_KHR,
-    };
-
-    VkRayTracingShaderGroupCreateInfoKHR rhit_group = {
-      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
-      .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR,
-      .generalShader = VK_SHADER_UNUSED_KHR,
-      .closestHitShader = 2,
-      .anyHitShader = VK_SHADER_UNUSED_KHR,
-      .intersectionShader = VK_SHADER_UNUSED_KHR,
-    };
-
-    VkRayTracingShaderGroupCreateInfoKHR shader_groups[3] = {
-      rgen_group, rmiss_group, rhit_group
-    };
-
-    VkRayTracingPipelineCreateInfoKHR pipeline_info = {
-      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR,
-      .stageCount = 3,
-      .pStages = stages,
-      .groupCount = 3,
-      .pGroups = shader_groups,
-      .maxPipelineRayRecursionDepth = 2,
-      .layout = rt_pipeline_layout,
-    };
-
-    VK_CHECK(vkCreateRayTracingPipelinesKHRp(device, NULL, NULL, 1, &pipeline_info,
-					    NULL, &rt_pipeline));
-    vkDestroyShaderModule(device, raygen_sh, NULL);
-    vkDestroyShaderModule(device, miss_sh, NULL);
-    vkDestroyShaderModule(device, closest_hit_sh, NULL);
-  }
-  // shader binding table
-  uint64_t sbt_handle_size = rt_pipeline_props.shaderGroupHandleSize;
-  uint64_t sbt_handle_alignment = rt_pipeline_props.shaderGroupHandleAlignment;
-  uint64_t sbt_handle_size_aligned =
-    (sbt_handle_size + sbt_handle_alignment - 1) & ~(sbt_handle_alignment - 1);
-  uint64_t sbt_size = 3 * sbt_handle_size_aligned; // 3 from the number of shader groups
-
-  vkrt_memory sbt_rgen_buffer;
-  vkrt_memory sbt_rmiss_buffer;
-  vkrt_memory sbt_rchit_buffer;
-
-  VkStridedDeviceAddressRegionKHR rgen_sbt;
-  VkStridedDeviceAddressRegionKHR rmiss_sbt;
-  VkStridedDeviceAddressRegionKHR rchit_sbt;
-  VkStridedDeviceAddressRegionKHR rcall_sbt = {};
-  {
-    uint8_t *sbt_results = calloc(sbt_size, 1);
-    VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR |
-      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
-    VK_CHECK(vkGetRayTracingShaderGroupHandlesKHRp(device, rt_pipeline, 0, 3,
-						  sbt_size, sbt_results));
-
-    // NOTE: these are in the same order as our shader groups above!
-    sbt_rgen_buffer = vkrt_allocate_memory(device, allocator, sbt_handle_size,
-					   sbt_results, usage);
-    rgen_sbt.deviceAddress = sbt_rgen_buffer.device_address;
-    rgen_sbt.size = sbt_handle_size_aligned;
-    rgen_sbt.stride = sbt_handle_size_aligned;
-
-    sbt_rmiss_buffer = vkrt_allocate_memory(device, allocator, sbt_handle_size,
-					   sbt_results + sbt_handle_size_aligned, usage);
-    rmiss_sbt.deviceAddress = sbt_rmiss_buffer.device_address;
-    rmiss_sbt.size = sbt_handle_size_aligned;
-    rmiss_sbt.stride = sbt_handle_size_aligned;
-
-    sbt_rchit_buffer = vkrt_allocate_memory(device, allocator, sbt_handle_size,
-					   sbt_results + sbt_handle_size_aligned * 2, usage);
-    rchit_sbt.deviceAddress = sbt_rchit_buffer.device_address;
-    rchit_sbt.size = sbt_handle_size_aligned;
-    rchit_sbt.stride = sbt_handle_size_aligned;
+  // pipelines, one per vkrt_specialization in use
+  vkrt_pipelines pipelines =
+    vkrt_pipelines_create(device, allocator, rt_pipeline_layout, rt_layout, rt_set,
+			  rt_push_constant_stages, sizeof(push_constants_t),
+			  rt_pipeline_props, opts.backend,
+			  offsetof(push_constants_t, launch_size));
+  vkrt_pipelines_set_hit_groups(&pipelines, scene.geom_count, scene.geom_hit_group);
+  printf("Tracing with the %s backend\n", vkrt_backend_names[opts.backend]);
+  // the wavefront and adaptive launches are sized on the gpu, which only the
+  // ray tracing pipeline can do
+  bool rt_pipeline = opts.backend == vkrt_backend_pipeline;
+  if (!rt_pipeline && (opts.wavefront || opts.adaptive)) {
+    fprintf(stderr, "The wavefront and adaptive sampling need the pipeline backend\n");
+    opts.wavefront = opts.adaptive = false;
   }
+  vkrt_specialization spec = {
+    .max_depth = opts.max_depth,
+    .samples = opts.spp,
+  };
 
   vkw_frame_data frames[FRAME_OVERLAP];
+  vkw_gpu_timer frame_timers[FRAME_OVERLAP];
   {
     for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
       frames[i] = vkw_frame_data_create(device, graphics_queue_family);
+      frame_timers[i] = vkw_gpu_timer_create(device, physical_device, 6);
     }
   }
 
   push_constants_t push_constants = {
     .e = {20, 20, 10, 0},
+    .ray_flags = alpha_test_ray_flags[opts.alpha_test],
+    .nee = !opts.no_nee,
+    .rr_min_depth = opts.rr_min_depth,
+    .sampler_mode = opts.sampler,
+    .history_max = opts.history_frames,
   };
 
   HMM_Vec3 camera_pos = {0, 2, 5};
-  HMM_Mat4 view, proj, inv_proj;
   float theta = 0, phi = 0;
-  /*
-  HMM_Mat4 view = HMM_Translate((HMM_Vec3){0, 2, 3});
-  //view = HMM_MulM4(view, HMM_Rotate_RH(M_PI, (HMM_Vec3){0, 1, 0}));
-  HMM_Mat4 proj = HMM_Perspective_RH_ZO(90.f * M_PI / 180.f,
-					(float)draw_extent.width/draw_extent.height,
-					100.f, 0.1f);
-  
-  HMM_Mat4 inv_proj = HMM_InvPerspective_RH(proj);
-  view.Elements[1][1] *= -1;
 
-  memcpy(&push_constants.view, &view, 16*sizeof(float));
-  memcpy(&push_constants.proj, &inv_proj, 16*sizeof(float));
-  */  
   bool done = false;
   uint32_t frame_number = 0;
+  uint32_t accum_frames = 0;
 
   uint32_t timeout = 1000000000;
 
@@ -675,9 +1327,141 @@ int main(void) {
   bool reset_accumulation = false;
   
   uint32_t ticks_frame = 0, ticks_prev = 0;
+  double gpu_trace_ms = 0, gpu_mrays = 0, gpu_tlas_ms = 0;
+  double gpu_deform_ms = 0, gpu_refit_ms = 0, gpu_denoise_ms = 0;
+  uint32_t gpu_any_hits = 0, gpu_rays = 0, gpu_shadow_rays = 0;
+  int alpha_test = opts.alpha_test;
+  bool count_any_hits = false;
+  int blas_policy = scene.policy;
+  vkrt_as_profiles as_profiles = opts.as_profiles;
+  int tlas_rebuild_interval = opts.tlas_rebuild_interval;
+  int host_build_threads = opts.host_build_threads;
+
+  vkrt_animator animator = vkrt_animator_create(model.gltf);
+  bool animate = vkrt_animator_playing(&animator);
+  float anim_time = 0, anim_speed = 1;
+  vkrt_deformer deformer = vkrt_deformer_create(device, allocator, &model);
+  int picked_instance = 0;
+  bool instances_moved = false;
+  int tile_size = opts.tile_size;
+  int tiles_per_frame = opts.tiles_per_frame;
+  int tile_order = opts.tile_order;
+  vkrt_tiler tiler = {};
+  if (tile_size > 0) { tiler = vkrt_tiler_create(draw_extent, tile_size); }
+  vkrt_dispatch_budget budget = {
+    .budget_ms = opts.frame_budget_ms,
+    .max_launches = 64,
+  };
+  bool use_budget = opts.frame_budget_ms > 0;
+  if (budget.budget_ms <= 0) { budget.budget_ms = 14; }
+  uint32_t frame_launches[FRAME_OVERLAP] = {};
+  bool denoise = opts.denoise;
+  int denoise_iterations = opts.denoise_iterations;
+  bool temporal = !opts.no_temporal;
+  int history_frames = opts.history_frames;
+  // the camera of the last frame, to notice it moving
+  push_constants_t prev_camera = {};
+  // frames the image is made of as the denoiser sees it, capped like the
+  // history when the camera moves
+  uint32_t denoise_frames = 0;
+  bool use_adaptive = opts.adaptive;
+  bool use_wavefront = opts.wavefront;
+  // the active pixel counts come back FRAME_OVERLAP frames late, render_id
+  // tells whether they're from before the image was last restarted
+  uint32_t render_id = 0;
+  uint32_t slot_render_id[FRAME_OVERLAP] = {};
+  uint32_t adaptive_launches[FRAME_OVERLAP] = {};
+  double active_fraction = 1;
+  bool converged = false;
+  uint32_t converged_frames = 0;
+
+  // the draw image keeps its contents between frames to accumulate into, it
+  // sits in the general layout whenever it isn't being copied out
+  {
+    VkCommandBuffer cmd = vkw_immediate_begin(device, immediate_buf);
+    vkh_transition_image(cmd, draw_image.image, VK_IMAGE_LAYOUT_UNDEFINED,
+			 VK_IMAGE_LAYOUT_GENERAL);
+    vkw_immediate_end(device, immediate_buf, graphics_queue);
+  }
+
+  if (headless) {
+    vkrt_bench bench = {
+      .device = device,
+      .allocator = allocator,
+      .queue = graphics_queue,
+      .immediate = immediate_buf,
+      .timer = vkw_gpu_timer_create(device, physical_device, 2),
+      .ray_stats = ray_stats,
+    };
+    trace_bench_state st = {
+      .tracer = vkrt_pipelines_get(&pipelines, spec, vkrt_raygen_path),
+      .pcs = &push_constants,
+      .image = draw_image.image,
+      .extent = draw_extent,
+      .wavefront = opts.wavefront ? &wavefront : NULL,
+      .variant = vkrt_pipelines_get_variant(&pipelines, spec),
+    };
+    update_camera(&push_constants, camera_pos, theta, phi, draw_extent);
+
+    if (opts.bench_alpha) {
+      run_alpha_bench(&bench, &st, opts);
+    }
+    if (opts.bench_nee) {
+      run_nee_bench(device, allocator, &bench, &st, opts);
+    }
+    if (opts.bench_roulette) {
+      run_roulette_bench(&bench, &st, opts);
+    }
+    if (opts.bench_sampler) {
+      run_sampler_bench(device, allocator, &bench, &st, opts);
+    }
+    if (opts.bench_adaptive && rt_pipeline) {
+      run_adaptive_bench(device, allocator, &bench, &st, &adaptive, opts);
+    }
+    if (opts.bench_wavefront && rt_pipeline) {
+      run_wavefront_bench(&bench, &st, &wavefront, opts);
+    }
+    if (opts.bench_instance_runs > 0) {
+      run_instance_bench(device, allocator, rt_set, &scene, &model, &bench, &st, opts);
+      update_camera(&push_constants, camera_pos, theta, phi, draw_extent);
+    }
+
+    char blas_profile[128], tlas_profile[128];
+    vkrt_as_flags_to_string(opts.as_profiles.static_blas, blas_profile,
+			    sizeof(blas_profile));
+    vkrt_as_flags_to_string(opts.as_profiles.tlas, tlas_profile,
+			    sizeof(tlas_profile));
+
+    if (opts.bench_blas) {
+      printf("asset,policy,blas_profile,tlas_profile,host_threads,blases,build_ms,"
+	     "blas_mb,tlas_mb,frames,gpu_ms_per_frame,mrays_per_s\n");
+    }
+    for (uint32_t p = 0; opts.bench_blas && p < vkrt_blas_policy_count; ++p) {
+      if (p != scene.policy) {
+	vkrt_scene_rebuild(device, allocator, graphics_queue, immediate_buf, &model,
+			   &scene, p, opts.as_profiles, opts.host_build_threads,
+			   scene.instance_gen);
+	vkrt_scene_write_descriptors(device, rt_set, &scene, 0, 2);
+	vkrt_pipelines_set_hit_groups(&pipelines, scene.geom_count, scene.geom_hit_group);
+      }
+      // warm up, then measure
+      vkrt_bench_run(&bench, 4, record_trace_bench, &st);
+      vkrt_bench_result r = vkrt_bench_run(&bench, opts.bench_frames,
+					   record_trace_bench, &st);
+      printf("%s,%s,%s,%s,%u,%u,%.3f,%.3f,%.3f,%u,%.3f,%.2f\n", opts.asset_path,
+	     vkrt_blas_policy_names[p], blas_profile, tlas_profile,
+	     scene.host_threads, scene.blas_count, scene.build_ms,
+	     scene.blas_bytes / (1024.0 * 1024.0), scene.tlas_bytes / (1024.0 * 1024.0),
+	     r.frames, vkrt_bench_ms_per_frame(r), vkrt_bench_mrays(r));
+      fflush(stdout);
+    }
+    vkw_gpu_timer_destroy(device, bench.timer);
+    done = true;
+  }
+
   for (;!done; frame_number++) {
     if (reset_accumulation) {
-      frame_number = 0;
+      accum_frames = 0;
       reset_accumulation = false;
     }
     ticks_prev = ticks_frame;
@@ -686,7 +1470,7 @@ int main(void) {
     if (swapchain_resize) {
       vkDeviceWaitIdle(device);
       vki_destroy_swapchain(device, swapchain);
-      swapchain = build_swapchain(device, physical_device, surface);
+      swapchain = build_swapchain(device, physical_device, surface, display_compute);
       swapchain_resize = false;
     }
     
@@ -703,7 +1487,8 @@ int main(void) {
       }
     } 
     
-    vkw_frame_data curr = frames[frame_number % 2];
+    uint32_t frame_slot = frame_number % FRAME_OVERLAP;
+    vkw_frame_data curr = frames[frame_slot];
     
     // imgui
     {
@@ -713,6 +1498,180 @@ int main(void) {
       if (igBegin("background", NULL, 0)) {
 	igText("Frame time: %d", ticks_frame - ticks_prev);
 	igText("Average frame time: %f", (float)ticks_frame/frame_number);
+	igText("GPU trace: %.2f ms (%.1f Mrays/s, %.0f%% shadow rays)", gpu_trace_ms,
+	       gpu_mrays, gpu_rays ? 100.0 * gpu_shadow_rays / gpu_rays : 0);
+	igText("TLAS update: %.3f ms", gpu_tlas_ms);
+	if (igCombo_Str_arr("alpha test", &alpha_test, alpha_test_mode_names,
+			    alpha_test_mode_count, -1)) {
+	  push_constants.ray_flags = alpha_test_ray_flags[alpha_test];
+	  reset_accumulation = true;
+	}
+	igCheckbox("count any-hit calls", &count_any_hits);
+	bool nee = push_constants.nee;
+	if (igCheckbox("next event estimation", &nee)) {
+	  push_constants.nee = nee;
+	  reset_accumulation = true;
+	}
+	int sampler = push_constants.sampler_mode;
+	if (igCombo_Str_arr("sampler", &sampler, vkrt_sampler_names, vkrt_sampler_count,
+			    -1)) {
+	  push_constants.sampler_mode = sampler;
+	  reset_accumulation = true;
+	}
+	int spp = spec.samples;
+	if (igSliderInt("samples per pixel", &spp, 1, 64, NULL, 0)) {
+	  spec.samples = spp;
+	  reset_accumulation = true;
+	  budget.ms_per_launch = 0; // launches cost something else now, measure again
+	}
+	if (igInputInt("tile size (0 = off)", &tile_size, 32, 128, 0)) {
+	  if (tile_size < 0) { tile_size = 0; }
+	  vkrt_tiler_destroy(&tiler);
+	  if (tile_size > 0) { tiler = vkrt_tiler_create(draw_extent, tile_size); }
+	  reset_accumulation = true;
+	  budget.ms_per_launch = 0;
+	}
+	igCheckbox("frame budget", &use_budget);
+	if (use_budget) {
+	  igSliderFloat("budget (ms)", &budget.budget_ms, 1, 100, "%.1f", 0);
+	  igText("%u launches per frame, %.3f ms each", budget.launches,
+		 budget.ms_per_launch);
+	}
+	if (tile_size > 0) {
+	  igSliderInt("tiles per frame", &tiles_per_frame, 1, 64, NULL, 0);
+	  igCombo_Str_arr("tile order", &tile_order, vkrt_tile_order_names,
+			  vkrt_tile_order_count, -1);
+	  igText("Pass %u: %u/%u tiles", accum_frames, tiler.next, tiler.count);
+	}
+	igCheckbox("denoise", &denoise);
+	if (denoise) {
+	  igSliderInt("denoise iterations", &denoise_iterations, 1, 5, NULL, 0);
+	  igSliderFloat("colour phi", &denoiser.colour_phi, 0.01f, 10, "%.2f", 0);
+	  igText("Denoise: %.3f ms", gpu_denoise_ms);
+	}
+	if (display_compute) {
+	  int tonemap = display.op;
+	  if (igCombo_Str_arr("tonemap", &tonemap, vkrt_tonemap_names, vkrt_tonemap_count,
+			      -1)) {
+	    display.op = tonemap;
+	  }
+	  igSliderFloat("exposure", &display.exposure, 0.05f, 16, "%.2f",
+			ImGuiSliderFlags_Logarithmic);
+	}
+	igCheckbox("temporal reprojection", &temporal);
+	if (temporal) {
+	  igSliderInt("history frames", &history_frames, 1, 256, NULL, 0);
+	  if (tile_size > 0) {
+	    igText("(tiled passes restart on camera moves)");
+	  }
+	}
+	if (rt_pipeline && igCheckbox("wavefront", &use_wavefront)) {
+	  reset_accumulation = true;
+	}
+	if (use_wavefront) {
+	  if (igCheckbox("sort by material", &wavefront.sort_materials)) {
+	    reset_accumulation = true;
+	  }
+	  if (tile_size > 0) { igText("(not while tiling)"); }
+	}
+	if (rt_pipeline && igCheckbox("adaptive sampling", &use_adaptive)) {
+	  converged = false;
+	}
+	if (use_adaptive && tile_size > 0) {
+	  igText("(not while tiling)");
+	} else if (use_adaptive && use_wavefront) {
+	  igText("(not with the wavefront)");
+	} else if (use_adaptive) {
+	  if (igSliderFloat("target error", &adaptive.max_error, 0.001f, 0.2f, "%.3f",
+			    ImGuiSliderFlags_Logarithmic)) {
+	    converged = false;
+	  }
+	  igText("Active pixels: %.1f%%", active_fraction * 100.0);
+	  if (converged) { igText("Converged after %u frames", converged_frames); }
+	}
+	int max_depth = spec.max_depth;
+	int rr_min_depth = push_constants.rr_min_depth;
+	if (igSliderInt("max depth", &max_depth, 1, 32, NULL, 0)) {
+	  spec.max_depth = max_depth;
+	  reset_accumulation = true;
+	}
+	if (igSliderInt("roulette from depth", &rr_min_depth, 0, 32, NULL, 0)) {
+	  push_constants.rr_min_depth = rr_min_depth;
+	  reset_accumulation = true;
+	}
+	igText("Pipeline variants: %u cached, %u built", pipelines.count, pipelines.built);
+	if (count_any_hits) {
+	  igText("Any-hit: %u calls (%.3f per ray)", gpu_any_hits,
+		 gpu_rays ? (double)gpu_any_hits / gpu_rays : 0);
+	}
+	if (deformer.mesh_count > 0) {
+	  igText("Skinning: %.3f ms, BLAS refit: %.3f ms", gpu_deform_ms, gpu_refit_ms);
+	}
+	bool rebuild = igCombo_Str_arr("blas policy", &blas_policy,
+				       vkrt_blas_policy_names,
+				       vkrt_blas_policy_count, -1);
+	if (igTreeNode_Str("build profiles")) {
+	  VkBuildAccelerationStructureFlagsKHR *profiles[] = {
+	    &as_profiles.static_blas, &as_profiles.dynamic_blas, &as_profiles.tlas,
+	  };
+	  const char *labels[] = { "static blas", "dynamic blas", "tlas" };
+	  for (uint32_t i = 0; i < 3; ++i) {
+	    igText("%s", labels[i]);
+	    igPushID_Int(i);
+	    VkBuildAccelerationStructureFlagsKHR prev = *profiles[i];
+	    for (uint32_t j = 0; j < VKRT_AS_FLAG_NAME_COUNT; ++j) {
+	      igCheckboxFlags_UintPtr(vkrt_as_flag_names[j].name, profiles[i],
+				      vkrt_as_flag_names[j].flag);
+	    }
+	    // fast-trace and fast-build can't both be set, keep the new one
+	    VkBuildAccelerationStructureFlagsKHR both =
+	      VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+	      VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+	    if ((*profiles[i] & both) == both) {
+	      *profiles[i] &= ~(prev & both);
+	    }
+	    igPopID();
+	  }
+	  if (host_build_supported) {
+	    igInputInt("host build threads", &host_build_threads, 1, 4, 0);
+	    if (host_build_threads < 0) { host_build_threads = 0; }
+	  }
+	  rebuild |= igButton("rebuild", (ImVec2){0, 0});
+	  igTreePop();
+	}
+	if (rebuild) {
+	  vkrt_scene_rebuild(device, allocator, graphics_queue, immediate_buf, &model,
+			     &scene, blas_policy, as_profiles, host_build_threads,
+			     scene.instance_gen);
+	  vkrt_scene_write_descriptors(device, rt_set, &scene, 0, 2);
+	  // the geometry nodes may be ordered differently under the new policy
+	  vkrt_pipelines_set_hit_groups(&pipelines, scene.geom_count, scene.geom_hit_group);
+	  reset_accumulation = true;
+	}
+	igText("%u blases, built in %.1f ms (%s), %.1f MB blas / %.2f MB tlas",
+	       scene.blas_count, scene.build_ms,
+	       scene.host_threads ? "host" : "device",
+	       scene.blas_bytes / (1024.0 * 1024.0),
+	       scene.tlas_bytes / (1024.0 * 1024.0));
+	if (igTreeNode_Str("instances")) {
+	  if (vkrt_animator_playing(&animator)) {
+	    igCheckbox("animate", &animate);
+	    igInputFloat("speed", &anim_speed, 0.1, 1, NULL, 0);
+	  }
+	  igInputInt("rebuild interval", &tlas_rebuild_interval, 1, 10, 0);
+	  if (tlas_rebuild_interval < 1) { tlas_rebuild_interval = 1; }
+	  igSliderInt("instance", &picked_instance, 0, scene.blas_count - 1, NULL, 0);
+	  if (picked_instance >= (int)scene.blas_count) { picked_instance = 0; }
+	  VkTransformMatrixKHR *t = &scene.instance_transforms[picked_instance];
+	  float pos[3] = { t->matrix[0][3], t->matrix[1][3], t->matrix[2][3] };
+	  if (igDragFloat3("translation", pos, 0.01, 0, 0, "%.3f", 0)) {
+	    t->matrix[0][3] = pos[0];
+	    t->matrix[1][3] = pos[1];
+	    t->matrix[2][3] = pos[2];
+	    instances_moved = true;
+	  }
+	  igTreePop();
+	}
 	igInputFloat4("color", push_constants.e, NULL, 0);
 	igInputFloat3("pos", camera_pos.Elements, NULL, 0);
 	igInputFloat("theta", &theta, 0.01, 0.1, NULL, 0);
@@ -724,21 +1683,78 @@ int main(void) {
     }
 
     // update camera matrices
-    view = HMM_Translate(camera_pos);
-    view = HMM_MulM4(view, HMM_Rotate_RH(theta, (HMM_Vec3){0, 1, 0}));
-    view = HMM_MulM4(view, HMM_Rotate_RH(phi, (HMM_Vec3){1, 0, 0}));    
-    proj = HMM_Perspective_RH_ZO(90.f * M_PI / 180.f,
-					  (float)draw_extent.width/draw_extent.height,
-					  100.f, 0.1f);
-  
-    inv_proj = HMM_InvPerspective_RH(proj);
-    view.Elements[1][1] *= -1;
+    update_camera(&push_constants, camera_pos, theta, phi, draw_extent);
 
-    memcpy(&push_constants.view, &view, 16*sizeof(float));
-    memcpy(&push_constants.proj, &inv_proj, 16*sizeof(float));
+    vkw_frame_cmd_begin(device, curr, timeout);
 
+    bool tlas_dirty = instances_moved;
+    instances_moved = false;
+    if (animate) {
+      anim_time += anim_speed * (ticks_frame - ticks_prev) / 1000.f;
+      vkrt_animator_sample(&animator, anim_time);
+      tlas_dirty |= vkrt_scene_animate(&scene, &model, &animator);
+    }
+    // deformed meshes change their blas bounds, so the tlas has to follow
+    bool deform = animate && deformer.mesh_count > 0;
+    tlas_dirty |= deform;
+    if (tlas_dirty) {
+      accum_frames = 0;
+    }
+    // a moved camera keeps what it can of the image through reprojection, a
+    // tiled pass would mix two cameras so that starts over
+    bool camera_moved =
+      memcmp(prev_camera.view, push_constants.view, sizeof(push_constants.view)) != 0 ||
+      memcmp(prev_camera.proj, push_constants.proj, sizeof(push_constants.proj)) != 0;
+    bool reproject = false;
+    if (camera_moved && accum_frames > 0) {
+      if (temporal && tile_size <= 0) {
+	reproject = true;
+	vkrt_history_set_camera(allocator, &history, frame_slot, push_constants.view,
+				push_constants.proj, prev_camera.view, prev_camera.proj);
+	if (denoise_frames > (uint32_t)history_frames) { denoise_frames = history_frames; }
+      } else {
+	accum_frames = 0;
+      }
+    }
+    if (accum_frames == 0 || reproject) {
+      render_id++;
+      converged = false;
+    }
+
+    // this slot's previous frame has finished, so its timings and ray count
+    // can be read back before they get reused
+    {
+      uint64_t ticks[6];
+      vkrt_ray_stats *stats = ray_stats.info.pMappedData;
+      VK_CHECK(vmaInvalidateAllocation(allocator, ray_stats.allocation, 0,
+				       VK_WHOLE_SIZE));
+      if (vkw_gpu_timer_read(device, &frame_timers[frame_slot], ticks)) {
+	gpu_deform_ms = vkw_gpu_timer_ms(frame_timers[frame_slot], ticks, 0, 1);
+	gpu_refit_ms = vkw_gpu_timer_ms(frame_timers[frame_slot], ticks, 1, 2);
+	gpu_tlas_ms = vkw_gpu_timer_ms(frame_timers[frame_slot], ticks, 2, 3);
+	gpu_trace_ms = vkw_gpu_timer_ms(frame_timers[frame_slot], ticks, 3, 4);
+	gpu_denoise_ms = vkw_gpu_timer_ms(frame_timers[frame_slot], ticks, 4, 5);
+	gpu_mrays = gpu_trace_ms > 0 ?
+	  (stats[frame_slot].rays + stats[frame_slot].shadow_rays) / (gpu_trace_ms * 1000.0) : 0;
+	vkrt_dispatch_budget_update(&budget, gpu_trace_ms, frame_launches[frame_slot]);
+      }
+      gpu_rays = stats[frame_slot].rays + stats[frame_slot].shadow_rays;
+      gpu_shadow_rays = stats[frame_slot].shadow_rays;
+      gpu_any_hits = stats[frame_slot].any_hits;
+      // nothing left above the error means the render is done
+      if (adaptive_launches[frame_slot] > 0 && slot_render_id[frame_slot] == render_id) {
+	uint64_t pixels = (uint64_t)draw_extent.width * draw_extent.height;
+	active_fraction = (double)stats[frame_slot].active_pixels /
+	  ((double)adaptive_launches[frame_slot] * pixels);
+	if (stats[frame_slot].active_pixels == 0 && !converged) {
+	  converged = true;
+	  converged_frames = accum_frames;
+	}
+      }
+      stats[frame_slot] = (vkrt_ray_stats){};
+      VK_CHECK(vmaFlushAllocation(allocator, ray_stats.allocation, 0, VK_WHOLE_SIZE));
+    }
 
-    vkw_frame_cmd_begin(device, curr, timeout);
     //printf("Starting frame: %u\n", frame_number);
     //fflush(stdout);
     uint32_t image_index;
@@ -750,33 +1766,135 @@ int main(void) {
     }
     
     VkCommandBuffer cmd = curr.buf;
-    vkh_transition_image(cmd, draw_image.image, VK_IMAGE_LAYOUT_UNDEFINED,
+    // orders this frame's launches after the previous frame's
+    vkh_transition_image(cmd, draw_image.image, VK_IMAGE_LAYOUT_GENERAL,
 			 VK_IMAGE_LAYOUT_GENERAL);
 
-    // raytracing
-    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rt_pipeline);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
-			    rt_pipeline_layout, 0, 1, &rt_set, 0, 0);
-
-    push_constants.frame_no = frame_number;
-    vkCmdPushConstants(cmd, rt_pipeline_layout, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR |
-		       VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(push_constants_t),
-		       &push_constants);
-
-    vkCmdTraceRaysKHRp(cmd, &rgen_sbt, &rmiss_sbt, &rchit_sbt, &rcall_sbt,
-		      draw_image.extent.width, draw_image.extent.height, 1);
+    vkw_gpu_timer_reset(cmd, &frame_timers[frame_slot]);
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 0);
+    if (deform) {
+      vkrt_deformer_update(allocator, &deformer, &model, &animator, frame_slot);
+      vkrt_deformer_record(cmd, &deformer, &model, frame_slot);
+    }
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 1);
+    if (deform) {
+      vkrt_scene_record_blas_refits(cmd, &scene, deformer.mesh_deformed);
+    }
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 2);
+    if (tlas_dirty) {
+      vkrt_scene_record_tlas_update(allocator, cmd, &scene, frame_slot,
+				    tlas_rebuild_interval);
+    }
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 3);
 
-    vkh_transition_image(cmd, draw_image.image, VK_IMAGE_LAYOUT_GENERAL,
-			 VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-    vkh_transition_image(cmd, swapchain.images[image_index],
-			 VK_IMAGE_LAYOUT_UNDEFINED,
-			 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    vkh_copy_image_to_image(cmd, draw_image.image,
-			    swapchain.images[image_index], draw_extent,
-			    swapchain.extent);
-    vkh_transition_image(cmd, swapchain.images[image_index],
-			 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    // raytracing
+    vkrt_tracer *tracer = vkrt_pipelines_get(&pipelines, spec, vkrt_raygen_path);
+    push_constants.stats_slot = frame_slot;
+    push_constants.count_any_hits = count_any_hits;
+    // a launch is the whole image, or one tile when tiling
+    uint32_t launches = tile_size > 0 ? tiles_per_frame : 1;
+    if (use_budget) {
+      launches = vkrt_dispatch_budget_launches(&budget, gpu_deform_ms + gpu_refit_ms +
+					       gpu_tlas_ms);
+    }
+    if (converged) { launches = 0; }
+    frame_launches[frame_slot] = launches;
+    push_constants.history_max = history_frames;
+    uint32_t adaptive_count = 0;
+    if (reproject) {
+      vkrt_history_record_save(cmd, &history, draw_image.image, aux.normal_depth.image,
+			       draw_extent);
+    }
+    for (uint32_t l = 0; l < launches; ++l) {
+      // only the first launch looks back at the old camera
+      push_constants.reproject = reproject && l == 0;
+      // accum_frames counts the passes started, so every tile of a pass gets
+      // the same frame_no and a reset (which zeroes it) starts a new pass.
+      // without tiling every launch is a pass of its own
+      bool new_pass = tile_size <= 0 || accum_frames == 0 ||
+	vkrt_tiler_pass_done(&tiler);
+      if (new_pass && l > 0) {
+	// the next pass accumulates onto what the last one wrote
+	vkh_memory_barrier(cmd, vkrt_trace_stage,
+			   VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+			   vkrt_trace_stage,
+			   VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+			   VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+      }
+      if (new_pass) {
+	push_constants.frame_no = accum_frames++;
+	denoise_frames = push_constants.frame_no == 0 ? 1 : denoise_frames + 1;
+      }
+      push_constants.adaptive = 0;
+      if (tile_size <= 0) {
+	push_constants.tile_offset[0] = push_constants.tile_offset[1] = 0;
+	if (use_wavefront) {
+	  vkrt_wavefront_record(cmd, &wavefront, vkrt_pipelines_get_variant(&pipelines, spec),
+				&push_constants, sizeof(push_constants_t),
+				&push_constants.wave);
+	  continue;
+	}
+	// reprojecting launches need every pixel, they fetch the history
+	push_constants.adaptive = use_adaptive && !push_constants.reproject &&
+	  push_constants.frame_no >= adaptive.min_frames;
+	if (push_constants.adaptive) {
+	  vkrt_adaptive_record(cmd, &adaptive, frame_slot);
+	  vkrt_tracer_record_indirect(cmd, tracer, &push_constants, sizeof(push_constants_t),
+				      adaptive.pixels.device_address);
+	  adaptive_count++;
+	  continue;
+	}
+	vkrt_tracer_record(cmd, tracer, &push_constants, sizeof(push_constants_t),
+			   draw_image.extent.width, draw_image.extent.height);
+	continue;
+      }
+      if (new_pass) {
+	int mouse_x, mouse_y;
+	SDL_GetMouseState(&mouse_x, &mouse_y);
+	vkrt_tiler_begin_pass(&tiler, tile_order,
+			      (float)mouse_x * draw_extent.width / window_width,
+			      (float)mouse_y * draw_extent.height / window_height);
+      }
+      VkRect2D tile;
+      vkrt_tiler_next(&tiler, &tile);
+      push_constants.tile_offset[0] = tile.offset.x;
+      push_constants.tile_offset[1] = tile.offset.y;
+      vkrt_tracer_record(cmd, tracer, &push_constants, sizeof(push_constants_t),
+			 tile.extent.width, tile.extent.height);
+    }
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 4);
+    adaptive_launches[frame_slot] = adaptive_count;
+    slot_render_id[frame_slot] = render_id;
+    prev_camera = push_constants;
+
+    // the filtered copy is only shown, accumulation carries on in draw_image
+    vkw_image *shown_image = &draw_image;
+    if (denoise) {
+      vkw_image *filtered = vkrt_denoiser_record(cmd, &denoiser, denoise_iterations,
+						 denoise_frames);
+      if (filtered) { shown_image = filtered; }
+    }
+    vkw_gpu_timer_mark(cmd, &frame_timers[frame_slot], 5);
+
+    if (display_compute) {
+      vkrt_display_record(cmd, device, &display, frame_slot, shown_image,
+			  swapchain.images[image_index], swapchain.image_views[image_index],
+			  swapchain.extent);
+    } else {
+      vkh_transition_image(cmd, shown_image->image, VK_IMAGE_LAYOUT_GENERAL,
+			   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+      vkh_transition_image(cmd, swapchain.images[image_index],
+			   VK_IMAGE_LAYOUT_UNDEFINED,
+			   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+      vkh_copy_image_to_image(cmd, shown_image->image,
+			      swapchain.images[image_index], draw_extent,
+			      swapchain.extent);
+      vkh_transition_image(cmd, shown_image->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+			   VK_IMAGE_LAYOUT_GENERAL);
+      vkh_transition_image(cmd, swapchain.images[image_index],
+			   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			   VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    }
         
     // imgui
     {
@@ -805,6 +1923,7 @@ int main(void) {
     vkh_transition_image(cmd, swapchain.images[image_index],
 			 VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
 			 VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    vkh_host_read_barrier(cmd);
     
     vkw_frame_end_and_submit(device, graphics_queue, curr);
 
@@ -825,25 +1944,32 @@ int main(void) {
 
   vkDeviceWaitIdle(device);
 
-  vkrt_destroy_as(device, allocator, tlas);
-  for(uint32_t i = 0; i < geom_count; ++i) {
-    vkrt_destroy_as(device, allocator, blases[i]);
-  }
-  free(blases);
-  vkrt_memory_free(allocator, sbt_rgen_buffer);
-  vkrt_memory_free(allocator, sbt_rmiss_buffer);
-  vkrt_memory_free(allocator, sbt_rchit_buffer);
-  vkrt_memory_free(allocator, geometry_nodes);
+  vkrt_tiler_destroy(&tiler);
+  vkrt_deformer_destroy(device, allocator, &deformer);
+  vkrt_animator_destroy(&animator);
+  vkrt_scene_destroy(device, allocator, &scene);
+  vkrt_instance_generator_destroy(device, &instance_gen);
+  vkrt_pipelines_destroy(&pipelines);
+  vkrt_memory_free(allocator, ray_stats);
+  vkrt_memory_free(allocator, blue_noise);
+  vkrt_denoiser_destroy(device, allocator, &denoiser);
+  vkrt_display_destroy(device, &display);
+  vkrt_aux_images_destroy(device, allocator, &aux);
+  vkrt_history_destroy(device, allocator, &history);
+  vkrt_adaptive_destroy(device, allocator, &adaptive);
+  vkrt_wavefront_destroy(allocator, &wavefront);
+  vkrt_lights_destroy(allocator, &lights);
+  vkrt_env_destroy(device, allocator, &env);
 
   vkrt_free_model(device, allocator, model);
     
-  vkDestroyPipeline(device, rt_pipeline, NULL);
   vkDestroyPipelineLayout(device, rt_pipeline_layout, NULL);
 
   vkDestroyDescriptorSetLayout(device, rt_layout, NULL);
   
   for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
     vkw_frame_data_destroy(device, frames[i]);
+    vkw_gpu_timer_destroy(device, frame_timers[i]);
   }
 
   ImGui_ImplVulkan_DestroyFontsTexture();
@@ -0,0 +1,129 @@
+// where paths start and where their light ends up: the camera, and the
+// accumulated image with what's kept next to it. shared by the ray generation
+// shader and the wavefront passes, include after shading.glsl
+
+layout(binding = 1, rgba32f) uniform image2D img;
+// first hit albedo and normal/depth, averaged like img for the denoiser
+layout(binding = 8, rgba16f) uniform image2D aux_albedo;
+layout(binding = 9, rgba32f) uniform image2D aux_normal_depth;
+
+// what img and aux_normal_depth held before the camera moved, and the cameras
+// to reproject between, see vk_rt_temporal.h
+struct camera_slot_t {
+  mat4 view_proj;
+  mat4 prev_view_proj;
+  vec4 prev_pos;
+};
+layout(binding = 10, set = 0) buffer camera_t {
+  camera_slot_t slots[];
+} cameras;
+layout(binding = 11, rgba32f) uniform readonly image2D history;
+layout(binding = 12, rgba32f) uniform readonly image2D history_normal_depth;
+
+// luminance mean, mean square and frames, see vk_rt_adaptive.h
+layout(binding = 13, rgba32f) uniform image2D moments;
+
+// world space direction through a point of the image, in pixels
+vec3 camera_ray(vec2 pixel_pos) {
+  vec2 d = pixel_pos / vec2(imageSize(img)) * 2.0 - 1.0;
+  vec4 target = pcs.proj * vec4(d.x, d.y, 1, 1);
+  return (pcs.view * vec4(normalize(target.xyz / target.w), 0)).xyz;
+}
+
+// a path starting from the camera through the pixel, jittered by its sample
+path_t camera_path(uvec2 pixel, uint sample_index) {
+  path_t path;
+  path.rng = rng_init(pixel, (pcs.frame_no + pcs.seed_offset) * samples + sample_index);
+  // jitter starting point by uniform random number
+  vec2 jitter = rng_2d(path.rng);
+  path.ro = (pcs.view * vec4(0, 0, 0, 1)).xyz;
+  path.rd = camera_ray(vec2(pixel) + jitter);
+  path.attenuated_colour = vec3(1);
+  path.radiance = vec3(0);
+  path.bsdf_pdf = 0;
+  path.depth = 0;
+  path.aux_albedo = vec3(1);
+  path.aux_normal_depth = vec4(0);
+  path.nee_radiance = vec3(0);
+  return path;
+}
+
+// the accumulated colour (a the frames in it) of the surface the pixel now
+// sees, fetched bilinearly from where the previous camera saw it. taps that
+// saw another surface, going by the depth and normal, are dropped, and so is
+// the whole history if none are left
+vec4 reproject_history(uvec2 pixel, vec4 normal_depth) {
+  camera_slot_t cam = cameras.slots[pcs.stats_slot];
+  vec3 rd = normalize(camera_ray(vec2(pixel) + 0.5));
+  vec3 ro = (pcs.view * vec4(0, 0, 0, 1)).xyz;
+  bool hit = normal_depth.w > 0;
+  // misses only depend on the direction, so reproject them from infinity
+  vec3 p = ro + rd * normal_depth.w;
+  vec4 pos = hit ? vec4(p, 1) : vec4(rd, 0);
+  vec4 prev_clip = cam.prev_view_proj * pos;
+  // behind the previous camera (the current one has it in front)
+  if (prev_clip.w * (cam.view_proj * pos).w <= 0) { return vec4(0); }
+
+  vec2 prev = (prev_clip.xy / prev_clip.w * 0.5 + 0.5) * vec2(imageSize(img)) - 0.5;
+  ivec2 base = ivec2(floor(prev));
+  vec2 f = prev - vec2(base);
+  float expected_depth = length(p - cam.prev_pos.xyz);
+  vec3 n = length(normal_depth.xyz) > 0 ? normalize(normal_depth.xyz) : vec3(0);
+  vec4 sum = vec4(0);
+  float weight_sum = 0;
+  for (int i = 0; i < 4; ++i) {
+    ivec2 q = base + ivec2(i & 1, i >> 1);
+    if (any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, imageSize(img)))) {
+      continue;
+    }
+    vec4 nd = imageLoad(history_normal_depth, q);
+    if (hit != (nd.w > 0)) { continue; }
+    if (hit) {
+      vec3 nq = length(nd.xyz) > 0 ? normalize(nd.xyz) : vec3(0);
+      if (abs(nd.w - expected_depth) > 0.05 * expected_depth || dot(n, nq) < 0.9) {
+	continue;
+      }
+    }
+    float w = ((i & 1) != 0 ? f.x : 1 - f.x) * ((i >> 1) != 0 ? f.y : 1 - f.y);
+    sum += imageLoad(history, q) * w;
+    weight_sum += w;
+  }
+  if (weight_sum < 1e-4) { return vec4(0); }
+  vec4 res = sum / weight_sum;
+  // the reprojected history is a little blurred, keep its weight bounded so
+  // new samples replace it while the camera keeps moving
+  res.a = min(res.a, float(pcs.history_max));
+  return res;
+}
+
+// adds a launch's average of the pixel's samples to the image, the aux images
+// and the luminance moments
+void accumulate_pixel(uvec2 pixel, vec3 col, vec3 albedo, vec4 normal_depth) {
+  // a counts the frames each pixel has accumulated, which differs from
+  // frame_no once history has been reprojected
+  vec4 prev_colour = vec4(0);
+  if (pcs.frame_no > 0) {
+    prev_colour = pcs.reproject != 0 ? reproject_history(pixel, normal_depth) :
+      imageLoad(img, ivec2(pixel));
+  }
+  float n = prev_colour.a;
+  imageStore(img, ivec2(pixel), vec4((prev_colour.rgb * n + col) / (n + 1), n + 1));
+
+  // the first hit restarts with the camera, the denoiser needs where it is now
+  vec4 prev_albedo = vec4(0);
+  vec4 prev_normal_depth = vec4(0);
+  if (pcs.frame_no > 0 && pcs.reproject == 0) {
+    prev_albedo = imageLoad(aux_albedo, ivec2(pixel));
+    prev_normal_depth = imageLoad(aux_normal_depth, ivec2(pixel));
+  }
+  float aux_n = prev_albedo.a;
+  imageStore(aux_albedo, ivec2(pixel),
+	     vec4((prev_albedo.rgb * aux_n + albedo) / (aux_n + 1), aux_n + 1));
+  imageStore(aux_normal_depth, ivec2(pixel),
+	     (prev_normal_depth * aux_n + normal_depth) / (aux_n + 1));
+  // restarts with the aux images, the variance of reprojected history isn't known
+  float l = dot(col, vec3(0.2126, 0.7152, 0.0722));
+  vec2 prev_moments = aux_n > 0 ? imageLoad(moments, ivec2(pixel)).xy : vec2(0);
+  imageStore(moments, ivec2(pixel),
+	     vec4((prev_moments * aux_n + vec2(l, l * l)) / (aux_n + 1), aux_n + 1, 0));
+}
@@ -0,0 +1,39 @@
+// the scene descriptors read by the hit shaders and whatever shades their
+// hits (vkrt_scene_write_descriptors and the material/texture writes in
+// main.c). the tlas (binding 0) is declared by the shaders that trace, so the
+// wavefront compute passes can include this without ray tracing
+
+#include "constants.glsl"
+
+struct geometry_node {
+  uint64_t vertex_buffer_address;
+  uint64_t index_buffer_address;
+  uint material_index;
+  uint first_light; // light of its first triangle, no_light if it doesn't emit
+};
+
+layout(binding = 2, set = 0) buffer geometry_nodes_t {
+  geometry_node nodes[];
+} geometry_nodes;
+
+struct material_t {
+  vec3 col;
+  uint texture_index; // no_texture if there isn't one
+  vec3 emissive;
+  uint emissive_texture_index;
+  float alpha;
+  float alpha_cutoff; // 0 unless the material is alpha masked
+};
+
+layout(binding = 3, set = 0) buffer materials_t {
+  material_t mats[];
+} materials;
+
+layout(binding = 4, set = 0) uniform sampler2D textures[];
+
+material_t get_material(geometry_node geom) {
+  uint index = geom.material_index;
+  return materials.mats[index];
+}
+
+#include "buffer_references.glsl"
@@ -1,9 +1,19 @@
-struct ray_payload {
-  vec3 ro;
-  vec3 rd;
-  vec3 attenuated_colour;
-  uint depth;
-  uint seed;
-  bool stop;
-  bool hit_light;
+// where a path is in its sample sequence, see sampler.glsl
+struct rng_t {
+  uint seed; // lcg state, or what the sequence is scrambled with
+  uint dim; // next dimension to draw
+  uint index; // sample index within the pixel
 };
+
+// what the hit shaders hand back. the ray generation shader keeps the path
+// (throughput, radiance, rng, depth) in registers and does the shading itself
+// (shading.glsl), so only these 8 words cross a traceRayEXT
+struct hit_record {
+  vec3 norm; // world space shading normal
+  float t; // distance along the ray, negative for a miss
+  vec2 uv;
+  uint material_index;
+  uint light_index; // entry in the light table, no_light if it isn't in there
+};
+
+const float pi = 3.141592653589793238;
@@ -0,0 +1,17 @@
+// specialization constants, set per pipeline variant (vkrt_specialization in
+// vk_rt_pipelines.h) so loops and checks on them are compiled with them folded
+// in. the defaults only matter to tools looking at the spir-v
+
+layout(constant_id = 0) const uint max_depth = 5; // bounces a path can take at most
+layout(constant_id = 1) const uint samples = 1; // per pixel per launch
+// the material flags (vkrt_material_* in vk_rt_scene.h) a hit group's shaders
+// are compiled for, the flags it lacks fold their code away. everything else,
+// the ray query backend included, keeps them all and checks at runtime
+layout(constant_id = 2) const uint material_kind = 7; // VKRT_MATERIAL_ANY
+const uint material_emissive = 1;
+const uint material_masked = 2;
+const uint material_textured = 4;
+
+// sentinels, the same in every variant so they're plain constants
+const uint no_texture = 0xFFFFFFFFu; // VKRT_NO_TEXTURE
+const uint no_light = 0xFFFFFFFFu; // first_light of geometry that doesn't emit
@@ -0,0 +1,73 @@
+// the hdr environment map (vk_rt_env.h): a lat-long image around the scene,
+// +y up, lighting the rays that leave it. next event estimation samples its
+// texels through the alias table next to it. included by shading.glsl, after
+// sampler.glsl
+
+layout(binding = 17, set = 0) uniform sampler2D env_map;
+
+struct env_texel_t {
+  float pdf; // chance of picking the texel
+  float alias_prob;
+  uint alias;
+};
+
+layout(binding = 18, set = 0) buffer env_t {
+  uint width; // 0 without an environment
+  uint height;
+  float strength;
+  uint pad;
+  env_texel_t texels[];
+} env;
+
+// as far as path rays are traced, beyond it they've left the scene
+const float env_distance = 100.0;
+
+bool has_env() {
+  return env.width > 0;
+}
+
+// lat-long coordinates of a direction, u around y and v down from +y
+vec2 env_uv(vec3 d) {
+  return vec2(atan(d.z, d.x) / (2 * pi) + 0.5, acos(clamp(d.y, -1, 1)) / pi);
+}
+
+vec3 env_dir(vec2 uv) {
+  float phi = (uv.x - 0.5) * 2 * pi;
+  float theta = uv.y * pi;
+  return vec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+// what a ray leaving the scene towards d (normalised) sees
+vec3 env_radiance(vec3 d) {
+  if (!has_env()) { return vec3(0); }
+  return textureLod(env_map, env_uv(d), 0).rgb * env.strength;
+}
+
+// solid angle pdf of the alias table picking the texel d points into, and a
+// uniform point in it
+float env_pdf(vec3 d) {
+  vec2 uv = env_uv(d);
+  uvec2 texel = min(uvec2(uv * vec2(env.width, env.height)),
+		    uvec2(env.width - 1, env.height - 1));
+  float sin_theta = sin(uv.y * pi);
+  if (sin_theta <= 0) { return 0; }
+  return env.texels[texel.y * env.width + texel.x].pdf * float(env.width * env.height) /
+    (2 * pi * pi * sin_theta);
+}
+
+// a direction towards a bright part of the environment, wi, with its solid
+// angle pdf. pick chooses the texel through the alias table, jitter the point
+// in it. the radiance found there is returned
+vec3 sample_env(float pick, vec2 jitter, out vec3 wi, out float pdf) {
+  uint count = env.width * env.height;
+  pick *= count;
+  uint index = min(uint(pick), count - 1);
+  if (fract(pick) >= env.texels[index].alias_prob) {
+    index = env.texels[index].alias;
+  }
+  vec2 uv = (vec2(index % env.width, index / env.width) + jitter) /
+    vec2(env.width, env.height);
+  wi = env_dir(uv);
+  pdf = env_pdf(wi);
+  return env_radiance(wi);
+}
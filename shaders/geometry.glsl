@@ -1,3 +1,7 @@
+// triangle hits, shared by the hit shaders and the ray query backend
+// (ray_query.glsl), so they take what the hit shader builtins would give them.
+// include after bindings.glsl
+
 struct vertex_t {
   vec3 pos; vec3 norm; vec2 uv;
 };
@@ -6,12 +10,10 @@ struct triangle_t {
   vertex_t vertices[3];
 };
 
-triangle_t unpack_triangle(uint prim_index, uint vertex_stride) {
+triangle_t unpack_triangle(geometry_node geom_node, uint prim_index, uint vertex_stride) {
   triangle_t tri;
   const uint idx = prim_index * 3;
 
-  geometry_node geom_node = geometry_nodes.nodes[gl_InstanceID + gl_GeometryIndexEXT];
-
   indices indices = indices(geom_node.index_buffer_address);
   vertices vertices = vertices(geom_node.vertex_buffer_address);
   // unpack vertices data
@@ -31,3 +33,50 @@ triangle_t unpack_triangle(uint prim_index, uint vertex_stride) {
 
   return tri;
 }
+
+// geom_index is the instance custom index plus the geometry index, attribs the
+// barycentrics of the hit and world_to_object gl_WorldToObjectEXT
+hit_record triangle_hit(uint geom_index, uint prim_index, vec2 attribs,
+			mat4x3 world_to_object, float t) {
+  geometry_node node = geometry_nodes.nodes[geom_index];
+  triangle_t tri = unpack_triangle(node, prim_index, 2); // vertex is 2 vec4s
+  // TODO: fix this
+  vertex_t v0 = tri.vertices[0];
+  vertex_t v1 = tri.vertices[1];
+  vertex_t v2 = tri.vertices[2];
+
+  // get the properties of the current point on the triangle
+  vec3 bary = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+  vec3 norm = v0.norm * bary.x + v1.norm * bary.y + v2.norm * bary.z;
+
+  hit_record hit;
+  // instances can be moved, so take the normal out of object space
+  hit.norm = normalize(vec3(norm * world_to_object));
+  hit.t = t;
+  hit.uv = v0.uv * bary.x + v1.uv * bary.y + v2.uv * bary.z;
+  hit.material_index = node.material_index;
+  // only the emissive hit groups look for a light
+  bool emits = (material_kind & material_emissive) != 0 && node.first_light != no_light;
+  hit.light_index = emits ? node.first_light + prim_index : no_light;
+  return hit;
+}
+
+// whether an alpha masked material cuts the hit out, what the any-hit shader
+// (alpha_test.rahit) checks
+bool alpha_masked(uint geom_index, uint prim_index, vec2 attribs) {
+  // opaque geometry only gets here when alpha_test_all forces it through the
+  // any-hit shader, which for them is compiled with every flag (see
+  // vkrt_pipeline_variant_build) so it pays for the full test
+  if ((material_kind & material_masked) == 0) { return false; }
+  geometry_node node = geometry_nodes.nodes[geom_index];
+  material_t material = get_material(node);
+  float alpha = material.alpha;
+  if ((material_kind & material_textured) != 0 && material.texture_index != no_texture) {
+    triangle_t tri = unpack_triangle(node, prim_index, 2);
+    vec3 bary = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+    vec2 uv = tri.vertices[0].uv * bary.x + tri.vertices[1].uv * bary.y +
+      tri.vertices[2].uv * bary.z;
+    alpha *= textureLod(textures[nonuniformEXT(material.texture_index)], uv, 0).a;
+  }
+  return alpha < material.alpha_cutoff;
+}
@@ -0,0 +1,7 @@
+// payload shared by the closest hit shaders, include after common.glsl.
+// they only report what was hit (geometry.glsl, sphere.glsl), the shading is
+// in shading.glsl
+
+layout(location = 0) rayPayloadInEXT hit_record hit;
+
+#include "bindings.glsl"
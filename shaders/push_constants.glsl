@@ -0,0 +1,27 @@
+// matches push_constants_t in main.c
+
+layout (push_constant) uniform constants {
+  vec4 light_pos;
+  mat4 view;
+  mat4 proj;
+  uint frame_no;
+  uint stats_slot;
+  uint ray_flags; // gl_RayFlags*, see alpha_test_mode in main.c
+  uint count_any_hits;
+  uint nee; // sample a light at every hit, see sample_light in shading.glsl
+  uint seed_offset; // decorrelates renders that use the same frame numbers
+  uint rr_min_depth; // bounces before russian roulette can end a path
+  uint sampler_mode; // vkrt_sampler_mode, see sampler.glsl
+  uvec2 tile_offset; // where the launch starts in the image, see vk_rt_tiles.h
+  uint reproject; // fetch history from where the previous camera saw it
+  uint history_max; // frames reprojected history counts as at most
+  uint adaptive; // the launch covers the active pixel list, see vk_rt_adaptive.h
+  // vkrt_wave_push_constants, see wavefront.glsl
+  uint wave_queue; // ray queue the pass reads
+  uint wave_sample; // sample of the launch being traced
+  uint wave_sorted; // shade reads the queue sorted by material
+  uint wave_sort_stage;
+  uint pad; // what std430 would put before launch_size anyway
+  // gl_LaunchSizeEXT for the ray query backend, set by vkrt_tracer_record
+  uvec2 launch_size;
+} pcs;
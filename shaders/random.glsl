@@ -21,18 +21,14 @@ uint lcg(inout uint previous)
     return previous & 0x00FFFFFF;
 }
 
-uint get_seed(ivec2 val) {
-  return tea(val.x, val.y);
-}
-
 float rand(inout uint seed) {
   return float(lcg(seed)) / float(0x01000000);
 }
 
-vec3 cosine_sample_hemisphere(uint seed)
+vec3 cosine_sample_hemisphere(vec2 u)
 {
-	float r1 = rand(seed);
-	float r2 = rand(seed);
+	float r1 = u.x;
+	float r2 = u.y;
 
 	vec3 dir;
 	float r = sqrt(r1);
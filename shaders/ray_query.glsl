@@ -0,0 +1,76 @@
+// tracing with ray queries, for the compute backend (ray_query.comp). the
+// candidates get what the any-hit and intersection shaders would do to them
+// and the closest hit comes back as the same hit_record, so images match the
+// ray tracing pipeline. include after geometry.glsl, sphere.glsl and the tlas
+
+// the closest hit (t < 0 for a miss). without record only its t is filled in,
+// which is all a shadow ray needs
+hit_record query_trace(vec3 ro, vec3 rd, float tmax, uint flags, bool record) {
+  rayQueryEXT rq;
+  rayQueryInitializeEXT(rq, tlas, flags, 0xFF, ro, 0.001, rd, tmax);
+  while (rayQueryProceedEXT(rq)) {
+    uint geom_index = rayQueryGetIntersectionInstanceCustomIndexEXT(rq, false) +
+      rayQueryGetIntersectionGeometryIndexEXT(rq, false);
+    uint prim_index = rayQueryGetIntersectionPrimitiveIndexEXT(rq, false);
+    if (rayQueryGetIntersectionTypeEXT(rq, false) ==
+	gl_RayQueryCandidateIntersectionTriangleEXT) {
+      // geometry that isn't opaque, see alpha_test.rahit
+      if (pcs.count_any_hits != 0) {
+	atomicAdd(ray_stats.slots[pcs.stats_slot].any_hits, 1);
+      }
+      if (!alpha_masked(geom_index, prim_index,
+			rayQueryGetIntersectionBarycentricsEXT(rq, false))) {
+	rayQueryConfirmIntersectionEXT(rq);
+      }
+      continue;
+    }
+    // an aabb of the sphere blas, see sphere.rint
+    float committed_t =
+      rayQueryGetIntersectionTypeEXT(rq, true) == gl_RayQueryCommittedIntersectionNoneEXT ?
+      tmax : rayQueryGetIntersectionTEXT(rq, true);
+    sphere_t s = spheres(geometry_nodes.nodes[geom_index].vertex_buffer_address).s[prim_index];
+    float t = sphere_intersect(s, rayQueryGetIntersectionObjectRayOriginEXT(rq, false),
+			       rayQueryGetIntersectionObjectRayDirectionEXT(rq, false),
+			       rayQueryGetRayTMinEXT(rq), committed_t);
+    if (t >= 0) {
+      rayQueryGenerateIntersectionEXT(rq, t);
+    }
+  }
+
+  hit_record hit;
+  hit.t = -1;
+  uint type = rayQueryGetIntersectionTypeEXT(rq, true);
+  if (type == gl_RayQueryCommittedIntersectionNoneEXT) { return hit; }
+  float t = rayQueryGetIntersectionTEXT(rq, true);
+  if (!record) {
+    hit.t = t;
+    return hit;
+  }
+
+  uint geom_index = rayQueryGetIntersectionInstanceCustomIndexEXT(rq, true) +
+    rayQueryGetIntersectionGeometryIndexEXT(rq, true);
+  uint prim_index = rayQueryGetIntersectionPrimitiveIndexEXT(rq, true);
+  mat4x3 world_to_object = rayQueryGetIntersectionWorldToObjectEXT(rq, true);
+  if (type == gl_RayQueryCommittedIntersectionTriangleEXT) {
+    return triangle_hit(geom_index, prim_index,
+			rayQueryGetIntersectionBarycentricsEXT(rq, true),
+			world_to_object, t);
+  }
+  sphere_t s = spheres(geometry_nodes.nodes[geom_index].vertex_buffer_address).s[prim_index];
+  return sphere_hit(s, rayQueryGetIntersectionObjectRayOriginEXT(rq, true),
+		    rayQueryGetIntersectionObjectRayDirectionEXT(rq, true),
+		    world_to_object, t);
+}
+
+// trace_shadow in shadow.glsl, with a query that stops at the first hit
+uint shadow_ray_count = 0;
+
+void query_shadow(inout path_t path) {
+  if (all(equal(path.nee_radiance, vec3(0)))) { return; }
+  hit_record blocker = query_trace(path.ro, path.nee_wi, path.nee_dist * 0.999,
+				   pcs.ray_flags | gl_RayFlagsTerminateOnFirstHitEXT, false);
+  shadow_ray_count += 1;
+  if (blocker.t < 0) {
+    path.radiance += path.nee_radiance;
+  }
+}
@@ -0,0 +1,13 @@
+// counters per frame slot, read back for the Mrays/s figures, matches
+// vkrt_ray_stats in vk_rt_bench.h
+
+struct ray_stats_slot {
+  uint rays;
+  uint shadow_rays;
+  uint any_hits;
+  uint active_pixels;
+};
+
+layout(binding = 5, set = 0) buffer ray_stats_t {
+  ray_stats_slot slots[];
+} ray_stats;
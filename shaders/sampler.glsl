@@ -0,0 +1,124 @@
+// the numbers paths are built from, picked by pcs.sampler_mode (see
+// vk_rt_sampler.h). include after push_constants.glsl
+//  random:     the tea seeded lcg from random.glsl
+//  sobol:      owen scrambled sobol, the index shuffled per pixel and every
+//              dimension scrambled with its own seed (burley 2020)
+//  blue noise: one owen scrambled sobol sequence for the whole image, rotated
+//              per pixel and dimension by a blue noise mask, so the error is
+//              spread out as high frequency noise across the screen
+
+#include "random.glsl"
+
+const uint sampler_random = 0;
+const uint sampler_sobol = 1;
+const uint sampler_blue_noise = 2;
+
+layout(binding = 7, set = 0) buffer blue_noise_t {
+  float v[];
+} blue_noise;
+
+const uint blue_noise_size = 64; // VKRT_BLUE_NOISE_SIZE
+
+// pcg hash, from "hash functions for gpu rendering" (jarzynski, olano)
+uint hash(uint x) {
+  uint state = x * 747796405u + 2891336453u;
+  uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  return (word >> 22u) ^ word;
+}
+
+uint hash_combine(uint seed, uint v) {
+  return seed ^ (hash(v) + 0x9E3779B9u + (seed << 6) + (seed >> 2));
+}
+
+uint laine_karras_permutation(uint x, uint seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// owen scrambling, every bit flipped depending on the bits above it
+uint nested_uniform_scramble(uint x, uint seed) {
+  return bitfieldReverse(laine_karras_permutation(bitfieldReverse(x), seed));
+}
+
+// the second sobol dimension, the first is just the index bit reversed
+uint sobol_1(uint index) {
+  uint v = 1u << 31;
+  uint res = 0;
+  for (; index != 0; index >>= 1, v ^= v >> 1) {
+    if ((index & 1) != 0) { res ^= v; }
+  }
+  return res;
+}
+
+float uint_to_unit(uint x) {
+  return float(x >> 8) * (1.0 / 16777216.0);
+}
+
+// seeds the sequence of a pixel's sample_index'th sample
+rng_t rng_init(uvec2 pixel, uint sample_index) {
+  rng_t rng;
+  rng.dim = 0;
+  rng.index = sample_index;
+  if (pcs.sampler_mode == sampler_random) {
+    rng.seed = tea(hash(pixel.x) ^ pixel.y, sample_index);
+  } else if (pcs.sampler_mode == sampler_sobol) {
+    rng.seed = hash(hash(pixel.x) ^ pixel.y);
+  } else {
+    rng.seed = pixel.x | (pixel.y << 16);
+  }
+  return rng;
+}
+
+// the blue noise mask, shifted around for every dimension
+float blue_noise_offset(rng_t rng, uint dim) {
+  uvec2 p = (uvec2(rng.seed & 0xFFFF, rng.seed >> 16) + dim * uvec2(37, 23)) %
+    blue_noise_size;
+  return blue_noise.v[p.y * blue_noise_size + p.x];
+}
+
+// the next two dimensions of the sample
+vec2 rng_2d(inout rng_t rng) {
+  uint dim = rng.dim;
+  rng.dim += 2;
+  if (pcs.sampler_mode == sampler_random) {
+    return vec2(rand(rng.seed), rand(rng.seed));
+  }
+  uint dim_seed = hash(dim);
+  uint index = rng.index;
+  if (pcs.sampler_mode == sampler_sobol) {
+    dim_seed = hash_combine(rng.seed, dim);
+    index = nested_uniform_scramble(index, dim_seed);
+  }
+  vec2 u = vec2(uint_to_unit(nested_uniform_scramble(bitfieldReverse(index),
+						     hash_combine(dim_seed, 0))),
+		uint_to_unit(nested_uniform_scramble(sobol_1(index),
+						     hash_combine(dim_seed, 1))));
+  if (pcs.sampler_mode == sampler_blue_noise) {
+    u = fract(u + vec2(blue_noise_offset(rng, dim), blue_noise_offset(rng, dim + 1)));
+  }
+  return u;
+}
+
+// the next dimension of the sample
+float rng_1d(inout rng_t rng) {
+  uint dim = rng.dim;
+  rng.dim += 1;
+  if (pcs.sampler_mode == sampler_random) {
+    return rand(rng.seed);
+  }
+  uint dim_seed = hash(dim);
+  uint index = rng.index;
+  if (pcs.sampler_mode == sampler_sobol) {
+    dim_seed = hash_combine(rng.seed, dim);
+    index = nested_uniform_scramble(index, dim_seed);
+  }
+  float u = uint_to_unit(nested_uniform_scramble(bitfieldReverse(index), dim_seed));
+  if (pcs.sampler_mode == sampler_blue_noise) {
+    u = fract(u + blue_noise_offset(rng, dim));
+  }
+  return u;
+}
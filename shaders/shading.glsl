@@ -0,0 +1,205 @@
+// shading of the hits a path makes, from the hit_record the hit shaders hand
+// back. it traces nothing itself, so the same code runs in the ray generation
+// shader and the wavefront shade pass (vk_rt_wavefront.h). include after
+// common.glsl, push_constants.glsl and sampler.glsl
+
+#include "bindings.glsl"
+
+// emissive triangles (vk_rt_lights.h), sampled for next event estimation
+struct light_t {
+  vec4 p0; // w is the area
+  vec4 e1;
+  vec4 e2;
+  vec4 uv01;
+  vec2 uv2;
+  uint material_index;
+  float pdf; // chance of picking it, its share of the total power
+  float alias_prob;
+  uint alias;
+};
+
+layout(binding = 6, set = 0) buffer lights_t {
+  uint count;
+  float total_power;
+  light_t tris[];
+} lights;
+
+#include "environment.glsl"
+
+// everything about a path that lives across bounces
+struct path_t {
+  vec3 ro;
+  vec3 rd;
+  vec3 attenuated_colour; // throughput of the path so far
+  vec3 radiance; // light gathered along the path
+  float bsdf_pdf; // solid angle pdf rd was sampled with, 0 for camera rays
+  uint depth;
+  rng_t rng;
+  // the first hit, for the denoiser's edges (vk_rt_denoise.h)
+  vec3 aux_albedo;
+  vec4 aux_normal_depth; // normal, distance from the camera (0 if missed)
+  // the shadow ray of the last hit, from ro towards nee_wi, and the light it
+  // adds if it gets through. see trace_shadow in shadow.glsl
+  vec3 nee_radiance;
+  vec3 nee_wi;
+  float nee_dist;
+};
+
+// emissiveFactor times the emissive texture, if there is one
+vec3 material_emission(material_t material, vec2 uv) {
+  vec3 emission = material.emissive;
+  if (material.emissive_texture_index != no_texture) {
+    emission *= textureLod(textures[nonuniformEXT(material.emissive_texture_index)],
+			   uv, 0).rgb;
+  }
+  return emission;
+}
+
+// weight for a sample taken with pdf a that could also have come from b
+float power_heuristic(float a, float b) {
+  a *= a;
+  b *= b;
+  return a / (a + b);
+}
+
+// chance next event estimation samples the environment rather than a light
+float env_pick_chance() {
+  if (!has_env()) { return 0; }
+  return lights.count > 0 ? 0.5 : 1;
+}
+
+// solid angle pdf of sampling a point on l seen from dist2 away at cos_light
+float light_pdf(light_t l, float dist2, float cos_light) {
+  return (1 - env_pick_chance()) * l.pdf * dist2 / (cos_light * l.p0.w);
+}
+
+// picks the environment or a light (through the alias table) and samples a
+// point on it, returning the light it gives a diffuse surface of colour albedo
+// at p if nothing is in the way (towards wi, dist away), weighted against the
+// same direction being found by the bsdf
+vec3 sample_light(inout rng_t rng, vec3 p, vec3 norm, vec3 albedo, out vec3 wi,
+		  out float dist) {
+  float env_chance = env_pick_chance();
+  if (lights.count == 0 && env_chance == 0) { return vec3(0); }
+  // one number picks the environment or a light, then the alias table entry
+  // and its coin flip
+  float pick = rng_1d(rng);
+  vec2 uv_sample = rng_2d(rng);
+  if (pick < env_chance) {
+    float pdf;
+    vec3 radiance = sample_env(pick / env_chance, uv_sample, wi, pdf);
+    dist = env_distance;
+    pdf *= env_chance;
+    float cos_surface = dot(norm, wi);
+    if (cos_surface <= 0 || pdf <= 0) { return vec3(0); }
+    float weight = power_heuristic(pdf, cos_surface / pi);
+    return albedo / pi * radiance * cos_surface * weight / pdf;
+  }
+  pick = (pick - env_chance) / (1 - env_chance) * lights.count;
+  uint index = min(uint(pick), lights.count - 1);
+  if (fract(pick) >= lights.tris[index].alias_prob) {
+    index = lights.tris[index].alias;
+  }
+  light_t l = lights.tris[index];
+  float u = uv_sample.x;
+  float v = uv_sample.y;
+  if (u + v > 1) { u = 1 - u; v = 1 - v; }
+  vec3 q = l.p0.xyz + u * l.e1.xyz + v * l.e2.xyz;
+  vec2 uv = l.uv01.xy * (1 - u - v) + l.uv01.zw * u + l.uv2 * v;
+
+  vec3 to_light = q - p;
+  float dist2 = dot(to_light, to_light);
+  dist = sqrt(dist2);
+  wi = to_light / dist;
+  vec3 light_norm = normalize(cross(l.e1.xyz, l.e2.xyz));
+  float cos_surface = dot(norm, wi);
+  float cos_light = abs(dot(light_norm, wi));
+  if (cos_surface <= 0 || cos_light <= 0 || l.p0.w <= 0) { return vec3(0); }
+  vec3 emission = material_emission(materials.mats[l.material_index], uv);
+  if (all(equal(emission, vec3(0)))) { return vec3(0); }
+
+  float pdf = light_pdf(l, dist2, cos_light);
+  float weight = power_heuristic(pdf, cos_surface / pi);
+  return albedo / pi * emission * cos_surface * weight / pdf;
+}
+
+// ends the path in the environment, weighted against next event estimation
+// having sampled the same direction
+void shade_miss(inout path_t path) {
+  if (!has_env()) { return; }
+  vec3 rd = normalize(path.rd);
+  float weight = 1;
+  if (pcs.nee != 0 && path.bsdf_pdf > 0) {
+    weight = power_heuristic(path.bsdf_pdf, env_pick_chance() * env_pdf(rd));
+  }
+  path.radiance += path.attenuated_colour * env_radiance(rd) * weight;
+}
+
+// continues the path from the hit its last ray made
+void shade_hit(inout path_t path, hit_record hit) {
+  path.depth += 1;
+  material_t material = materials.mats[hit.material_index];
+  vec3 material_colour;
+
+  // TODO: we don't like if statements here
+  if (material.texture_index == no_texture) {
+    material_colour = material.col;
+  } else {
+    // no derivatives outside fragment shaders, so the top mip it is
+    material_colour = textureLod(textures[nonuniformEXT(material.texture_index)],
+				 hit.uv, 0).rgb;
+  }
+  float dist = hit.t * length(path.rd);
+  if (path.depth == 1) {
+    path.aux_albedo = material_colour;
+    path.aux_normal_depth = vec4(hit.norm, dist);
+  }
+
+  vec3 emission = material_emission(material, hit.uv);
+  if (any(greaterThan(emission, vec3(0)))) {
+    // with next event estimation the previous hit could have sampled this
+    // light too, so weight the bsdf sample against that
+    float weight = 1;
+    if (pcs.nee != 0 && path.bsdf_pdf > 0 && hit.light_index != no_light) {
+      light_t l = lights.tris[hit.light_index];
+      vec3 rd = normalize(path.rd);
+      float cos_light = abs(dot(normalize(cross(l.e1.xyz, l.e2.xyz)), rd));
+      weight = power_heuristic(path.bsdf_pdf, light_pdf(l, dist * dist, cos_light));
+    }
+    path.radiance += path.attenuated_colour * emission * weight;
+  }
+
+  path.ro = path.ro + path.rd * hit.t;
+  path.nee_radiance = vec3(0);
+  if (pcs.nee != 0) {
+    path.nee_radiance = path.attenuated_colour *
+      sample_light(path.rng, path.ro, hit.norm, material_colour, path.nee_wi,
+		   path.nee_dist);
+  }
+  // create an onb for the hemisphere sample
+  vec3 norm = hit.norm;
+  vec3 up = (abs(norm.z) < 0.99) ? vec3(0, 0, 1) : vec3(1, 0, 0);
+  vec3 tx = normalize(cross(up, norm));
+  vec3 ty = cross(norm, tx);
+  mat3 frame = mat3(tx, ty, norm);
+  path.rd = frame * cosine_sample_hemisphere(rng_2d(path.rng));
+  path.bsdf_pdf = max(dot(norm, path.rd), 0) / pi;
+  path.attenuated_colour *= material_colour;
+}
+
+// whether the path goes on to trace another ray: it stops at the maximum
+// depth, and past the minimum depth russian roulette ends paths carrying
+// little light, the survivors scaled up by the odds of surviving so the
+// estimate stays unbiased
+bool continue_path(inout path_t path) {
+  if (path.depth >= max_depth) { return false; }
+  if (path.depth >= pcs.rr_min_depth) {
+    vec3 t = path.attenuated_colour;
+    float survive = min(max(t.r, max(t.g, t.b)), 0.95);
+    if (rng_1d(path.rng) >= survive) {
+      return false;
+    }
+    path.attenuated_colour /= survive;
+  }
+  return true;
+}
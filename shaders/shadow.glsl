@@ -0,0 +1,22 @@
+// the shadow rays of next event estimation, traced from ray generation
+// shaders (the path loop in ray_gen.rgen and wave_shadow.rgen). include after
+// shading.glsl and the tlas
+
+layout(location = 2) rayPayloadEXT bool shadowed;
+
+// the shadow rays this invocation traced, for ray_stats.glsl
+uint shadow_ray_count = 0;
+
+// traces the shadow ray shade_hit left, adding its light if it gets through
+void trace_shadow(inout path_t path) {
+  if (all(equal(path.nee_radiance, vec3(0)))) { return; }
+  // only visibility matters: stop at the first hit and skip its shading
+  shadowed = true;
+  traceRayEXT(tlas, pcs.ray_flags | gl_RayFlagsTerminateOnFirstHitEXT |
+	      gl_RayFlagsSkipClosestHitShaderEXT, 0xFF, 0, 1, 1, path.ro, 0.001,
+	      path.nee_wi, path.nee_dist * 0.999, 2);
+  shadow_ray_count += 1;
+  if (!shadowed) {
+    path.radiance += path.nee_radiance;
+  }
+}
@@ -0,0 +1,44 @@
+// analytic spheres, the geometry node of a sphere blas points at an array of
+// these (vkrt_sphere) with gl_PrimitiveID indexing it. shared by the sphere
+// hit group and the ray query backend (ray_query.glsl), include after
+// bindings.glsl
+
+struct sphere_t {
+  vec3 centre;
+  float radius;
+  uint material_index;
+};
+
+layout (buffer_reference, scalar) readonly buffer spheres { sphere_t s[]; };
+
+// where the object space ray enters the sphere (or leaves it, if it starts
+// inside) between tmin and tmax, negative if it doesn't. object space keeps
+// t the same as in world space
+float sphere_intersect(sphere_t s, vec3 ro, vec3 rd, float tmin, float tmax) {
+  vec3 oc = ro - s.centre;
+  float a = dot(rd, rd);
+  float b = dot(oc, rd);
+  float c = dot(oc, oc) - s.radius * s.radius;
+  float disc = b * b - a * c;
+  if (disc < 0) { return -1; }
+
+  float root = sqrt(disc);
+  float t = (-b - root) / a;
+  if (t < tmin) { t = (-b + root) / a; }
+  return t >= tmin && t <= tmax ? t : -1;
+}
+
+// ro and rd are the object space ray, world_to_object gl_WorldToObjectEXT
+hit_record sphere_hit(sphere_t s, vec3 ro, vec3 rd, mat4x3 world_to_object, float t) {
+  vec3 p = ro + rd * t;
+  vec3 n = (p - s.centre) / s.radius;
+
+  hit_record hit;
+  hit.norm = normalize(vec3(n * world_to_object));
+  hit.t = t;
+  // latitude/longitude uvs so textured materials still map onto it
+  hit.uv = vec2(atan(n.z, n.x) / (2 * pi) + 0.5, acos(clamp(n.y, -1, 1)) / pi);
+  hit.material_index = s.material_index;
+  hit.light_index = no_light; // not in the light table
+  return hit;
+}
@@ -0,0 +1,68 @@
+// the state the wavefront passes (vk_rt_wavefront.h) hand each other: a path
+// per pixel, and queues of the paths waiting on the next pass. include after
+// shading.glsl
+
+// matches VKRT_WAVE_PATH_WORDS
+struct wave_path_t {
+  path_t path;
+  hit_record hit; // what extend found for the path's ray
+  // this launch's finished samples, summed
+  vec3 col;
+  vec3 albedo;
+  vec4 normal_depth;
+};
+
+layout(binding = 15, set = 0, scalar) buffer wave_paths_t {
+  wave_path_t paths[];
+} wave_paths;
+
+// the queues' headers: the VkTraceRaysIndirectCommandKHR launching a thread per
+// entry (w is the length of each queue's slice of items), then the
+// VkDispatchIndirectCommand with a workgroup per wave_group_size entries
+struct wave_queue_t {
+  uvec4 launch;
+  uvec4 dispatch;
+};
+
+// vkrt_wave_queue
+const uint wave_rays = 0; // and 1, the ray queues bounces alternate between
+const uint wave_shadow_rays = 2;
+const uint wave_sorted_rays = 3;
+const uint wave_queue_count = 4;
+const uint wave_group_size = 64;
+
+layout(binding = 16, set = 0) buffer wave_queues_t {
+  wave_queue_t queues[wave_queue_count];
+  // a slice per queue, then a counter per material for sorting
+  uint items[];
+} wave_queues;
+
+uint wave_item_index(uint queue, uint index) {
+  return queue * wave_queues.queues[0].launch.w + index;
+}
+
+// appends a path to the queue, which has to be the same across the subgroup
+void wave_push(uint queue, uint path_index) {
+  // one atomic per subgroup for its slice of the queue
+  uint count = subgroupAdd(1);
+  uint base = 0;
+  if (subgroupElect()) {
+    base = atomicAdd(wave_queues.queues[queue].launch.x, count);
+    // the workgroups needed for base + count entries, less those base needed
+    uint groups = (base + count + wave_group_size - 1) / wave_group_size -
+      (base + wave_group_size - 1) / wave_group_size;
+    if (groups > 0) {
+      atomicAdd(wave_queues.queues[queue].dispatch.x, groups);
+    }
+  }
+  base = subgroupBroadcastFirst(base);
+  uint index = base + subgroupExclusiveAdd(1);
+  wave_queues.items[wave_item_index(queue, index)] = path_index;
+}
+
+// adds the last sample's path to the sums
+void wave_finish_sample(inout wave_path_t w) {
+  w.col += w.path.radiance;
+  w.albedo += w.path.aux_albedo;
+  w.normal_depth += w.path.aux_normal_depth;
+}
@@ -23,6 +23,12 @@ void vkh_copy_image_to_image(VkCommandBuffer cmd, VkImage src,
 			     VkImage dst, VkExtent2D srce,
 			     VkExtent2D dste);
 
+void vkh_host_read_barrier(VkCommandBuffer cmd);
+
+void vkh_memory_barrier(VkCommandBuffer cmd, VkPipelineStageFlags2 src_stage,
+			VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage,
+			VkAccessFlags2 dst_access);
+
 #endif
 #ifdef VK_HELP_IMPL
 VkImageCreateInfo vkh_image_create_info(VkFormat format, VkExtent3D extent,
@@ -154,4 +160,40 @@ void vkh_copy_image_to_image(VkCommandBuffer cmd, VkImage src,
 
   vkCmdBlitImage2(cmd, &blit_info);
 }
+
+// makes every device write so far visible to the host once the submission's
+// fence has been waited on
+void vkh_host_read_barrier(VkCommandBuffer cmd) {
+  VkMemoryBarrier2 barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+    .srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+    .srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+    .dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT,
+    .dstAccessMask = VK_ACCESS_2_HOST_READ_BIT,
+  };
+  VkDependencyInfo dep_info = {
+    .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+    .memoryBarrierCount = 1,
+    .pMemoryBarriers = &barrier,
+  };
+  vkCmdPipelineBarrier2(cmd, &dep_info);
+}
+
+void vkh_memory_barrier(VkCommandBuffer cmd, VkPipelineStageFlags2 src_stage,
+			VkAccessFlags2 src_access, VkPipelineStageFlags2 dst_stage,
+			VkAccessFlags2 dst_access) {
+  VkMemoryBarrier2 barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+    .srcStageMask = src_stage,
+    .srcAccessMask = src_access,
+    .dstStageMask = dst_stage,
+    .dstAccessMask = dst_access,
+  };
+  VkDependencyInfo dep_info = {
+    .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+    .memoryBarrierCount = 1,
+    .pMemoryBarriers = &barrier,
+  };
+  vkCmdPipelineBarrier2(cmd, &dep_info);
+}
 #endif
@@ -0,0 +1,125 @@
+#ifndef VK_RT_ADAPTIVE_H_
+#define VK_RT_ADAPTIVE_H_
+// adaptive sampling: the ray generation shader keeps a running mean and mean
+// square of every pixel's luminance, and before each launch a compute pass
+// (shaders/adaptive.comp) lists the pixels whose relative standard error is
+// still above the target. the launch is then an indirect one over that list,
+// so converged pixels cost nothing, and once the list is empty the render is
+// done
+
+// matches the push constants in shaders/adaptive.comp
+typedef struct {
+  float max_error; // relative standard error pixels are traced until
+  uint32_t min_frames; // frames every pixel gets before its error counts
+  uint32_t stats_slot; // where the active pixels are counted
+} vkrt_adaptive_push_constants;
+
+typedef struct {
+  vkw_image moments; // luminance mean, mean square, frames (trace set binding 13)
+  // a VkTraceRaysIndirectCommandKHR padded to 16 bytes, then the active
+  // pixels packed x | y << 16 (trace set binding 14)
+  vkrt_memory pixels;
+  vkw_compute_pipeline pipeline;
+  VkDescriptorSetLayout layout;
+  VkDescriptorSet set;
+  VkExtent2D extent;
+  float max_error;
+  uint32_t min_frames;
+} vkrt_adaptive;
+
+// colour is the accumulated image, its a the frames in each pixel
+vkrt_adaptive vkrt_adaptive_create(VkDevice device, VmaAllocator allocator,
+				   vkw_immediate_submit_buffer immediate, VkQueue queue,
+				   vkw_descriptor_allocator *ds_alloc, vkw_image colour,
+				   vkrt_memory ray_stats) {
+  vkrt_adaptive a = {
+    .extent = { colour.extent.width, colour.extent.height },
+    .max_error = 0.02f,
+    .min_frames = 16,
+  };
+  a.moments = vkw_image_create(device, allocator, colour.extent,
+			       VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT,
+			       false);
+  VkCommandBuffer cmd = vkw_immediate_begin(device, immediate);
+  vkh_transition_image(cmd, a.moments.image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkw_immediate_end(device, immediate, queue);
+
+  uint64_t pixel_count = (uint64_t)a.extent.width * a.extent.height;
+  uint32_t header[4] = { 0, 1, 1, 0 };
+  a.pixels = vkrt_allocate_memory(device, allocator, sizeof(header) + pixel_count * 4,
+				  NULL, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+				  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+				  VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+				  VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+  VK_CHECK(vmaCopyMemoryToAllocation(allocator, header, a.pixels.allocation, 0,
+				     sizeof(header)));
+
+  vkw_descriptor_layout_builder b = {};
+  vkw_descriptor_layout_builder_add(&b, 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  vkw_descriptor_layout_builder_add(&b, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  vkw_descriptor_layout_builder_add(&b, 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  vkw_descriptor_layout_builder_add(&b, 3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+  a.layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_COMPUTE_BIT);
+  a.set = vkw_descriptor_allocator_alloc(ds_alloc, device, a.layout);
+
+  vkrt_ds_writer writer = vkrt_ds_writer_create(4, a.set);
+  vkrt_ds_writer_add_image(&writer, 0, colour.view);
+  vkrt_ds_writer_add_image(&writer, 1, a.moments.view);
+  vkrt_ds_writer_add_buffer(&writer, 2, a.pixels.buffer, 0, VK_WHOLE_SIZE);
+  vkrt_ds_writer_add_buffer(&writer, 3, ray_stats.buffer, 0, VK_WHOLE_SIZE);
+  vkrt_ds_writer_write(device, writer);
+  vkrt_ds_writer_free(&writer);
+
+  VkShaderModule shader;
+  if (!vkh_load_shader_module("./shaders/adaptive.spv", device, &shader)) {
+    fprintf(stderr, "Failed to load the adaptive sampling shader - please check it exists\n");
+    exit(1);
+  }
+  a.pipeline = vkw_compute_pipeline_create(device, a.layout, shader,
+					   sizeof(vkrt_adaptive_push_constants));
+  vkDestroyShaderModule(device, shader, NULL);
+  return a;
+}
+
+// lists the pixels still above the error (barriers included), ready for
+// vkrt_tracer_record_indirect with a->pixels.device_address
+void vkrt_adaptive_record(VkCommandBuffer cmd, vkrt_adaptive *a, uint32_t stats_slot) {
+  // the last launch wrote the images and read the list, including its size
+  vkh_memory_barrier(cmd, vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_TRANSFER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_TRANSFER_WRITE_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+  vkCmdFillBuffer(cmd, a->pixels.buffer, 0, sizeof(uint32_t), 0);
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		     VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+  vkrt_adaptive_push_constants pcs = {
+    .max_error = a->max_error,
+    .min_frames = a->min_frames,
+    .stats_slot = stats_slot,
+  };
+  vkw_compute_pipeline_bind(cmd, a->pipeline, a->set);
+  vkw_compute_pipeline_push_constants(cmd, a->pipeline, &pcs);
+  vkCmdDispatch(cmd, (a->extent.width + 7) / 8, (a->extent.height + 7) / 8, 1);
+
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT |
+		     vkrt_trace_stage,
+		     VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT |
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+}
+
+void vkrt_adaptive_destroy(VkDevice device, VmaAllocator allocator, vkrt_adaptive *a) {
+  vkw_compute_pipeline_destroy(device, a->pipeline);
+  vkDestroyDescriptorSetLayout(device, a->layout, NULL);
+  vkw_image_destroy(device, allocator, a->moments);
+  vkrt_memory_free(allocator, a->pixels);
+  *a = (vkrt_adaptive){};
+}
+#endif // VK_RT_ADAPTIVE_H_
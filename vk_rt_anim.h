@@ -0,0 +1,220 @@
+#ifndef VK_RT_ANIM_H_
+#define VK_RT_ANIM_H_
+// samples gltf animations on the host, giving the world matrix of every node
+// at a point in time
+
+#include <math.h>
+
+typedef struct {
+  cgltf_data *data;
+  uint32_t animation; // index of the animation being played
+  float duration;
+
+  // one per node, column major like the rest of HMM
+  HMM_Mat4 *local;
+  HMM_Mat4 *world;
+  bool *world_done;
+
+  // morph target weights, max_targets per node
+  uint32_t max_targets;
+  float *weights;
+} vkrt_animator;
+
+vkrt_animator vkrt_animator_create(cgltf_data *data) {
+  vkrt_animator a = {
+    .data = data,
+    .local = calloc(sizeof(HMM_Mat4), data->nodes_count),
+    .world = calloc(sizeof(HMM_Mat4), data->nodes_count),
+    .world_done = calloc(sizeof(bool), data->nodes_count),
+  };
+  for (size_t i = 0; i < data->meshes_count; ++i) {
+    for (size_t j = 0; j < data->meshes[i].primitives_count; ++j) {
+      uint32_t targets = data->meshes[i].primitives[j].targets_count;
+      if (targets > a.max_targets) { a.max_targets = targets; }
+    }
+  }
+  a.weights = calloc(sizeof(float), data->nodes_count * a.max_targets + 1);
+  if (data->animations_count == 0) { return a; }
+  cgltf_animation anim = data->animations[a.animation];
+  for (size_t i = 0; i < anim.samplers_count; ++i) {
+    cgltf_accessor *input = anim.samplers[i].input;
+    if (input->has_max && input->max[0] > a.duration) {
+      a.duration = input->max[0];
+    }
+  }
+  return a;
+}
+
+bool vkrt_animator_playing(vkrt_animator *a) {
+  return a->data->animations_count > 0 && a->duration > 0;
+}
+
+// the keyframes of s either side of t, as the output elements holding their
+// values, and how far t is from the first to the second
+typedef struct {
+  size_t value0, value1;
+  float f;
+} vkrt_anim_keys;
+
+vkrt_anim_keys vkrt_anim_find_keys(cgltf_animation_sampler *s, float t) {
+  cgltf_accessor *input = s->input;
+  size_t k = 0;
+  float t0 = 0, t1 = 0;
+  // keyframe counts are small, a linear search will do
+  while (k + 1 < input->count) {
+    cgltf_accessor_read_float(input, k + 1, &t1, 1);
+    if (t1 > t) { break; }
+    k++;
+  }
+  size_t k1 = (k + 1 < input->count) ? k + 1 : k;
+  cgltf_accessor_read_float(input, k, &t0, 1);
+  cgltf_accessor_read_float(input, k1, &t1, 1);
+
+  float f = (t1 > t0) ? (t - t0) / (t1 - t0) : 0;
+  f = fminf(fmaxf(f, 0), 1);
+  if (s->interpolation == cgltf_interpolation_type_step) { f = 0; }
+
+  // cubic spline keys are stored as (in tangent, value, out tangent)
+  bool cubic = s->interpolation == cgltf_interpolation_type_cubic_spline;
+  size_t stride = cubic ? 3 : 1;
+  size_t offset = cubic ? 1 : 0;
+  return (vkrt_anim_keys) {
+    .value0 = k * stride + offset,
+    .value1 = k1 * stride + offset,
+    .f = f,
+  };
+}
+
+// interpolates the keyframes of s around t into out (comps floats per key),
+// cubic splines only use their values and ignore the tangents
+void vkrt_anim_sample(cgltf_animation_sampler *s, float t, uint32_t comps,
+		      bool rotation, float *out) {
+  assert(comps <= 4 && "Only vector outputs are supported");
+  vkrt_anim_keys keys = vkrt_anim_find_keys(s, t);
+  float a[4], b[4];
+  cgltf_accessor_read_float(s->output, keys.value0, a, comps);
+  cgltf_accessor_read_float(s->output, keys.value1, b, comps);
+  if (rotation) {
+    HMM_Quat qa = { .X = a[0], .Y = a[1], .Z = a[2], .W = a[3] };
+    HMM_Quat qb = { .X = b[0], .Y = b[1], .Z = b[2], .W = b[3] };
+    HMM_Quat q = HMM_SLerp(qa, keys.f, qb);
+    memcpy(out, q.Elements, 4 * sizeof(float));
+  } else {
+    for (uint32_t c = 0; c < comps; ++c) {
+      out[c] = a[c] + (b[c] - a[c]) * keys.f;
+    }
+  }
+}
+
+// weights are stored as one scalar per target per key, unlike the vector
+// outputs handled by vkrt_anim_sample
+void vkrt_anim_sample_weights(cgltf_animation_sampler *s, float t, uint32_t targets,
+			      float *out) {
+  vkrt_anim_keys keys = vkrt_anim_find_keys(s, t);
+  for (uint32_t i = 0; i < targets; ++i) {
+    float a = 0, b = 0;
+    cgltf_accessor_read_float(s->output, keys.value0 * targets + i, &a, 1);
+    cgltf_accessor_read_float(s->output, keys.value1 * targets + i, &b, 1);
+    out[i] = a + (b - a) * keys.f;
+  }
+}
+
+HMM_Mat4 vkrt_animator_world_node(vkrt_animator *a, size_t i) {
+  if (!a->world_done[i]) {
+    cgltf_node *parent = a->data->nodes[i].parent;
+    a->world[i] = parent ?
+      HMM_MulM4(vkrt_animator_world_node(a, cgltf_node_index(a->data, parent)),
+		a->local[i]) : a->local[i];
+    a->world_done[i] = true;
+  }
+  return a->world[i];
+}
+
+void vkrt_animator_sample(vkrt_animator *a, float time) {
+  cgltf_data *data = a->data;
+  size_t node_count = data->nodes_count;
+
+  // start from the rest pose
+  float (*t)[3] = calloc(sizeof(*t), node_count);
+  float (*r)[4] = calloc(sizeof(*r), node_count);
+  float (*s)[3] = calloc(sizeof(*s), node_count);
+  bool *animated = calloc(sizeof(bool), node_count);
+  for (size_t i = 0; i < node_count; ++i) {
+    cgltf_node *node = &data->nodes[i];
+    memcpy(t[i], node->has_translation ? node->translation : (float[3]){0, 0, 0},
+	   sizeof(t[i]));
+    memcpy(r[i], node->has_rotation ? node->rotation : (float[4]){0, 0, 0, 1},
+	   sizeof(r[i]));
+    memcpy(s[i], node->has_scale ? node->scale : (float[3]){1, 1, 1}, sizeof(s[i]));
+
+    float *w = &a->weights[i * a->max_targets];
+    memset(w, 0, a->max_targets * sizeof(float));
+    if (node->weights_count > 0) {
+      memcpy(w, node->weights, node->weights_count * sizeof(float));
+    } else if (node->mesh && node->mesh->weights_count > 0) {
+      memcpy(w, node->mesh->weights, node->mesh->weights_count * sizeof(float));
+    }
+  }
+
+  if (vkrt_animator_playing(a)) {
+    float time_in_anim = fmodf(time, a->duration);
+    cgltf_animation *anim = &data->animations[a->animation];
+    for (size_t i = 0; i < anim->channels_count; ++i) {
+      cgltf_animation_channel ch = anim->channels[i];
+      if (!ch.target_node) { continue; }
+      size_t n = cgltf_node_index(data, ch.target_node);
+      switch (ch.target_path) {
+      case cgltf_animation_path_type_translation: {
+	vkrt_anim_sample(ch.sampler, time_in_anim, 3, false, t[n]);
+      } break;
+      case cgltf_animation_path_type_rotation: {
+	vkrt_anim_sample(ch.sampler, time_in_anim, 4, true, r[n]);
+      } break;
+      case cgltf_animation_path_type_scale: {
+	vkrt_anim_sample(ch.sampler, time_in_anim, 3, false, s[n]);
+      } break;
+      case cgltf_animation_path_type_weights: {
+	cgltf_mesh *mesh = ch.target_node->mesh;
+	if (mesh && mesh->primitives_count > 0) {
+	  vkrt_anim_sample_weights(ch.sampler, time_in_anim,
+				   mesh->primitives[0].targets_count,
+				   &a->weights[n * a->max_targets]);
+	}
+      } break;
+      default: break;
+      }
+      // weights don't touch the node's transform
+      animated[n] |= ch.target_path != cgltf_animation_path_type_weights;
+    }
+  }
+
+  for (size_t i = 0; i < node_count; ++i) {
+    cgltf_node *node = &data->nodes[i];
+    if (node->has_matrix && !animated[i]) {
+      memcpy(a->local[i].Elements, node->matrix, 16 * sizeof(float));
+    } else {
+      HMM_Quat q = { .X = r[i][0], .Y = r[i][1], .Z = r[i][2], .W = r[i][3] };
+      a->local[i] = HMM_MulM4(HMM_Translate((HMM_Vec3){ t[i][0], t[i][1], t[i][2] }),
+			      HMM_MulM4(HMM_QToM4(q),
+					HMM_Scale((HMM_Vec3){ s[i][0], s[i][1], s[i][2] })));
+    }
+    a->world_done[i] = false;
+  }
+  for (size_t i = 0; i < node_count; ++i) {
+    vkrt_animator_world_node(a, i);
+  }
+
+  free(animated);
+  free(s);
+  free(r);
+  free(t);
+}
+
+void vkrt_animator_destroy(vkrt_animator *a) {
+  free(a->local);
+  free(a->world);
+  free(a->world_done);
+  free(a->weights);
+  *a = (vkrt_animator){};
+}
+#endif // VK_RT_ANIM_H_
@@ -0,0 +1,153 @@
+#ifndef VK_RT_BENCH_H_
+#define VK_RT_BENCH_H_
+// helpers for the headless benchmark modes: each frame is recorded into the
+// immediate buffer by a callback, timed with gpu timestamps, and the ray
+// counters written by the ray generation shaders are read back afterwards
+
+// one per frame slot, matches ray_stats_slot in shaders/ray_stats.glsl
+typedef struct {
+  uint32_t rays; // extension rays, the ones that move paths along
+  uint32_t shadow_rays; // next event estimation's, see shaders/shadow.glsl
+  uint32_t any_hits; // only counted when the push constants ask for it
+  uint32_t active_pixels; // listed by adaptive sampling, see vk_rt_adaptive.h
+} vkrt_ray_stats;
+
+typedef struct {
+  VkDevice device;
+  VmaAllocator allocator;
+  VkQueue queue;
+  vkw_immediate_submit_buffer immediate;
+  vkw_gpu_timer timer;
+  vkrt_memory ray_stats; // the bench uses slot 0
+} vkrt_bench;
+
+typedef struct {
+  uint32_t frames;
+  double gpu_ms;
+  uint64_t rays;
+  uint64_t shadow_rays;
+  uint64_t any_hits;
+} vkrt_bench_result;
+
+typedef void (*vkrt_bench_record_fn)(VkCommandBuffer cmd, uint32_t frame, void *user);
+
+vkrt_bench_result vkrt_bench_run(vkrt_bench *bench, uint32_t frames,
+				 vkrt_bench_record_fn record, void *user) {
+  vkrt_bench_result res = { .frames = frames };
+  vkrt_ray_stats *stats = bench->ray_stats.info.pMappedData;
+  uint64_t ticks[2];
+
+  for (uint32_t i = 0; i < frames; ++i) {
+    stats[0] = (vkrt_ray_stats){};
+    VK_CHECK(vmaFlushAllocation(bench->allocator, bench->ray_stats.allocation,
+				0, VK_WHOLE_SIZE));
+
+    VkCommandBuffer cmd = vkw_immediate_begin(bench->device, bench->immediate);
+    vkw_gpu_timer_reset(cmd, &bench->timer);
+    vkw_gpu_timer_mark(cmd, &bench->timer, 0);
+    record(cmd, i, user);
+    vkw_gpu_timer_mark(cmd, &bench->timer, 1);
+    vkh_host_read_barrier(cmd);
+    vkw_immediate_end(bench->device, bench->immediate, bench->queue);
+
+    if (vkw_gpu_timer_read(bench->device, &bench->timer, ticks)) {
+      res.gpu_ms += vkw_gpu_timer_ms(bench->timer, ticks, 0, 1);
+    }
+    VK_CHECK(vmaInvalidateAllocation(bench->allocator, bench->ray_stats.allocation,
+				     0, VK_WHOLE_SIZE));
+    res.rays += stats[0].rays;
+    res.shadow_rays += stats[0].shadow_rays;
+    res.any_hits += stats[0].any_hits;
+  }
+  return res;
+}
+
+// copies an rgba32f image (in the general layout) into a host visible buffer
+void vkrt_bench_read_image(vkrt_bench *bench, VkImage image, VkExtent2D extent,
+			   vkrt_memory dst) {
+  VkCommandBuffer cmd = vkw_immediate_begin(bench->device, bench->immediate);
+  vkh_transition_image(cmd, image, VK_IMAGE_LAYOUT_GENERAL,
+		       VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+  VkBufferImageCopy region = {
+    .imageSubresource = {
+      .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+      .layerCount = 1,
+    },
+    .imageExtent = { extent.width, extent.height, 1 },
+  };
+  vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, dst.buffer,
+			 1, &region);
+  vkh_transition_image(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkh_host_read_barrier(cmd);
+  vkw_immediate_end(bench->device, bench->immediate, bench->queue);
+  VK_CHECK(vmaInvalidateAllocation(bench->allocator, dst.allocation, 0, VK_WHOLE_SIZE));
+}
+
+// root mean square error over the rgb channels of two rgba images
+double vkrt_bench_rmse(const float *a, const float *b, uint64_t pixels) {
+  double sum = 0;
+  for (uint64_t i = 0; i < pixels; ++i) {
+    for (uint32_t c = 0; c < 3; ++c) {
+      double d = a[4 * i + c] - b[4 * i + c];
+      sum += d * d;
+    }
+  }
+  return pixels ? sqrt(sum / (3.0 * pixels)) : 0;
+}
+
+double vkrt_bench_ms_per_frame(vkrt_bench_result res) {
+  return res.frames ? res.gpu_ms / res.frames : 0;
+}
+
+// shadow rays are traced like any other, so they count too
+double vkrt_bench_mrays(vkrt_bench_result res) {
+  return res.gpu_ms > 0 ? (res.rays + res.shadow_rays) / (res.gpu_ms * 1000.0) : 0;
+}
+
+// how copies of the scene are laid out by the instance scaling benchmark
+typedef enum {
+  vkrt_bench_layout_grid,
+  vkrt_bench_layout_scatter,
+  vkrt_bench_layout_count,
+} vkrt_bench_layout;
+
+const char *vkrt_bench_layout_names[vkrt_bench_layout_count] = {
+  "grid", "scatter",
+};
+
+// small lcg so scattered layouts are the same on every run, returns [0, 1)
+float vkrt_bench_randf(uint32_t *state) {
+  *state = *state * 1664525u + 1013904223u;
+  return (*state >> 8) / 16777216.0f;
+}
+
+// transforms for copies of something centred at centre, either on a square
+// grid in the xz plane spacing apart or scattered over the same area with
+// random rotations about y, returns the width of that area
+float vkrt_bench_layout_transforms(vkrt_bench_layout layout, uint32_t copies,
+				   float spacing, HMM_Vec3 centre,
+				   VkTransformMatrixKHR *out) {
+  uint32_t side = (uint32_t)ceilf(sqrtf((float)copies));
+  float width = side * spacing;
+  uint32_t rng = 1;
+  HMM_Mat4 to_origin = HMM_Translate(HMM_MulV3F(centre, -1));
+  for (uint32_t i = 0; i < copies; ++i) {
+    HMM_Vec3 pos;
+    float angle = 0;
+    if (layout == vkrt_bench_layout_grid) {
+      pos = (HMM_Vec3){ (i % side + 0.5f) * spacing - width / 2, 0,
+			(i / side + 0.5f) * spacing - width / 2 };
+    } else {
+      pos = (HMM_Vec3){ (vkrt_bench_randf(&rng) - 0.5f) * width, 0,
+			(vkrt_bench_randf(&rng) - 0.5f) * width };
+      angle = vkrt_bench_randf(&rng) * 2 * M_PI;
+    }
+    HMM_Mat4 m = HMM_MulM4(HMM_Translate(pos),
+			   HMM_MulM4(HMM_Rotate_RH(angle, (HMM_Vec3){0, 1, 0}),
+				     to_origin));
+    out[i] = vkrt_transform_from_m4(m);
+  }
+  return width;
+}
+#endif // VK_RT_BENCH_H_
@@ -0,0 +1,37 @@
+#ifndef VK_RT_BUDGET_H_
+#define VK_RT_BUDGET_H_
+// the other way round from tiling (vk_rt_tiles.h): rather than splitting a
+// launch up, fits as many launches into a frame as a gpu time budget allows
+
+// works out how many launches (whole images or tiles) to record in a frame
+// from the gpu time the last ones took, measured with timestamps. the timings
+// arrive FRAME_OVERLAP frames late, so the count only grows gradually
+typedef struct {
+  float budget_ms; // gpu time per frame to fill, 0 turns the budget off
+  uint32_t max_launches;
+  double ms_per_launch; // smoothed, 0 until the first measurement
+  uint32_t launches; // picked for the last frame
+} vkrt_dispatch_budget;
+
+// other_ms is the rest of the frame's gpu work (skinning, refits, tlas)
+uint32_t vkrt_dispatch_budget_launches(vkrt_dispatch_budget *b, double other_ms) {
+  uint32_t n = 1;
+  if (b->budget_ms > 0 && b->ms_per_launch > 0) {
+    double fit = (b->budget_ms - other_ms) / b->ms_per_launch;
+    n = fit < 1 ? 1 : (uint32_t)fit;
+    uint32_t grow = 2 * (b->launches > 0 ? b->launches : 1);
+    if (n > grow) { n = grow; }
+    if (n > b->max_launches) { n = b->max_launches; }
+  }
+  b->launches = n;
+  return n;
+}
+
+// feeds back the trace time measured for a frame that recorded launches
+void vkrt_dispatch_budget_update(vkrt_dispatch_budget *b, double trace_ms,
+				 uint32_t launches) {
+  if (launches == 0 || trace_ms <= 0) { return; }
+  double per = trace_ms / launches;
+  b->ms_per_launch = b->ms_per_launch > 0 ? 0.8 * b->ms_per_launch + 0.2 * per : per;
+}
+#endif // VK_RT_BUDGET_H_
@@ -0,0 +1,159 @@
+#ifndef VK_RT_DENOISE_H_
+#define VK_RT_DENOISE_H_
+// edge-avoiding a-trous wavelet filter (dammertz et al. 2010) over the
+// accumulated image, run as a few compute passes with a growing step. the
+// edges come from the albedo, normal and depth of the first hit, which the
+// ray generation shader writes next to the colour
+
+// the images the ray generation shader writes the first hit into (bindings 8
+// and 9 of the trace set), averaged like the colour. albedo's a counts the
+// frames in the average
+typedef struct {
+  vkw_image albedo; // rgb
+  vkw_image normal_depth; // world space normal, w the distance from the camera
+} vkrt_aux_images;
+
+// matches the push constants in shaders/atrous.comp
+typedef struct {
+  uint32_t src; // index into the images of the set, 0 is the accumulated colour
+  uint32_t dst;
+  uint32_t step;
+  uint32_t flags; // vkrt_denoise_first | vkrt_denoise_last
+  float colour_phi;
+  float normal_phi;
+  float depth_phi;
+} vkrt_denoise_push_constants;
+
+enum {
+  vkrt_denoise_first = 1, // divide the albedo out, only lighting gets blurred
+  vkrt_denoise_last = 2, // and multiply it back in
+};
+
+typedef struct {
+  vkw_compute_pipeline pipeline;
+  VkDescriptorSetLayout layout;
+  VkDescriptorSet set;
+  VkExtent2D extent;
+  vkw_image ping[2];
+  float colour_phi; // edge stopping strengths, see shaders/atrous.comp
+  float normal_phi;
+  float depth_phi;
+} vkrt_denoiser;
+
+vkrt_aux_images vkrt_aux_images_create(VkDevice device, VmaAllocator allocator,
+				       VkExtent2D extent) {
+  VkExtent3D dims = { extent.width, extent.height, 1 };
+  // normal_depth is also copied into the reprojection history
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  return (vkrt_aux_images) {
+    .albedo = vkw_image_create(device, allocator, dims, VK_FORMAT_R16G16B16A16_SFLOAT,
+			       usage, false),
+    .normal_depth = vkw_image_create(device, allocator, dims,
+				     VK_FORMAT_R32G32B32A32_SFLOAT, usage, false),
+  };
+}
+
+void vkrt_aux_images_destroy(VkDevice device, VmaAllocator allocator,
+			     vkrt_aux_images *aux) {
+  vkw_image_destroy(device, allocator, aux->albedo);
+  vkw_image_destroy(device, allocator, aux->normal_depth);
+  *aux = (vkrt_aux_images){};
+}
+
+// colour is read, never written, so accumulation carries on underneath
+vkrt_denoiser vkrt_denoiser_create(VkDevice device, VmaAllocator allocator,
+				   vkw_immediate_submit_buffer immediate, VkQueue queue,
+				   vkw_descriptor_allocator *ds_alloc,
+				   vkw_image colour, vkrt_aux_images aux) {
+  vkrt_denoiser d = {
+    .extent = { colour.extent.width, colour.extent.height },
+    .colour_phi = 1.0f,
+    .normal_phi = 64.0f,
+    .depth_phi = 0.1f,
+  };
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  VkCommandBuffer cmd = vkw_immediate_begin(device, immediate);
+  for (uint32_t i = 0; i < 2; ++i) {
+    d.ping[i] = vkw_image_create(device, allocator, colour.extent,
+				 VK_FORMAT_R32G32B32A32_SFLOAT, usage, false);
+    vkh_transition_image(cmd, d.ping[i].image, VK_IMAGE_LAYOUT_UNDEFINED,
+			 VK_IMAGE_LAYOUT_GENERAL);
+  }
+  vkh_transition_image(cmd, aux.albedo.image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkh_transition_image(cmd, aux.normal_depth.image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkw_immediate_end(device, immediate, queue);
+
+  vkw_descriptor_layout_builder b = {};
+  vkw_descriptor_layout_builder_add2(&b, 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3);
+  vkw_descriptor_layout_builder_add(&b, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  vkw_descriptor_layout_builder_add(&b, 2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  d.layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_COMPUTE_BIT);
+  d.set = vkw_descriptor_allocator_alloc(ds_alloc, device, d.layout);
+
+  VkImageView views[3] = { colour.view, d.ping[0].view, d.ping[1].view };
+  vkrt_ds_writer writer = vkrt_ds_writer_create(5, d.set);
+  vkrt_ds_writer_add_images(&writer, 0, 3, views);
+  vkrt_ds_writer_add_image(&writer, 1, aux.albedo.view);
+  vkrt_ds_writer_add_image(&writer, 2, aux.normal_depth.view);
+  vkrt_ds_writer_write(device, writer);
+  vkrt_ds_writer_free(&writer);
+
+  VkShaderModule shader;
+  if (!vkh_load_shader_module("./shaders/atrous.spv", device, &shader)) {
+    fprintf(stderr, "Failed to load the denoise shader - please check it exists\n");
+    exit(1);
+  }
+  d.pipeline = vkw_compute_pipeline_create(device, d.layout, shader,
+					   sizeof(vkrt_denoise_push_constants));
+  vkDestroyShaderModule(device, shader, NULL);
+  return d;
+}
+
+// filters the image the tracer has just written (barriers included) and
+// returns the one holding the result, in the general layout. frames is how
+// many frames have been accumulated, the colour edges tighten as noise drops
+vkw_image *vkrt_denoiser_record(VkCommandBuffer cmd, vkrt_denoiser *d, uint32_t iterations,
+				uint32_t frames) {
+  vkh_memory_barrier(cmd, vkrt_trace_stage,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+  vkw_compute_pipeline_bind(cmd, d->pipeline, d->set);
+  uint32_t src = 0;
+  for (uint32_t i = 0; i < iterations; ++i) {
+    uint32_t dst = src == 1 ? 2 : 1;
+    vkrt_denoise_push_constants pcs = {
+      .src = src,
+      .dst = dst,
+      .step = 1u << i,
+      .flags = (i == 0 ? vkrt_denoise_first : 0) |
+               (i + 1 == iterations ? vkrt_denoise_last : 0),
+      // halved every iteration, as the wider steps have already smoothed
+      .colour_phi = d->colour_phi / (float)(1u << i) / (frames > 0 ? frames : 1),
+      .normal_phi = d->normal_phi,
+      .depth_phi = d->depth_phi,
+    };
+    vkw_compute_pipeline_push_constants(cmd, d->pipeline, &pcs);
+    vkCmdDispatch(cmd, (d->extent.width + 7) / 8, (d->extent.height + 7) / 8, 1);
+    vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		       VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		       VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+		       VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		       VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+		       VK_ACCESS_2_TRANSFER_READ_BIT);
+    src = dst;
+  }
+  return src == 0 ? NULL : &d->ping[src - 1];
+}
+
+void vkrt_denoiser_destroy(VkDevice device, VmaAllocator allocator, vkrt_denoiser *d) {
+  vkw_compute_pipeline_destroy(device, d->pipeline);
+  vkDestroyDescriptorSetLayout(device, d->layout, NULL);
+  for (uint32_t i = 0; i < 2; ++i) {
+    vkw_image_destroy(device, allocator, d->ping[i]);
+  }
+  *d = (vkrt_denoiser){};
+}
+#endif // VK_RT_DENOISE_H_
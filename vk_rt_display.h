@@ -0,0 +1,119 @@
+#ifndef VK_RT_DISPLAY_H_
+#define VK_RT_DISPLAY_H_
+// puts the accumulated (or denoised) image on screen: a compute pass
+// (shaders/tonemap.comp) tonemaps it straight into the swapchain image, which
+// needs storage usage. accumulation stays in its own float image, the
+// swapchain image is only written. where the surface or its format can't be
+// stored to, the image is blitted as before
+
+typedef enum {
+  vkrt_tonemap_clamp, // what the blit does, values over 1 clip
+  vkrt_tonemap_reinhard,
+  vkrt_tonemap_aces, // narkowicz's fit of the aces filmic curve
+  vkrt_tonemap_count,
+} vkrt_tonemap_op;
+
+const char *vkrt_tonemap_names[vkrt_tonemap_count] = {
+  "clamp", "reinhard", "aces",
+};
+
+// matches the push constants in shaders/tonemap.comp
+typedef struct {
+  float exposure;
+  uint32_t op; // vkrt_tonemap_op
+} vkrt_tonemap_push_constants;
+
+typedef struct {
+  vkw_compute_pipeline pipeline;
+  VkDescriptorSetLayout layout;
+  // one per frame in flight, pointed at that frame's images as it's recorded
+  VkDescriptorSet *sets;
+  uint32_t set_count;
+  float exposure;
+  vkrt_tonemap_op op;
+} vkrt_display;
+
+// whether swapchain images of format can be written by the pass. it writes
+// them without a format qualifier, so any colour format works if the device
+// can store to it that way
+bool vkrt_display_supported(VkPhysicalDevice physical_device, VkSurfaceKHR surface,
+			    VkFormat format) {
+  VkSurfaceCapabilitiesKHR caps;
+  VK_CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &caps));
+  VkFormatProperties3 props3 = {
+    .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_3,
+  };
+  vkGetPhysicalDeviceFormatProperties2(physical_device, format, &(VkFormatProperties2) {
+      .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+      .pNext = &props3,
+    });
+  VkFormatFeatureFlags2 needed = VK_FORMAT_FEATURE_2_STORAGE_IMAGE_BIT |
+    VK_FORMAT_FEATURE_2_STORAGE_WRITE_WITHOUT_FORMAT_BIT;
+  return (caps.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) &&
+    (props3.optimalTilingFeatures & needed) == needed;
+}
+
+vkrt_display vkrt_display_create(VkDevice device, vkw_descriptor_allocator *ds_alloc,
+				 uint32_t frames_in_flight) {
+  vkrt_display d = {
+    .set_count = frames_in_flight,
+    .exposure = 1.0f,
+  };
+  vkw_descriptor_layout_builder b = {};
+  vkw_descriptor_layout_builder_add(&b, 0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  vkw_descriptor_layout_builder_add(&b, 1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+  d.layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_COMPUTE_BIT);
+  d.sets = calloc(sizeof(VkDescriptorSet), frames_in_flight);
+  for (uint32_t i = 0; i < frames_in_flight; ++i) {
+    d.sets[i] = vkw_descriptor_allocator_alloc(ds_alloc, device, d.layout);
+  }
+
+  VkShaderModule shader;
+  if (!vkh_load_shader_module("./shaders/tonemap.spv", device, &shader)) {
+    fprintf(stderr, "Failed to load the tonemap shader - please check it exists\n");
+    exit(1);
+  }
+  d.pipeline = vkw_compute_pipeline_create(device, d.layout, shader,
+					   sizeof(vkrt_tonemap_push_constants));
+  vkDestroyShaderModule(device, shader, NULL);
+  return d;
+}
+
+// tonemaps src (in the general layout, just written by the tracer or the
+// denoiser) into the swapchain image, scaling it to the swapchain's size.
+// leaves the swapchain image ready to draw the ui over. slot is the frame in
+// flight, whose previous commands must have finished
+void vkrt_display_record(VkCommandBuffer cmd, VkDevice device, vkrt_display *d,
+			 uint32_t slot, vkw_image *src, VkImage swapchain_image,
+			 VkImageView swapchain_view, VkExtent2D swapchain_extent) {
+  VkDescriptorSet set = d->sets[slot];
+  vkrt_ds_writer writer = vkrt_ds_writer_create(2, set);
+  vkrt_ds_writer_add_image(&writer, 0, src->view);
+  vkrt_ds_writer_add_image(&writer, 1, swapchain_view);
+  vkrt_ds_writer_write(device, writer);
+  vkrt_ds_writer_free(&writer);
+
+  vkh_memory_barrier(cmd, vkrt_trace_stage | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+  vkh_transition_image(cmd, swapchain_image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkrt_tonemap_push_constants pcs = {
+    .exposure = d->exposure,
+    .op = d->op,
+  };
+  vkw_compute_pipeline_bind(cmd, d->pipeline, set);
+  vkw_compute_pipeline_push_constants(cmd, d->pipeline, &pcs);
+  vkCmdDispatch(cmd, (swapchain_extent.width + 7) / 8, (swapchain_extent.height + 7) / 8, 1);
+  vkh_transition_image(cmd, swapchain_image, VK_IMAGE_LAYOUT_GENERAL,
+		       VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+}
+
+void vkrt_display_destroy(VkDevice device, vkrt_display *d) {
+  vkw_compute_pipeline_destroy(device, d->pipeline);
+  vkDestroyDescriptorSetLayout(device, d->layout, NULL);
+  free(d->sets);
+  *d = (vkrt_display){};
+}
+#endif // VK_RT_DISPLAY_H_
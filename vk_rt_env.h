@@ -0,0 +1,141 @@
+#ifndef VK_RT_ENV_H_
+#define VK_RT_ENV_H_
+// an hdr environment map around the scene, a lat-long image lighting whatever
+// the paths miss (shaders/environment.glsl). next event estimation picks its
+// texels through an alias table over their luminance times the solid angle
+// they cover, like the emissive triangles of vk_rt_lights.h. loaded with
+// stb_image, so radiance .hdr files (and ldr images) but not .exr
+
+// the buffer starts with this, followed by a vkrt_env_texel per texel, top row
+// (+y) first
+typedef struct {
+  uint32_t width; // 0 without an environment, which is black
+  uint32_t height;
+  float strength; // the image is scaled by this
+  uint32_t pad;
+} vkrt_env_header;
+
+// matches env_texel_t in shaders/environment.glsl
+typedef struct {
+  float pdf; // chance of picking the texel
+  float alias_prob;
+  uint32_t alias;
+} vkrt_env_texel;
+
+typedef struct {
+  vkw_image image; // shared exponent rgb, sampled with the u wrapping around
+  vkrt_memory buffer; // trace set binding 18
+  uint32_t width, height;
+} vkrt_env;
+
+// packs into VK_FORMAT_E5B9G9R9_UFLOAT_PACK32, four bytes a texel like the
+// textures vkw_image_create_data uploads, but with the range of a float
+uint32_t vkrt_pack_rgb9e5(const float *rgb) {
+  const float max_value = 65408.0f; // 511 / 512 * 2^16
+  float c[3];
+  float max_c = 0;
+  for (uint32_t i = 0; i < 3; ++i) {
+    c[i] = rgb[i] > 0 ? (rgb[i] < max_value ? rgb[i] : max_value) : 0; // nan too
+    max_c = c[i] > max_c ? c[i] : max_c;
+  }
+  if (max_c == 0) { return 0; }
+  int e;
+  frexpf(max_c, &e); // max_c is in [2^(e-1), 2^e)
+  int exponent = (e - 1 > -16 ? e - 1 : -16) + 16;
+  float scale = ldexpf(1.0f, exponent - 15 - 9);
+  if ((uint32_t)floorf(max_c / scale + 0.5f) == 512) {
+    scale *= 2;
+    exponent += 1;
+  }
+  uint32_t res = (uint32_t)exponent << 27;
+  for (uint32_t i = 0; i < 3; ++i) {
+    res |= (uint32_t)floorf(c[i] / scale + 0.5f) << (9 * i);
+  }
+  return res;
+}
+
+// without a path the environment is black, the bindings still get something
+vkrt_env vkrt_env_load(VkDevice device, VmaAllocator allocator,
+		       vkw_immediate_submit_buffer immediate, VkQueue queue,
+		       const char *path, float strength) {
+  vkrt_env env = {};
+  float *pixels = NULL;
+  int w = 1, h = 1;
+  if (path) {
+    int c;
+    pixels = stbi_loadf(path, &w, &h, &c, 3);
+    if (!pixels) {
+      fprintf(stderr, "Failed to load the environment map %s: %s\n", path,
+	      stbi_failure_reason());
+      exit(1);
+    }
+    env.width = w;
+    env.height = h;
+  }
+
+  uint32_t texels = w * h;
+  uint32_t *packed = calloc(sizeof(uint32_t), texels);
+  float *pdf = calloc(sizeof(float), texels);
+  float *alias_prob = calloc(sizeof(float), texels);
+  uint32_t *alias = calloc(sizeof(uint32_t), texels);
+  float total = 0;
+  for (uint32_t y = 0; pixels && y < (uint32_t)h; ++y) {
+    // rows near the poles cover less of the sphere
+    float sin_theta = sinf((float)HMM_PI * (y + 0.5f) / h);
+    for (uint32_t x = 0; x < (uint32_t)w; ++x) {
+      uint32_t i = y * w + x;
+      packed[i] = vkrt_pack_rgb9e5(&pixels[3 * i]);
+      pdf[i] = vkrt_luminance(&pixels[3 * i]) * sin_theta;
+      total += pdf[i];
+    }
+  }
+  vkrt_build_alias_table(texels, total, pdf, alias_prob, alias);
+
+  size_t size = sizeof(vkrt_env_header) + texels * sizeof(vkrt_env_texel);
+  uint8_t *data = calloc(size, 1);
+  *(vkrt_env_header *)data = (vkrt_env_header) {
+    .width = env.width,
+    .height = env.height,
+    .strength = strength,
+  };
+  vkrt_env_texel *out = (vkrt_env_texel *)(data + sizeof(vkrt_env_header));
+  for (uint32_t i = 0; i < texels; ++i) {
+    out[i] = (vkrt_env_texel) { pdf[i], alias_prob[i], alias[i] };
+  }
+  env.buffer = vkrt_allocate_memory(device, allocator, size, data,
+				    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+				    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+
+  VkExtent3D dims = { w, h, 1 };
+  env.image = vkw_image_create_data(device, allocator, immediate, queue, dims,
+				    VK_FORMAT_E5B9G9R9_UFLOAT_PACK32,
+				    VK_IMAGE_USAGE_SAMPLED_BIT, false, packed);
+  // the default sampler mirrors, which would show at the seam behind the
+  // camera and at the poles
+  vkDestroySampler(device, env.image.sampler, NULL);
+  VkSamplerCreateInfo sampler_info = {
+    .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .magFilter = VK_FILTER_LINEAR,
+    .minFilter = VK_FILTER_LINEAR,
+    .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+    .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+    .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+  };
+  VK_CHECK(vkCreateSampler(device, &sampler_info, NULL, &env.image.sampler));
+
+  free(data);
+  free(alias);
+  free(alias_prob);
+  free(pdf);
+  free(packed);
+  stbi_image_free(pixels);
+  return env;
+}
+
+void vkrt_env_destroy(VkDevice device, VmaAllocator allocator, vkrt_env *env) {
+  vkw_image_destroy(device, allocator, env->image);
+  vkrt_memory_free(allocator, env->buffer);
+  *env = (vkrt_env){};
+}
+#endif // VK_RT_ENV_H_
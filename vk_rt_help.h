@@ -1,6 +1,7 @@
 #ifndef VK_RT_HELP_H_
 #define VK_RT_HELP_H_
 #include <assert.h>
+#include <time.h>
 
 #include "vk_mem_alloc.h"
 #include "vulkan/vulkan.h"
@@ -14,7 +15,23 @@ PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceA
 PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHRp;
 PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHRp;
 PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHRp;
+PFN_vkCmdTraceRaysIndirectKHR vkCmdTraceRaysIndirectKHRp;
 PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHRp;
+PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHRp;
+PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHRp;
+// host builds, only usable with accelerationStructureHostCommands
+PFN_vkBuildAccelerationStructuresKHR vkBuildAccelerationStructuresKHRp;
+PFN_vkWriteAccelerationStructuresPropertiesKHR vkWriteAccelerationStructuresPropertiesKHRp;
+PFN_vkCopyAccelerationStructureKHR vkCopyAccelerationStructureKHRp;
+PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperationKHRp;
+PFN_vkDestroyDeferredOperationKHR vkDestroyDeferredOperationKHRp;
+PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoinKHRp;
+PFN_vkGetDeferredOperationResultKHR vkGetDeferredOperationResultKHRp;
+
+// the stage the tracing runs in, which the barriers around launches wait on.
+// the ray query backend traces from compute shaders, and the ray tracing
+// stage can't be named in barriers without ray tracing pipelines
+VkPipelineStageFlags2 vkrt_trace_stage = VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR;
 
 #define VK_RESOLVE_DEVICE_PFN(device, pfn) \
   pfn##p = (PFN_##pfn)vkGetDeviceProcAddr(device, #pfn);
@@ -27,7 +44,17 @@ void vkrt_get_device_functions(VkDevice device) {
   VK_RESOLVE_DEVICE_PFN(device, vkCreateRayTracingPipelinesKHR);
   VK_RESOLVE_DEVICE_PFN(device, vkGetRayTracingShaderGroupHandlesKHR);
   VK_RESOLVE_DEVICE_PFN(device, vkCmdTraceRaysKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkCmdTraceRaysIndirectKHR);
   VK_RESOLVE_DEVICE_PFN(device, vkDestroyAccelerationStructureKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkCmdWriteAccelerationStructuresPropertiesKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkCmdCopyAccelerationStructureKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkBuildAccelerationStructuresKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkWriteAccelerationStructuresPropertiesKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkCopyAccelerationStructureKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkCreateDeferredOperationKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkDestroyDeferredOperationKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkDeferredOperationJoinKHR);
+  VK_RESOLVE_DEVICE_PFN(device, vkGetDeferredOperationResultKHR);
 }
 
 typedef struct {
@@ -69,6 +96,30 @@ vkrt_allocate_memory(VkDevice device, VmaAllocator allocator, uint64_t size,
   return res;
 }
 
+// like vkrt_allocate_memory but in memory the host can't see, for what only
+// the gpu reads and writes (the host can still fill it with transfer commands)
+vkrt_memory vkrt_allocate_device_memory(VkDevice device, VmaAllocator allocator,
+					uint64_t size, VkBufferUsageFlagBits usage) {
+  VkBufferCreateInfo info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+    .size = size,
+    .usage = usage,
+  };
+  VmaAllocationCreateInfo vma_info = {
+    .usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+  };
+
+  vkrt_memory res = {};
+  VK_CHECK(vmaCreateBuffer(allocator, &info, &vma_info, &res.buffer, &res.allocation,
+			   &res.info));
+  VkBufferDeviceAddressInfo addr_info = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+    .buffer = res.buffer,
+  };
+  res.device_address = vkGetBufferDeviceAddress(device, &addr_info);
+  return res;
+}
+
 void vkrt_memory_free(VmaAllocator allocator, vkrt_memory memory) {
   vmaDestroyBuffer(allocator, memory.buffer, memory.allocation);
 }
@@ -76,31 +127,164 @@ void vkrt_memory_free(VmaAllocator allocator, vkrt_memory memory) {
 typedef struct {
   VkAccelerationStructureKHR as;
   vkrt_as_memory memory;
-  uint32_t handle;
+  VkDeviceAddress handle;
+  VkDeviceSize size;
+  VkBuildAccelerationStructureFlagsKHR flags; // what the as was built with
+  VkDeviceSize scratch_size; // enough for an in place rebuild or an update
 } vkrt_as;
 
+// wall clock in milliseconds, used for timing host side work (builds etc.)
+double vkrt_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 typedef enum {
   vkrt_as_bottom = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
   vkrt_as_top = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
 } vkrt_as_level;
 
+void vkrt_destroy_as(VkDevice device, VmaAllocator allocator, vkrt_as as) {
+  vkrt_memory_free(allocator, as.memory);
+  vkDestroyAccelerationStructureKHRp(device, as.as, NULL);
+}
+
+// build profiles are combinations of these flags, written like
+// "fast-trace+allow-compaction"
+typedef struct {
+  const char *name;
+  VkBuildAccelerationStructureFlagsKHR flag;
+} vkrt_as_flag_name;
+
+#define VKRT_AS_FLAG_NAME_COUNT 5
+const vkrt_as_flag_name vkrt_as_flag_names[VKRT_AS_FLAG_NAME_COUNT] = {
+  { "fast-trace", VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR },
+  { "fast-build", VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR },
+  { "low-memory", VK_BUILD_ACCELERATION_STRUCTURE_LOW_MEMORY_BIT_KHR },
+  { "allow-update", VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR },
+  { "allow-compaction", VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR },
+};
+
+// returns false if a name is unknown or fast-trace and fast-build are both set
+bool vkrt_as_flags_from_string(const char *str,
+			       VkBuildAccelerationStructureFlagsKHR *flags) {
+  VkBuildAccelerationStructureFlagsKHR res = 0;
+  while (*str) {
+    size_t len = strcspn(str, "+");
+    bool found = false;
+    for (uint32_t i = 0; i < VKRT_AS_FLAG_NAME_COUNT; ++i) {
+      if (strlen(vkrt_as_flag_names[i].name) == len &&
+	  strncmp(str, vkrt_as_flag_names[i].name, len) == 0) {
+	res |= vkrt_as_flag_names[i].flag;
+	found = true;
+      }
+    }
+    if (!found) { return false; }
+    str += len + (str[len] == '+');
+  }
+  VkBuildAccelerationStructureFlagsKHR both =
+    VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+    VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR;
+  if ((res & both) == both) { return false; }
+  *flags = res;
+  return true;
+}
+
+void vkrt_as_flags_to_string(VkBuildAccelerationStructureFlagsKHR flags,
+			     char *buf, size_t size) {
+  size_t len = 0;
+  buf[0] = 0;
+  for (uint32_t i = 0; i < VKRT_AS_FLAG_NAME_COUNT; ++i) {
+    if (flags & vkrt_as_flag_names[i].flag) {
+      len += snprintf(buf + len, len < size ? size - len : 0, "%s%s",
+		      len ? "+" : "", vkrt_as_flag_names[i].name);
+    }
+  }
+}
+
 VkAccelerationStructureBuildGeometryInfoKHR
 vkrt_as_build_geometry_info(vkrt_as_level lvl, uint64_t geom_cnt,
-			    const VkAccelerationStructureGeometryKHR *geoms) {
+			    const VkAccelerationStructureGeometryKHR *geoms,
+			    VkBuildAccelerationStructureFlagsKHR flags) {
   return (VkAccelerationStructureBuildGeometryInfoKHR) {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
     .type = lvl,
-    .flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+    .flags = flags,
     .geometryCount = geom_cnt,
     .pGeometries = geoms,
   };
 }
 
+// replaces as with a copy that only takes up its compacted size, as must have
+// been built with VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR
+void vkrt_compact_as(VkDevice device, VmaAllocator allocator, VkQueue queue,
+		     vkw_immediate_submit_buffer immediate, vkrt_as_level lvl,
+		     vkrt_as *as) {
+  VkQueryPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+    .queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+    .queryCount = 1,
+  };
+  VkQueryPool pool;
+  VK_CHECK(vkCreateQueryPool(device, &pool_info, NULL, &pool));
+
+  VkCommandBuffer cmd = vkw_immediate_begin(device, immediate);
+  vkCmdResetQueryPool(cmd, pool, 0, 1);
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+  vkCmdWriteAccelerationStructuresPropertiesKHRp(cmd, 1, &as->as,
+						 VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+						 pool, 0);
+  vkw_immediate_end(device, immediate, queue);
+
+  VkDeviceSize compact_size = 0;
+  VK_CHECK(vkGetQueryPoolResults(device, pool, 0, 1, sizeof(compact_size),
+				 &compact_size, sizeof(compact_size),
+				 VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+  vkDestroyQueryPool(device, pool, NULL);
+  if (compact_size == 0 || compact_size >= as->size) { return; }
+
+  vkrt_as compact = { .size = compact_size, .flags = as->flags };
+  compact.memory =
+    vkrt_allocate_memory(device, allocator, compact_size, NULL,
+			 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
+			 | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  VkAccelerationStructureCreateInfoKHR as_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+    .buffer = compact.memory.buffer,
+    .size = compact_size,
+    .type = lvl,
+  };
+  VK_CHECK(vkCreateAccelerationStructureKHRp(device, &as_info, NULL, &compact.as));
+
+  VkCopyAccelerationStructureInfoKHR copy_info = {
+    .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+    .src = as->as,
+    .dst = compact.as,
+    .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR,
+  };
+  cmd = vkw_immediate_begin(device, immediate);
+  vkCmdCopyAccelerationStructureKHRp(cmd, &copy_info);
+  vkw_immediate_end(device, immediate, queue);
+
+  VkAccelerationStructureDeviceAddressInfoKHR device_addr_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+    .accelerationStructure = compact.as,
+  };
+  compact.handle = vkGetAccelerationStructureDeviceAddressKHRp(device, &device_addr_info);
+
+  vkrt_destroy_as(device, allocator, *as);
+  *as = compact;
+}
+
 vkrt_as vkrt_create_as(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
 		       vkw_immediate_submit_buffer immediate, vkrt_as_level lvl,
 		       VkAccelerationStructureBuildGeometryInfoKHR geom_info,
 		       uint32_t primitive_count) {  
-  vkrt_as as;
+  vkrt_as as = { .flags = geom_info.flags };
   VkAccelerationStructureBuildSizesInfoKHR as_build_sizes_info = {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
   };
@@ -114,6 +298,10 @@ vkrt_as vkrt_create_as(VkDevice device, VmaAllocator allocator, VkQueue scratch_
 			 as_build_sizes_info.accelerationStructureSize, NULL,
 			 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
 			 | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  as.size = as_build_sizes_info.accelerationStructureSize;
+  as.scratch_size = as_build_sizes_info.buildScratchSize >
+    as_build_sizes_info.updateScratchSize ? as_build_sizes_info.buildScratchSize :
+    as_build_sizes_info.updateScratchSize;
   VkAccelerationStructureCreateInfoKHR as_info = {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
     .buffer = as.memory.buffer,
@@ -150,6 +338,10 @@ vkrt_as vkrt_create_as(VkDevice device, VmaAllocator allocator, VkQueue scratch_
 
   vkrt_memory_free(allocator, as_scratch_buffer);
 
+  if (as.flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+    vkrt_compact_as(device, allocator, scratch_queue, immediate, lvl, &as);
+  }
+
   return as;
 }
 
@@ -158,7 +350,7 @@ vkrt_as vkrt_create_as2(VkDevice device, VmaAllocator allocator, VkQueue scratch
 			VkAccelerationStructureBuildGeometryInfoKHR geom_info,
 			uint32_t build_range_info_count, uint32_t *primitive_counts,
 			const VkAccelerationStructureBuildRangeInfoKHR **pp_build_range_infos) {
-  vkrt_as as;
+  vkrt_as as = { .flags = geom_info.flags };
   VkAccelerationStructureBuildSizesInfoKHR as_build_sizes_info = {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
   };
@@ -173,6 +365,10 @@ vkrt_as vkrt_create_as2(VkDevice device, VmaAllocator allocator, VkQueue scratch
 			 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
 			 | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
 
+  as.size = as_build_sizes_info.accelerationStructureSize;
+  as.scratch_size = as_build_sizes_info.buildScratchSize >
+    as_build_sizes_info.updateScratchSize ? as_build_sizes_info.buildScratchSize :
+    as_build_sizes_info.updateScratchSize;
   VkAccelerationStructureCreateInfoKHR as_info = {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
     .buffer = as.memory.buffer,
@@ -204,12 +400,11 @@ vkrt_as vkrt_create_as2(VkDevice device, VmaAllocator allocator, VkQueue scratch
 
   vkrt_memory_free(allocator, as_scratch_buffer);
 
-  return as;
-}
+  if (as.flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+    vkrt_compact_as(device, allocator, scratch_queue, immediate, lvl, &as);
+  }
 
-void vkrt_destroy_as(VkDevice device, VmaAllocator allocator, vkrt_as as) {
-  vkrt_memory_free(allocator, as.memory);
-  vkDestroyAccelerationStructureKHRp(device, as.as, NULL);
+  return as;
 }
 
 typedef struct {
@@ -233,6 +428,7 @@ typedef struct {
   uint32_t primitive_count;
   //
   vkrt_memory transform_buffer;
+  bool non_opaque; // alpha masked, so hits go through the any-hit shader
 } vkrt_geom_data_gpu;
 /*
 vkrt_geom_data_gpu vkrt_load_gltf_mesh_gpu(VkDevice device, VmaAllocator allocator,
@@ -392,10 +588,62 @@ void vkrt_geom_data_gpu_free(VmaAllocator allocator, vkrt_geom_data_gpu data) {
   vkrt_memory_free(allocator, data.transform_buffer);
 }
 
+VkAccelerationStructureGeometryKHR vkrt_blas_geometry(vkrt_geom_data_gpu geom) {
+  return (VkAccelerationStructureGeometryKHR) {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+    .flags = geom.non_opaque ? 0 : VK_GEOMETRY_OPAQUE_BIT_KHR,
+    .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
+    .geometry.triangles.sType =
+    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+    .geometry.triangles.vertexData = geom.vertex_buffer.device_address,
+    .geometry.triangles.indexData = geom.index_buffer.device_address,
+    .geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
+    .geometry.triangles.maxVertex = geom.vertex_count,
+    .geometry.triangles.vertexStride = geom.vertex_stride,
+    .geometry.triangles.indexType = VK_INDEX_TYPE_UINT32,
+    .geometry.triangles.transformData = geom.transform_buffer.device_address,
+  };
+}
+
+// records a refit (update set, needs ALLOW_UPDATE) or in place rebuild of a
+// blas from the same geometry it was created with, e.g. after the vertices
+// have been skinned, the caller is responsible for the barriers around it
+void vkrt_record_blas_build(VkCommandBuffer cmd, vkrt_as *blas, uint32_t geom_data_cnt,
+			    vkrt_geom_data_gpu *geom_datas, VkDeviceAddress scratch,
+			    bool update) {
+  VkAccelerationStructureGeometryKHR *as_geom_infos =
+    calloc(sizeof(*as_geom_infos), geom_data_cnt);
+  VkAccelerationStructureBuildRangeInfoKHR *p_build_range_infos =
+    calloc(sizeof(*p_build_range_infos), geom_data_cnt);
+  for (uint32_t i = 0; i < geom_data_cnt; ++i) {
+    as_geom_infos[i] = vkrt_blas_geometry(geom_datas[i]);
+    p_build_range_infos[i] = (VkAccelerationStructureBuildRangeInfoKHR) {
+      .primitiveCount = geom_datas[i].primitive_count,
+    };
+  }
+
+  VkAccelerationStructureBuildGeometryInfoKHR geom_info =
+    vkrt_as_build_geometry_info(vkrt_as_bottom, geom_data_cnt, as_geom_infos,
+				blas->flags);
+  geom_info.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR :
+    VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+  geom_info.srcAccelerationStructure = update ? blas->as : VK_NULL_HANDLE;
+  geom_info.dstAccelerationStructure = blas->as;
+  geom_info.scratchData.deviceAddress = scratch;
+
+  // all the ranges of one build are passed as one array
+  const VkAccelerationStructureBuildRangeInfoKHR *ranges = p_build_range_infos;
+  vkCmdBuildAccelerationStructuresKHRp(cmd, 1, &geom_info, &ranges);
+
+  free(p_build_range_infos);
+  free(as_geom_infos);
+}
+
 vkrt_as
 vkrt_create_blas2(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
 		  vkw_immediate_submit_buffer immediate, uint32_t geom_data_cnt,
-		  vkrt_geom_data_gpu *geom_datas) {
+		  vkrt_geom_data_gpu *geom_datas,
+		  VkBuildAccelerationStructureFlagsKHR flags) {
   assert(geom_data_cnt >= 1 && "Must be at least 1 geometry");
 
   VkAccelerationStructureGeometryKHR *as_geom_infos =
@@ -410,20 +658,7 @@ vkrt_create_blas2(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue
   uint32_t *primitive_counts = calloc(sizeof(uint32_t), geom_data_cnt);
 
   for (uint32_t i = 0; i < geom_data_cnt; ++i) {
-    as_geom_infos[i] = (VkAccelerationStructureGeometryKHR) {
-      .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-      .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
-      .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
-      .geometry.triangles.sType =
-      VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
-      .geometry.triangles.vertexData = geom_datas[i].vertex_buffer.device_address,
-      .geometry.triangles.indexData = geom_datas[i].index_buffer.device_address,
-      .geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
-      .geometry.triangles.maxVertex = geom_datas[i].vertex_count,
-      .geometry.triangles.vertexStride = geom_datas[i].vertex_stride,
-      .geometry.triangles.indexType = VK_INDEX_TYPE_UINT32,
-      .geometry.triangles.transformData = geom_datas[i].transform_buffer.device_address,
-    };
+    as_geom_infos[i] = vkrt_blas_geometry(geom_datas[i]);
     p_build_range_infos[i] = (VkAccelerationStructureBuildRangeInfoKHR) {
       .firstVertex = 0,
       .primitiveOffset = 0,
@@ -435,12 +670,13 @@ vkrt_create_blas2(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue
   }
   
   VkAccelerationStructureBuildGeometryInfoKHR as_build_geom_info =
-    vkrt_as_build_geometry_info(vkrt_as_bottom, geom_data_cnt, as_geom_infos);
+    vkrt_as_build_geometry_info(vkrt_as_bottom, geom_data_cnt, as_geom_infos, flags);
 
   vkrt_as blas = vkrt_create_as2(device, allocator, scratch_queue, immediate,
 				 vkrt_as_bottom, as_build_geom_info, geom_data_cnt,
 				 primitive_counts, pp_build_range_infos);
 
+  free(primitive_counts);
   free(pp_build_range_infos);
   free(p_build_range_infos);
   free(as_geom_infos);
@@ -448,6 +684,32 @@ vkrt_create_blas2(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue
   return blas;
 }
 
+// builds a blas of aabb_cnt VkAabbPositionsKHR boxes from aabb_buffer, the
+// primitives inside them are found by the intersection shader of the hit group
+vkrt_as
+vkrt_create_aabb_blas(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
+		      vkw_immediate_submit_buffer immediate, vkrt_memory aabb_buffer,
+		      uint32_t aabb_cnt, VkBuildAccelerationStructureFlagsKHR flags) {
+  assert(aabb_cnt >= 1 && "Must be at least 1 aabb");
+  VkAccelerationStructureGeometryKHR as_geom_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+    .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
+    .geometryType = VK_GEOMETRY_TYPE_AABBS_KHR,
+    .geometry.aabbs.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_AABBS_DATA_KHR,
+    .geometry.aabbs.data = aabb_buffer.device_address,
+    .geometry.aabbs.stride = sizeof(VkAabbPositionsKHR),
+  };
+  VkAccelerationStructureBuildRangeInfoKHR build_range_info = {
+    .primitiveCount = aabb_cnt,
+  };
+  const VkAccelerationStructureBuildRangeInfoKHR *p_build_range_info = &build_range_info;
+
+  VkAccelerationStructureBuildGeometryInfoKHR as_build_geom_info =
+    vkrt_as_build_geometry_info(vkrt_as_bottom, 1, &as_geom_info, flags);
+  return vkrt_create_as2(device, allocator, scratch_queue, immediate, vkrt_as_bottom,
+			 as_build_geom_info, 1, &aabb_cnt, &p_build_range_info);
+}
+
 vkrt_as
 vkrt_create_blas3(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
 		  vkw_immediate_submit_buffer immediate, vkrt_memory vertex_buffer,
@@ -483,7 +745,8 @@ vkrt_create_blas3(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue
   };
   
   VkAccelerationStructureBuildGeometryInfoKHR as_build_geom_info =
-    vkrt_as_build_geometry_info(vkrt_as_bottom, 1, &as_geom_info);
+    vkrt_as_build_geometry_info(vkrt_as_bottom, 1, &as_geom_info,
+				VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 
   vkrt_as blas = vkrt_create_as2(device, allocator, scratch_queue, immediate,
 				 vkrt_as_bottom, as_build_geom_info, 1,
@@ -570,7 +833,8 @@ vkrt_create_blas(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
   }
   
   VkAccelerationStructureBuildGeometryInfoKHR as_build_geom_info =
-    vkrt_as_build_geometry_info(vkrt_as_bottom, geom_data_cnt, as_geom_infos);
+    vkrt_as_build_geometry_info(vkrt_as_bottom, geom_data_cnt, as_geom_infos,
+				VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
 
   uint32_t primitive_count = 0;
   for (size_t i = 0; i < geom_data_cnt; ++i) {
@@ -589,51 +853,166 @@ vkrt_create_blas(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
   return blas;
 }
 
-vkrt_as vkrt_create_tlas(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
-			 vkw_immediate_submit_buffer immediate, uint64_t blas_cnt,
-			 vkrt_as *blases, VkTransformMatrixKHR transform) {
-
-  VkAccelerationStructureInstanceKHR *as_instances =
-    calloc(sizeof(*as_instances), blas_cnt);
+// fills a host visible instance buffer with one instance per blas,
+// custom_indices (may be NULL) become gl_InstanceCustomIndexEXT, which the hit
+// shaders add to gl_GeometryIndexEXT to find the geometry node, sbt_offsets
+// (may be NULL) are where each instance's hit records start
+void vkrt_write_tlas_instances(VmaAllocator allocator, vkrt_memory instance_buffer,
+			       uint64_t blas_cnt, vkrt_as *blases,
+			       VkTransformMatrixKHR *transforms,
+			       uint32_t *custom_indices, uint32_t *sbt_offsets) {
+  VkAccelerationStructureInstanceKHR *as_instances = instance_buffer.info.pMappedData;
   for (uint64_t i = 0; i < blas_cnt; ++i) {
     as_instances[i] = (VkAccelerationStructureInstanceKHR) {
-      .transform = transform,
-      .instanceCustomIndex = 0,
+      .transform = transforms[i],
+      .instanceCustomIndex = custom_indices ? custom_indices[i] : 0,
       .mask = 0xFF,
-      .instanceShaderBindingTableRecordOffset = 0,
+      .instanceShaderBindingTableRecordOffset = sbt_offsets ? sbt_offsets[i] : 0,
       .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
       .accelerationStructureReference = blases[i].handle
     };
   }
-  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
+  VK_CHECK(vmaFlushAllocation(allocator, instance_buffer.allocation, 0,
+			      blas_cnt * sizeof(*as_instances)));
+}
 
-  vkrt_memory instance_buffer =
-    vkrt_allocate_memory(device, allocator, sizeof(*as_instances) * blas_cnt,
-			 as_instances, usage);  
-  free(as_instances);
+vkrt_memory vkrt_allocate_tlas_instances(VkDevice device, VmaAllocator allocator,
+					 uint64_t instance_cnt) {
+  // storage so they can also be written by vk_rt_instances.h
+  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  return vkrt_allocate_memory(device, allocator,
+			      sizeof(VkAccelerationStructureInstanceKHR) * instance_cnt,
+			      NULL, usage);
+}
 
-  VkAccelerationStructureGeometryKHR as_geom_info = {
+VkAccelerationStructureGeometryKHR vkrt_tlas_geometry(VkDeviceAddress instances) {
+  return (VkAccelerationStructureGeometryKHR) {
     .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
     .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
     .geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
     .geometry.instances.sType =
     VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
     .geometry.instances.arrayOfPointers = VK_FALSE,
-    .geometry.instances.data = instance_buffer.device_address,
+    .geometry.instances.data = instances,
   };
+}
+
+// builds a tlas over instances already written to instance_buffer, the buffer
+// stays with the caller so the tlas can be updated from it later
+vkrt_as vkrt_create_tlas2(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
+			  vkw_immediate_submit_buffer immediate, uint64_t instance_cnt,
+			  vkrt_memory instance_buffer,
+			  VkBuildAccelerationStructureFlagsKHR flags) {
+  VkAccelerationStructureGeometryKHR as_geom_info =
+    vkrt_tlas_geometry(instance_buffer.device_address);
   
   VkAccelerationStructureBuildGeometryInfoKHR as_build_geom_info =
-    vkrt_as_build_geometry_info(vkrt_as_top, 1, &as_geom_info);
+    vkrt_as_build_geometry_info(vkrt_as_top, 1, &as_geom_info, flags);
   
-  vkrt_as tlas = vkrt_create_as(device, allocator, scratch_queue, immediate,
-				vkrt_as_top, as_build_geom_info,
-				blas_cnt);
+  return vkrt_create_as(device, allocator, scratch_queue, immediate,
+			vkrt_as_top, as_build_geom_info, instance_cnt);
+}
+
+vkrt_as vkrt_create_tlas(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
+			 vkw_immediate_submit_buffer immediate, uint64_t blas_cnt,
+			 vkrt_as *blases, VkTransformMatrixKHR transform,
+			 uint32_t *custom_indices,
+			 VkBuildAccelerationStructureFlagsKHR flags) {
+  VkTransformMatrixKHR *transforms = calloc(sizeof(*transforms), blas_cnt);
+  for (uint64_t i = 0; i < blas_cnt; ++i) {
+    transforms[i] = transform;
+  }
+  vkrt_memory instance_buffer = vkrt_allocate_tlas_instances(device, allocator, blas_cnt);
+  vkrt_write_tlas_instances(allocator, instance_buffer, blas_cnt, blases, transforms,
+			    custom_indices, NULL);
+  free(transforms);
+
+  vkrt_as tlas = vkrt_create_tlas2(device, allocator, scratch_queue, immediate,
+				   blas_cnt, instance_buffer, flags);
 
   vkrt_memory_free(allocator, instance_buffer);
   return tlas;
 }
 
+// creates a tlas with room for instance_cnt instances without building it,
+// the build is then recorded with vkrt_record_tlas_build
+vkrt_as vkrt_allocate_tlas(VkDevice device, VmaAllocator allocator, uint32_t instance_cnt,
+			   VkBuildAccelerationStructureFlagsKHR flags) {
+  VkAccelerationStructureGeometryKHR as_geom_info = vkrt_tlas_geometry(0);
+  VkAccelerationStructureBuildGeometryInfoKHR geom_info =
+    vkrt_as_build_geometry_info(vkrt_as_top, 1, &as_geom_info, flags);
+  VkAccelerationStructureBuildSizesInfoKHR sizes = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+  };
+  vkGetAccelerationStructureBuildSizesKHRp(device,
+					   VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+					   &geom_info, &instance_cnt, &sizes);
+  vkrt_as tlas = {
+    .flags = flags,
+    .size = sizes.accelerationStructureSize,
+    .scratch_size = sizes.buildScratchSize > sizes.updateScratchSize ?
+    sizes.buildScratchSize : sizes.updateScratchSize,
+  };
+  tlas.memory =
+    vkrt_allocate_memory(device, allocator, tlas.size, NULL,
+			 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
+			 | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  VkAccelerationStructureCreateInfoKHR as_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+    .buffer = tlas.memory.buffer,
+    .size = tlas.size,
+    .type = vkrt_as_top,
+  };
+  VK_CHECK(vkCreateAccelerationStructureKHRp(device, &as_info, NULL, &tlas.as));
+
+  VkAccelerationStructureDeviceAddressInfoKHR device_addr_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+    .accelerationStructure = tlas.as,
+  };
+  tlas.handle = vkGetAccelerationStructureDeviceAddressKHRp(device, &device_addr_info);
+  return tlas;
+}
+
+// scratch big enough for both full builds and updates of a tlas
+VkDeviceSize vkrt_tlas_scratch_size(VkDevice device, uint32_t instance_cnt,
+				    VkBuildAccelerationStructureFlagsKHR flags) {
+  VkAccelerationStructureGeometryKHR as_geom_info = vkrt_tlas_geometry(0);
+  VkAccelerationStructureBuildGeometryInfoKHR geom_info =
+    vkrt_as_build_geometry_info(vkrt_as_top, 1, &as_geom_info, flags);
+  VkAccelerationStructureBuildSizesInfoKHR sizes = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+  };
+  vkGetAccelerationStructureBuildSizesKHRp(device,
+					   VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+					   &geom_info, &instance_cnt, &sizes);
+  return sizes.buildScratchSize > sizes.updateScratchSize ?
+    sizes.buildScratchSize : sizes.updateScratchSize;
+}
+
+// records an in place rebuild of tlas, or a refit if update is set (the tlas
+// must have been built with ALLOW_UPDATE for that), the caller is responsible
+// for the barriers around it
+void vkrt_record_tlas_build(VkCommandBuffer cmd, vkrt_as *tlas, uint32_t instance_cnt,
+			    VkDeviceAddress instances, VkDeviceAddress scratch,
+			    bool update) {
+  VkAccelerationStructureGeometryKHR as_geom_info = vkrt_tlas_geometry(instances);
+  VkAccelerationStructureBuildGeometryInfoKHR geom_info =
+    vkrt_as_build_geometry_info(vkrt_as_top, 1, &as_geom_info, tlas->flags);
+  geom_info.mode = update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR :
+    VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+  geom_info.srcAccelerationStructure = update ? tlas->as : VK_NULL_HANDLE;
+  geom_info.dstAccelerationStructure = tlas->as;
+  geom_info.scratchData.deviceAddress = scratch;
+
+  const VkAccelerationStructureBuildRangeInfoKHR *range =
+    &(VkAccelerationStructureBuildRangeInfoKHR){
+    .primitiveCount = instance_cnt,
+  };
+  vkCmdBuildAccelerationStructuresKHRp(cmd, 1, &geom_info, &range);
+}
+
 typedef struct {
   uint32_t ds_count;
   VkWriteDescriptorSet *write_ds;
@@ -695,6 +1074,28 @@ void vkrt_ds_writer_add_image(vkrt_ds_writer *writer, uint32_t binding,
   };
 }
 
+// an array of storage images, all in the general layout
+void vkrt_ds_writer_add_images(vkrt_ds_writer *writer, uint32_t binding,
+			       uint32_t image_count, VkImageView *views) {
+  size_t start = writer->image_info_idx;
+  for (size_t i = 0; i < image_count; ++i) {
+    writer->image_infos[writer->image_info_idx++] = (VkDescriptorImageInfo) {
+      .sampler = VK_NULL_HANDLE,
+      .imageView = views[i],
+      .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+  }
+
+  writer->write_ds[binding] = (VkWriteDescriptorSet) {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .pImageInfo = &writer->image_infos[start],
+    .dstSet = writer->dst_set,
+    .dstBinding = binding,
+    .descriptorCount = image_count,
+    .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+  };
+}
+
 void vkrt_ds_writer_add_sampled_images(vkrt_ds_writer *writer, uint32_t binding,
 				       uint32_t image_count, vkw_image *images) {
   size_t start = writer->image_info_idx;
@@ -734,7 +1135,16 @@ void vkrt_ds_writer_add_buffer(vkrt_ds_writer *writer, uint32_t binding,
 }
 
 void vkrt_ds_writer_write(VkDevice device, vkrt_ds_writer writer) {
-  vkUpdateDescriptorSets(device, writer.ds_count, writer.write_ds, 0, NULL);
+  // only submit bindings that were actually added, so a writer can be used to
+  // update a subset of a set (or skip empty arrays)
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < writer.ds_count; ++i) {
+    if (writer.write_ds[i].sType == VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET &&
+	writer.write_ds[i].descriptorCount > 0) {
+      writer.write_ds[count++] = writer.write_ds[i];
+    }
+  }
+  vkUpdateDescriptorSets(device, count, writer.write_ds, 0, NULL);
 }
 
 void vkrt_ds_writer_free(vkrt_ds_writer *writer) {
@@ -744,4 +1154,59 @@ void vkrt_ds_writer_free(vkrt_ds_writer *writer) {
   free(writer->image_infos);
   free(writer->buffer_infos);
 }
+
+typedef struct {
+  VkPipeline pipeline;
+  VkPipelineLayout layout;
+  VkDescriptorSet set;
+  VkShaderStageFlags push_constant_stages;
+  // a compute shader tracing with ray queries instead, in 8x8 workgroups. as
+  // it has no gl_LaunchSizeEXT, the launch size is pushed as two uints at
+  // launch_size_offset in its push constants
+  bool compute;
+  uint32_t launch_size_offset;
+
+  VkStridedDeviceAddressRegionKHR rgen;
+  VkStridedDeviceAddressRegionKHR rmiss;
+  VkStridedDeviceAddressRegionKHR rchit;
+  VkStridedDeviceAddressRegionKHR rcall;
+} vkrt_tracer;
+
+void vkrt_tracer_record(VkCommandBuffer cmd, vkrt_tracer *tracer,
+			void *push_constants, uint32_t sizeof_push_constants,
+			uint32_t width, uint32_t height) {
+  VkPipelineBindPoint bind_point = tracer->compute ? VK_PIPELINE_BIND_POINT_COMPUTE :
+    VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR;
+  vkCmdBindPipeline(cmd, bind_point, tracer->pipeline);
+  vkCmdBindDescriptorSets(cmd, bind_point, tracer->layout, 0, 1, &tracer->set, 0, 0);
+  vkCmdPushConstants(cmd, tracer->layout, tracer->push_constant_stages, 0,
+		     sizeof_push_constants, push_constants);
+  if (tracer->compute) {
+    uint32_t launch_size[2] = { width, height };
+    vkCmdPushConstants(cmd, tracer->layout, tracer->push_constant_stages,
+		       tracer->launch_size_offset, sizeof(launch_size), launch_size);
+    vkCmdDispatch(cmd, (width + 7) / 8, (height + 7) / 8, 1);
+    return;
+  }
+  vkCmdTraceRaysKHRp(cmd, &tracer->rgen, &tracer->rmiss, &tracer->rchit,
+		     &tracer->rcall, width, height, 1);
+}
+
+// the launch size is read from a VkTraceRaysIndirectCommandKHR at the address
+// when the launch runs, so it can be written by an earlier pass on the gpu
+void vkrt_tracer_record_indirect(VkCommandBuffer cmd, vkrt_tracer *tracer,
+				 void *push_constants, uint32_t sizeof_push_constants,
+				 VkDeviceAddress size_address) {
+  if (tracer->compute) {
+    fprintf(stderr, "Indirect launches need a ray tracing pipeline\n");
+    exit(1);
+  }
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, tracer->pipeline);
+  vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+			  tracer->layout, 0, 1, &tracer->set, 0, 0);
+  vkCmdPushConstants(cmd, tracer->layout, tracer->push_constant_stages, 0,
+		     sizeof_push_constants, push_constants);
+  vkCmdTraceRaysIndirectKHRp(cmd, &tracer->rgen, &tracer->rmiss, &tracer->rchit,
+			     &tracer->rcall, size_address);
+}
 #endif // VK_RT_HELP_H_
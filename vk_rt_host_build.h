@@ -0,0 +1,222 @@
+#ifndef VK_RT_HOST_BUILD_H_
+#define VK_RT_HOST_BUILD_H_
+// builds blases on the cpu with vkBuildAccelerationStructuresKHR: every build
+// is started as a deferred operation, then a pool of worker threads joins
+// them until they're all done. needs accelerationStructureHostCommands, and
+// every buffer involved has to be host visible (vkrt_allocate_memory ones are)
+
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+  VkAccelerationStructureGeometryKHR *geoms;
+  VkAccelerationStructureBuildRangeInfoKHR *ranges;
+  // deferred builds may read their parameters until they finish, so they
+  // live here rather than on the stack
+  const VkAccelerationStructureBuildRangeInfoKHR *p_ranges;
+  VkAccelerationStructureBuildGeometryInfoKHR info;
+  void *scratch;
+  VkDeferredOperationKHR op; // VK_NULL_HANDLE if the build wasn't deferred
+} vkrt_host_build_job;
+
+typedef struct {
+  VkDevice device;
+  uint32_t job_count;
+  vkrt_host_build_job *jobs;
+  uint32_t first_job; // workers start on different jobs to spread out
+} vkrt_host_build_worker;
+
+void *vkrt_host_build_worker_run(void *arg) {
+  vkrt_host_build_worker *w = arg;
+  for (uint32_t n = 0; n < w->job_count; ++n) {
+    vkrt_host_build_job *job = &w->jobs[(w->first_job + n) % w->job_count];
+    if (job->op == VK_NULL_HANDLE) { continue; }
+    // THREAD_DONE means the operation doesn't want more threads, SUCCESS that
+    // it has finished, either way move on to the next one
+    while (vkDeferredOperationJoinKHRp(w->device, job->op) == VK_THREAD_IDLE_KHR) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+// replaces as with a compacted copy, like vkrt_compact_as but on the host
+void vkrt_compact_as_host(VkDevice device, VmaAllocator allocator, vkrt_as_level lvl,
+			  vkrt_as *as) {
+  VkDeviceSize compact_size = 0;
+  VK_CHECK(vkWriteAccelerationStructuresPropertiesKHRp(device, 1, &as->as,
+						       VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+						       sizeof(compact_size), &compact_size,
+						       sizeof(compact_size)));
+  if (compact_size == 0 || compact_size >= as->size) { return; }
+
+  vkrt_as compact = { .size = compact_size, .flags = as->flags };
+  compact.memory =
+    vkrt_allocate_memory(device, allocator, compact_size, NULL,
+			 VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
+			 | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  VkAccelerationStructureCreateInfoKHR as_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+    .buffer = compact.memory.buffer,
+    .size = compact_size,
+    .type = lvl,
+  };
+  VK_CHECK(vkCreateAccelerationStructureKHRp(device, &as_info, NULL, &compact.as));
+
+  VkCopyAccelerationStructureInfoKHR copy_info = {
+    .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+    .src = as->as,
+    .dst = compact.as,
+    .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR,
+  };
+  VK_CHECK(vkCopyAccelerationStructureKHRp(device, VK_NULL_HANDLE, &copy_info));
+  VK_CHECK(vmaFlushAllocation(allocator, compact.memory.allocation, 0, VK_WHOLE_SIZE));
+
+  VkAccelerationStructureDeviceAddressInfoKHR device_addr_info = {
+    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+    .accelerationStructure = compact.as,
+  };
+  compact.handle = vkGetAccelerationStructureDeviceAddressKHRp(device, &device_addr_info);
+
+  vkrt_destroy_as(device, allocator, *as);
+  *as = compact;
+}
+
+// builds blas_count blases into out, blas i is made of the geometries from
+// first_geom[i] up to first_geom[i + 1] (or geom_count for the last one)
+void vkrt_host_build_blases(VkDevice device, VmaAllocator allocator,
+			    uint32_t thread_count, uint32_t blas_count,
+			    const uint32_t *first_geom, uint32_t geom_count,
+			    vkrt_geom_data_gpu *geom_datas,
+			    const VkBuildAccelerationStructureFlagsKHR *flags,
+			    vkrt_as *out) {
+  if (blas_count == 0) { return; }
+  if (thread_count < 1) { thread_count = 1; }
+  vkrt_host_build_job *jobs = calloc(sizeof(*jobs), blas_count);
+
+  // start every build, nothing actually runs until a thread joins it
+  for (uint32_t i = 0; i < blas_count; ++i) {
+    vkrt_host_build_job *job = &jobs[i];
+    uint32_t first = first_geom[i];
+    uint32_t cnt = ((i + 1 < blas_count) ? first_geom[i + 1] : geom_count) - first;
+    job->geoms = calloc(sizeof(*job->geoms), cnt);
+    job->ranges = calloc(sizeof(*job->ranges), cnt);
+    job->p_ranges = job->ranges;
+    uint32_t *primitive_counts = calloc(sizeof(uint32_t), cnt);
+    for (uint32_t g = 0; g < cnt; ++g) {
+      vkrt_geom_data_gpu geom = geom_datas[first + g];
+      job->geoms[g] = vkrt_blas_geometry(geom);
+      job->geoms[g].geometry.triangles.vertexData.hostAddress =
+	geom.vertex_buffer.info.pMappedData;
+      job->geoms[g].geometry.triangles.indexData.hostAddress =
+	geom.index_buffer.info.pMappedData;
+      job->geoms[g].geometry.triangles.transformData.hostAddress =
+	geom.transform_buffer.info.pMappedData;
+      job->ranges[g].primitiveCount = geom.primitive_count;
+      primitive_counts[g] = geom.primitive_count;
+    }
+    job->info = vkrt_as_build_geometry_info(vkrt_as_bottom, cnt, job->geoms, flags[i]);
+
+    VkAccelerationStructureBuildSizesInfoKHR host_sizes = {
+      .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+    };
+    VkAccelerationStructureBuildSizesInfoKHR device_sizes = host_sizes;
+    vkGetAccelerationStructureBuildSizesKHRp(device,
+					     VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR,
+					     &job->info, primitive_counts, &host_sizes);
+    // dynamic blases are refit on the device later, so size for both
+    vkGetAccelerationStructureBuildSizesKHRp(device,
+					     VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+					     &job->info, primitive_counts, &device_sizes);
+    free(primitive_counts);
+
+    vkrt_as *as = &out[i];
+    *as = (vkrt_as) { .flags = flags[i] };
+    as->size = host_sizes.accelerationStructureSize >
+      device_sizes.accelerationStructureSize ? host_sizes.accelerationStructureSize :
+      device_sizes.accelerationStructureSize;
+    as->scratch_size = device_sizes.buildScratchSize > device_sizes.updateScratchSize ?
+      device_sizes.buildScratchSize : device_sizes.updateScratchSize;
+    as->memory =
+      vkrt_allocate_memory(device, allocator, as->size, NULL,
+			   VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR
+			   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    VkAccelerationStructureCreateInfoKHR as_info = {
+      .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+      .buffer = as->memory.buffer,
+      .size = as->size,
+      .type = vkrt_as_bottom,
+    };
+    VK_CHECK(vkCreateAccelerationStructureKHRp(device, &as_info, NULL, &as->as));
+
+    job->scratch = malloc(host_sizes.buildScratchSize + 1);
+    job->info.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    job->info.dstAccelerationStructure = as->as;
+    job->info.scratchData.hostAddress = job->scratch;
+
+    VK_CHECK(vkCreateDeferredOperationKHRp(device, NULL, &job->op));
+    VkResult res = vkBuildAccelerationStructuresKHRp(device, job->op, 1, &job->info,
+						      &job->p_ranges);
+    if (res == VK_OPERATION_NOT_DEFERRED_KHR || res == VK_SUCCESS) {
+      // the implementation chose to build it right away
+      vkDestroyDeferredOperationKHRp(device, job->op, NULL);
+      job->op = VK_NULL_HANDLE;
+    } else if (res != VK_OPERATION_DEFERRED_KHR) {
+      fprintf(stderr, "Failed to start host blas build: %d\n", res);
+      exit(1);
+    }
+  }
+
+  // the calling thread is one of the workers
+  vkrt_host_build_worker *workers = calloc(sizeof(*workers), thread_count);
+  pthread_t *threads = calloc(sizeof(*threads), thread_count);
+  for (uint32_t t = 0; t < thread_count; ++t) {
+    workers[t] = (vkrt_host_build_worker) {
+      .device = device,
+      .job_count = blas_count,
+      .jobs = jobs,
+      .first_job = (uint64_t)t * blas_count / thread_count,
+    };
+    if (t > 0 && pthread_create(&threads[t], NULL, vkrt_host_build_worker_run,
+				&workers[t]) != 0) {
+      fprintf(stderr, "Failed to start host build thread\n");
+      exit(1);
+    }
+  }
+  vkrt_host_build_worker_run(&workers[0]);
+  for (uint32_t t = 1; t < thread_count; ++t) {
+    pthread_join(threads[t], NULL);
+  }
+  free(threads);
+  free(workers);
+
+  for (uint32_t i = 0; i < blas_count; ++i) {
+    vkrt_host_build_job *job = &jobs[i];
+    if (job->op != VK_NULL_HANDLE) {
+      VkResult res = vkGetDeferredOperationResultKHRp(device, job->op);
+      if (res != VK_SUCCESS) {
+	fprintf(stderr, "Host blas build failed: %d\n", res);
+	exit(1);
+      }
+      vkDestroyDeferredOperationKHRp(device, job->op, NULL);
+    }
+    free(job->scratch);
+    free(job->ranges);
+    free(job->geoms);
+
+    vkrt_as *as = &out[i];
+    // written by the cpu, make it visible to the device
+    VK_CHECK(vmaFlushAllocation(allocator, as->memory.allocation, 0, VK_WHOLE_SIZE));
+    VkAccelerationStructureDeviceAddressInfoKHR device_addr_info = {
+      .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+      .accelerationStructure = as->as,
+    };
+    as->handle = vkGetAccelerationStructureDeviceAddressKHRp(device, &device_addr_info);
+
+    if (as->flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+      vkrt_compact_as_host(device, allocator, vkrt_as_bottom, as);
+    }
+  }
+  free(jobs);
+}
+#endif // VK_RT_HOST_BUILD_H_
@@ -0,0 +1,99 @@
+#ifndef VK_RT_INSTANCES_H_
+#define VK_RT_INSTANCES_H_
+// generates tlas instance records on the gpu: the host (or another pass) only
+// fills a compact table of objects, a compute pass turns it into
+// VkAccelerationStructureInstanceKHRs which the tlas build reads straight after
+
+// one per instance, matches object_t in shaders/tlas_instances.comp
+typedef struct {
+  VkTransformMatrixKHR transform;
+  uint32_t blas_index; // into the blas address table
+  uint32_t custom_index_mask; // see vkrt_object_custom_index_mask
+} vkrt_object;
+
+// matches the push constants in shaders/tlas_instances.comp
+typedef struct {
+  VkDeviceAddress objects;
+  VkDeviceAddress blas_addresses;
+  VkDeviceAddress instances;
+  uint32_t count;
+  uint32_t flags;
+} vkrt_instance_gen_push_constants;
+
+typedef struct {
+  vkw_compute_pipeline pipeline;
+  VkDescriptorSetLayout layout; // empty, everything goes through addresses
+} vkrt_instance_generator;
+
+uint32_t vkrt_object_custom_index_mask(uint32_t custom_index, uint8_t mask) {
+  assert(custom_index < (1u << 24) && "Custom index only has 24 bits");
+  return custom_index | ((uint32_t)mask << 24);
+}
+
+vkrt_instance_generator vkrt_instance_generator_create(VkDevice device) {
+  vkrt_instance_generator gen = {};
+  vkw_descriptor_layout_builder b = {};
+  gen.layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_COMPUTE_BIT);
+  VkShaderModule shader;
+  if (!vkh_load_shader_module("./shaders/tlas_instances.spv", device, &shader)) {
+    fprintf(stderr, "Failed to load the tlas instance shader - please check it exists\n");
+    exit(1);
+  }
+  gen.pipeline = vkw_compute_pipeline_create(device, gen.layout, shader,
+					     sizeof(vkrt_instance_gen_push_constants));
+  vkDestroyShaderModule(device, shader, NULL);
+  return gen;
+}
+
+vkrt_memory vkrt_allocate_objects(VkDevice device, VmaAllocator allocator,
+				  uint64_t object_cnt) {
+  return vkrt_allocate_memory(device, allocator, sizeof(vkrt_object) * object_cnt, NULL,
+			      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+}
+
+// table of blas device addresses that objects refer to by index
+vkrt_memory vkrt_allocate_blas_addresses(VkDevice device, VmaAllocator allocator,
+					 uint32_t blas_cnt, vkrt_as *blases) {
+  VkDeviceAddress *addresses = calloc(sizeof(*addresses), blas_cnt);
+  for (uint32_t i = 0; i < blas_cnt; ++i) {
+    addresses[i] = blases[i].handle;
+  }
+  vkrt_memory res =
+    vkrt_allocate_memory(device, allocator, sizeof(*addresses) * blas_cnt, addresses,
+			 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  free(addresses);
+  return res;
+}
+
+// records the expansion of count objects into instances, followed by the
+// barrier that makes them visible to an acceleration structure build
+void vkrt_instance_generator_record(VkCommandBuffer cmd, vkrt_instance_generator *gen,
+				    VkDeviceAddress objects, VkDeviceAddress blas_addresses,
+				    VkDeviceAddress instances, uint32_t count,
+				    VkGeometryInstanceFlagsKHR flags) {
+  if (count == 0) { return; }
+  vkw_compute_pipeline_bind(cmd, gen->pipeline, VK_NULL_HANDLE);
+  vkrt_instance_gen_push_constants pcs = {
+    .objects = objects,
+    .blas_addresses = blas_addresses,
+    .instances = instances,
+    .count = count,
+    .flags = flags,
+  };
+  vkw_compute_pipeline_push_constants(cmd, gen->pipeline, &pcs);
+  vkCmdDispatch(cmd, (count + 63) / 64, 1, 1);
+
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_SHADER_READ_BIT);
+}
+
+void vkrt_instance_generator_destroy(VkDevice device, vkrt_instance_generator *gen) {
+  vkw_compute_pipeline_destroy(device, gen->pipeline);
+  vkDestroyDescriptorSetLayout(device, gen->layout, NULL);
+  *gen = (vkrt_instance_generator){};
+}
+#endif // VK_RT_INSTANCES_H_
@@ -0,0 +1,205 @@
+#ifndef VK_RT_LIGHTS_H_
+#define VK_RT_LIGHTS_H_
+// gathers the emissive triangles of a model into a buffer the closest hit
+// shaders pick from for next event estimation, in world space at the rest pose
+// (so lights on animated meshes or moved instances are sampled where they were).
+// lights are picked in proportion to their power through an alias table
+
+// models without any emissive material get this one lit up instead, so the
+// scenes that relied on it being the light still have one
+#define VKRT_LIGHT_MATERIAL 1
+#define VKRT_LIGHT_FALLBACK_EMISSION 10.0f
+
+// one per triangle, matches light_t in shaders/shading.glsl
+typedef struct {
+  float p0[4]; // first vertex, w holds the area
+  float e1[4]; // edges from p0
+  float e2[4];
+  float uv01[4]; // uvs of the vertices, for emissive textures
+  float uv2[2];
+  uint32_t material_index;
+  float pdf; // chance of picking this light, its share of the total power
+  // alias table entry: keep this light with probability alias_prob, otherwise
+  // take the alias
+  float alias_prob;
+  uint32_t alias;
+  uint32_t pad[2];
+} vkrt_light;
+
+// the buffer starts with this, followed by the lights
+typedef struct {
+  uint32_t count;
+  float total_power;
+  uint32_t pad[2];
+} vkrt_light_header;
+
+typedef struct {
+  uint32_t count;
+  float total_power;
+  bool fallback; // lit up VKRT_LIGHT_MATERIAL as nothing emitted
+  vkrt_memory buffer;
+} vkrt_lights;
+
+float vkrt_luminance(const float *rgb) {
+  return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+// vose's method: splits every entry's probability between itself and one
+// other, so sampling is one random index and one coin flip whatever the count.
+// pdf holds the weights (summing to total) and gets their shares, alias_prob
+// the chance of keeping an entry and alias the one taken otherwise
+void vkrt_build_alias_table(uint32_t count, float total, float *pdf, float *alias_prob,
+			    uint32_t *alias) {
+  if (count == 0) { return; }
+  float *scaled = calloc(sizeof(float), count);
+  uint32_t *small = calloc(sizeof(uint32_t), count);
+  uint32_t *large = calloc(sizeof(uint32_t), count);
+  uint32_t small_count = 0, large_count = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    pdf[i] = total > 0 ? pdf[i] / total : 1.0f / count;
+    scaled[i] = pdf[i] * count;
+    if (scaled[i] < 1) {
+      small[small_count++] = i;
+    } else {
+      large[large_count++] = i;
+    }
+  }
+  while (small_count > 0 && large_count > 0) {
+    uint32_t s = small[--small_count];
+    uint32_t l = large[--large_count];
+    alias_prob[s] = scaled[s];
+    alias[s] = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      small[small_count++] = l;
+    } else {
+      large[large_count++] = l;
+    }
+  }
+  // whatever is left over is 1 up to rounding
+  while (large_count > 0) {
+    uint32_t l = large[--large_count];
+    alias_prob[l] = 1;
+    alias[l] = l;
+  }
+  while (small_count > 0) {
+    uint32_t s = small[--small_count];
+    alias_prob[s] = 1;
+    alias[s] = s;
+  }
+  free(large);
+  free(small);
+  free(scaled);
+}
+
+// lights are picked in proportion to their power, which pdf holds going in
+void vkrt_lights_build_alias_table(vkrt_light *lights, uint32_t count, float total) {
+  float *pdf = calloc(sizeof(float), count);
+  float *alias_prob = calloc(sizeof(float), count);
+  uint32_t *alias = calloc(sizeof(uint32_t), count);
+  for (uint32_t i = 0; i < count; ++i) {
+    pdf[i] = lights[i].pdf;
+  }
+  vkrt_build_alias_table(count, total, pdf, alias_prob, alias);
+  for (uint32_t i = 0; i < count; ++i) {
+    lights[i].pdf = pdf[i];
+    lights[i].alias_prob = alias_prob[i];
+    lights[i].alias = alias[i];
+  }
+  free(alias);
+  free(alias_prob);
+  free(pdf);
+}
+
+// also sets first_light on every primitive of the model, so build it before
+// the scene (vkrt_scene_build copies them into the geometry nodes). without
+// allow_fallback a model that emits nothing gets no lights
+vkrt_lights vkrt_lights_build(VkDevice device, VmaAllocator allocator,
+			      vkrt_model *model, bool allow_fallback) {
+  vkrt_lights lights = {};
+  vkrt_material *materials = model->materials_buffer.info.pMappedData;
+  bool any_emissive = false;
+  for (size_t i = 0; i < model->material_count; ++i) {
+    any_emissive |= vkrt_luminance(materials[i].emissive) > 0;
+  }
+  if (allow_fallback && !any_emissive && VKRT_LIGHT_MATERIAL < model->material_count) {
+    for (uint32_t c = 0; c < 3; ++c) {
+      materials[VKRT_LIGHT_MATERIAL].emissive[c] = VKRT_LIGHT_FALLBACK_EMISSION;
+    }
+    VK_CHECK(vmaFlushAllocation(allocator, model->materials_buffer.allocation,
+				0, VK_WHOLE_SIZE));
+    lights.fallback = true;
+  }
+
+  for (size_t i = 0; i < model->mesh_count; ++i) {
+    for (size_t j = 0; j < model->meshes[i].primitive_count; ++j) {
+      vkrt_primitive *p = &model->meshes[i].primitives[j];
+      p->first_light = UINT32_MAX;
+      if (vkrt_luminance(materials[p->material_index].emissive) > 0) {
+	p->first_light = lights.count;
+	lights.count += p->primitive_count;
+      }
+    }
+  }
+
+  // always at least the header, so the binding is never empty
+  size_t size = sizeof(vkrt_light_header) + lights.count * sizeof(vkrt_light);
+  uint8_t *data = calloc(size, 1);
+  vkrt_light *out = (vkrt_light *)(data + sizeof(vkrt_light_header));
+  for (size_t i = 0; i < model->mesh_count; ++i) {
+    vkrt_mesh mesh = model->meshes[i];
+    VkTransformMatrixKHR *t = mesh.transform_buffer.info.pMappedData;
+    for (size_t j = 0; j < mesh.primitive_count; ++j) {
+      vkrt_primitive p = mesh.primitives[j];
+      if (p.first_light == UINT32_MAX) { continue; }
+      // emissive textures are taken to average out at 1 for the power
+      float radiance = vkrt_luminance(materials[p.material_index].emissive);
+      vkrt_vertex_t *vertices = p.vertex_buffer.info.pMappedData;
+      uint32_t *indices = p.index_buffer.info.pMappedData;
+      for (uint32_t tri = 0; tri < p.primitive_count; ++tri) {
+	HMM_Vec3 v[3];
+	float *uv[3];
+	for (uint32_t k = 0; k < 3; ++k) {
+	  vkrt_vertex_t *vert = &vertices[indices[3 * tri + k]];
+	  HMM_Vec3 pos = vert->pos;
+	  for (uint32_t r = 0; r < 3; ++r) {
+	    v[k].Elements[r] = t->matrix[r][0] * pos.X + t->matrix[r][1] * pos.Y +
+	      t->matrix[r][2] * pos.Z + t->matrix[r][3];
+	  }
+	  uv[k] = vert->uv;
+	}
+	HMM_Vec3 e1 = HMM_SubV3(v[1], v[0]);
+	HMM_Vec3 e2 = HMM_SubV3(v[2], v[0]);
+	float area = 0.5f * HMM_LenV3(HMM_Cross(e1, e2));
+	float power = radiance * area * (float)HMM_PI;
+	out[p.first_light + tri] = (vkrt_light) {
+	  .p0 = { v[0].X, v[0].Y, v[0].Z, area },
+	  .e1 = { e1.X, e1.Y, e1.Z, 0 },
+	  .e2 = { e2.X, e2.Y, e2.Z, 0 },
+	  .uv01 = { uv[0][0], uv[0][1], uv[1][0], uv[1][1] },
+	  .uv2 = { uv[2][0], uv[2][1] },
+	  .material_index = p.material_index,
+	  .pdf = power, // normalised by the alias table build
+	};
+	lights.total_power += power;
+      }
+    }
+  }
+  vkrt_lights_build_alias_table(out, lights.count, lights.total_power);
+  *(vkrt_light_header *)data = (vkrt_light_header) {
+    .count = lights.count,
+    .total_power = lights.total_power,
+  };
+
+  lights.buffer = vkrt_allocate_memory(device, allocator, size, data,
+				       VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+				       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  free(data);
+  return lights;
+}
+
+void vkrt_lights_destroy(VmaAllocator allocator, vkrt_lights *lights) {
+  vkrt_memory_free(allocator, lights->buffer);
+  *lights = (vkrt_lights){};
+}
+#endif // VK_RT_LIGHTS_H_
@@ -13,12 +13,30 @@ typedef struct {
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+// texture_index of materials without a texture. the shaders get it as a
+// specialization constant (vkrt_specialization), so it can't alias a real one
+#define VKRT_NO_TEXTURE UINT32_MAX
+
 // temporary
+// matches material_t in shaders/bindings.glsl (std430, so padded to 48 bytes)
 typedef struct {
   float color[3];
   uint32_t texture_index;
+  float emissive[3]; // emissiveFactor, scaled by KHR_materials_emissive_strength
+  uint32_t emissive_texture_index; // VKRT_NO_TEXTURE if there isn't one
+  float alpha;
+  float alpha_cutoff; // 0 unless the material is alpha masked
+  float pad[2];
 } vkrt_material;
 
+// an analytic sphere in world space, traced with an aabb and an intersection
+// shader (shaders/sphere.rint), matches sphere_t in shaders/sphere.glsl
+typedef struct {
+  float centre[3];
+  float radius;
+  uint32_t material_index;
+} vkrt_sphere;
+
 typedef struct {
   vkrt_memory vertex_buffer;
   vkrt_memory index_buffer;
@@ -27,12 +45,21 @@ typedef struct {
   uint32_t primitive_count;
 
   uint32_t material_index;
+  bool alpha_masked; // built non-opaque so the any-hit shader can discard hits
+  // index of the light of the first triangle in vk_rt_lights.h's table, the
+  // others follow in order. UINT32_MAX if the material doesn't emit
+  uint32_t first_light;
 } vkrt_primitive;
 
 typedef struct {
   size_t primitive_count;
   vkrt_primitive *primitives;
   vkrt_memory transform_buffer;
+  bool dynamic; // skinned, morphed or animated, see vkrt_gltf_mesh_is_dynamic
+  bool skinned;
+
+  uint32_t node_index; // UINT32_MAX if no node uses the mesh
+  HMM_Mat4 rest_world; // world transform baked into transform_buffer
 } vkrt_mesh;
 
 
@@ -41,7 +68,12 @@ typedef struct {
   vkrt_mesh *meshes;
   size_t texture_count;
   vkw_image *textures;
+  size_t material_count;
   vkrt_memory materials_buffer;
+  cgltf_data *gltf; // kept for animation
+  // meshes swapped for spheres keep no primitives, their spheres are here
+  size_t sphere_count;
+  vkrt_sphere *spheres;
 } vkrt_model;
 
 // NOTE HACK REMOVE THIS
@@ -118,6 +150,8 @@ vkrt_primitive vkrt_load_gltf_primitive(VkDevice device, VmaAllocator allocator,
     .vertex_buffer = vertex_buffer,
     .index_buffer = index_buffer,
     .material_index = material_idx,
+    .alpha_masked = p.material && p.material->alpha_mode == cgltf_alpha_mode_mask,
+    .first_light = UINT32_MAX,
     .vertex_count = vertex_count,
     .primitive_count = index_count / 3
   };
@@ -133,6 +167,7 @@ vkrt_load_gltf_mesh(VkDevice device, VmaAllocator allocator, cgltf_mesh mesh,
   VkTransformMatrixKHR transform = {};
   HMM_Mat4 transform4 = {};
   cgltf_node_transform_world(&node, (float*)transform4.Elements);
+  res.rest_world = transform4;
   transform4 = HMM_TransposeM4(transform4);
   memcpy(&transform, &transform4.Elements, 12 * sizeof(float));
 
@@ -150,9 +185,144 @@ vkrt_load_gltf_mesh(VkDevice device, VmaAllocator allocator, cgltf_mesh mesh,
   return res;
 }
 
+// meshes that are skinned, have morph targets or hang off an animated node will
+// have their acceleration structures updated at runtime
+bool vkrt_gltf_mesh_is_dynamic(cgltf_data *data, cgltf_mesh *mesh) {
+  for (size_t i = 0; i < mesh->primitives_count; ++i) {
+    if (mesh->primitives[i].targets_count > 0) { return true; }
+  }
+  for (size_t i = 0; i < data->nodes_count; ++i) {
+    cgltf_node *node = &data->nodes[i];
+    if (node->mesh != mesh) { continue; }
+    if (node->skin) { return true; }
+    for (size_t j = 0; j < data->animations_count; ++j) {
+      cgltf_animation anim = data->animations[j];
+      for (size_t k = 0; k < anim.channels_count; ++k) {
+	if (anim.channels[k].target_node == node) { return true; }
+      }
+    }
+  }
+  return false;
+}
+
+// true if the extras of a gltf object hold "key": true at their top level.
+// the json is tokenized with the jsmn parser cgltf uses, which main.c gets
+// with CGLTF_IMPLEMENTATION
+bool vkrt_gltf_extras_flag(cgltf_data *data, const cgltf_extras *extras,
+			   const char *key) {
+  cgltf_size size = 0;
+  if (cgltf_copy_extras_json(data, extras, NULL, &size) != cgltf_result_success ||
+      size <= 1) {
+    return false;
+  }
+  char *json = malloc(size);
+  cgltf_copy_extras_json(data, extras, json, &size);
+  size_t len = strlen(json);
+  jsmn_parser parser;
+  jsmn_init(&parser);
+  int token_count = jsmn_parse(&parser, json, len, NULL, 0);
+  bool res = false;
+  if (token_count > 0) {
+    jsmntok_t *tokens = calloc(sizeof(*tokens), token_count);
+    jsmn_init(&parser);
+    jsmn_parse(&parser, json, len, tokens, token_count);
+    // an object's size is its key count, each key is followed by its value
+    // which cgltf_skip_json steps over whatever it holds
+    for (int k = 0, i = 1; tokens[0].type == JSMN_OBJECT && k < tokens[0].size && !res;
+	 ++k, i = cgltf_skip_json(tokens, i + 1)) {
+      if (cgltf_json_strcmp(&tokens[i], (const uint8_t *)json, key) != 0) { continue; }
+      jsmntok_t v = tokens[i + 1];
+      res = v.type == JSMN_PRIMITIVE && v.end - v.start == 4 &&
+	strncmp(json + v.start, "true", 4) == 0;
+    }
+    free(tokens);
+  }
+  free(json);
+  return res;
+}
+
+// how far (relative to the radius) a vertex may be from the sphere's surface
+// when detecting spheres, and when checking a mesh tagged as one. tagged
+// meshes may be coarser, but a box or a capsule still fails
+#define VKRT_SPHERE_DETECT_TOLERANCE 0.02f
+#define VKRT_SPHERE_TAGGED_TOLERANCE 0.1f
+
+// fits a world space sphere around the vertices of a primitive. it fails
+// unless every vertex is within tolerance * radius of the sphere's surface,
+// and unless there are at least min_vertices
+bool vkrt_primitive_fit_sphere(vkrt_primitive p, HMM_Mat4 world, float tolerance,
+			       uint32_t min_vertices, vkrt_sphere *out) {
+  vkrt_vertex_t *vertices = p.vertex_buffer.info.pMappedData;
+  if (p.vertex_count == 0) { return false; }
+  HMM_Vec3 lo = { INFINITY, INFINITY, INFINITY };
+  HMM_Vec3 hi = { -INFINITY, -INFINITY, -INFINITY };
+  for (uint32_t i = 0; i < p.vertex_count; ++i) {
+    for (uint32_t a = 0; a < 3; ++a) {
+      lo.Elements[a] = fminf(lo.Elements[a], vertices[i].pos.Elements[a]);
+      hi.Elements[a] = fmaxf(hi.Elements[a], vertices[i].pos.Elements[a]);
+    }
+  }
+  HMM_Vec3 centre = HMM_MulV3F(HMM_AddV3(lo, hi), 0.5f);
+  HMM_Vec3 half = HMM_MulV3F(HMM_SubV3(hi, lo), 0.5f);
+  float radius = fmaxf(half.X, fmaxf(half.Y, half.Z));
+  if (radius <= 0) { return false; }
+
+  if (p.vertex_count < min_vertices) { return false; }
+  for (uint32_t i = 0; i < p.vertex_count; ++i) {
+    float d = HMM_LenV3(HMM_SubV3(vertices[i].pos, centre));
+    if (fabsf(d - radius) > tolerance * radius) { return false; }
+  }
+
+  HMM_Vec4 c = HMM_MulM4V4(world, HMM_V4V(centre, 1));
+  // non uniform scales would make an ellipsoid, take the largest axis
+  float scale = fmaxf(HMM_LenV3(world.Columns[0].XYZ),
+		      fmaxf(HMM_LenV3(world.Columns[1].XYZ),
+			    HMM_LenV3(world.Columns[2].XYZ)));
+  *out = (vkrt_sphere) {
+    .centre = { c.X, c.Y, c.Z },
+    .radius = radius * scale,
+    .material_index = p.material_index,
+  };
+  return true;
+}
+
+// replaces every primitive of a static mesh with a sphere if they all fit one
+// (see vkrt_primitive_fit_sphere), freeing the triangles
+bool vkrt_mesh_to_spheres(VmaAllocator allocator, vkrt_mesh *mesh, float tolerance,
+			  uint32_t min_vertices, vkrt_model *model) {
+  if (mesh->dynamic || mesh->primitive_count == 0) { return false; }
+  vkrt_sphere *spheres = calloc(sizeof(*spheres), mesh->primitive_count);
+  for (size_t i = 0; i < mesh->primitive_count; ++i) {
+    if (!vkrt_primitive_fit_sphere(mesh->primitives[i], mesh->rest_world, tolerance,
+				   min_vertices, &spheres[i])) {
+      free(spheres);
+      return false;
+    }
+  }
+  model->spheres = realloc(model->spheres, (model->sphere_count + mesh->primitive_count) *
+			   sizeof(*model->spheres));
+  memcpy(model->spheres + model->sphere_count, spheres,
+	 mesh->primitive_count * sizeof(*spheres));
+  model->sphere_count += mesh->primitive_count;
+  free(spheres);
+
+  for (size_t i = 0; i < mesh->primitive_count; ++i) {
+    vkrt_memory_free(allocator, mesh->primitives[i].vertex_buffer);
+    vkrt_memory_free(allocator, mesh->primitives[i].index_buffer);
+  }
+  free(mesh->primitives);
+  mesh->primitives = NULL;
+  mesh->primitive_count = 0;
+  return true;
+}
+
+// meshes (or their nodes) tagged with "extras": { "vkrt_sphere": true } are
+// always loaded as spheres, with detect_spheres any other static mesh that is
+// a tessellated sphere is too
 vkrt_model
 vkrt_load_gltf_model(VkDevice device, VmaAllocator allocator, VkQueue scratch_queue,
-		     vkw_immediate_submit_buffer immediate, const char *fp) {
+		     vkw_immediate_submit_buffer immediate, const char *fp,
+		     bool detect_spheres) {
   cgltf_options options = {};
   cgltf_data *data = NULL;
   cgltf_result res = cgltf_parse_file(&options, fp, &data);
@@ -178,39 +348,59 @@ vkrt_load_gltf_model(VkDevice device, VmaAllocator allocator, VkQueue scratch_qu
     materials[i].color[0] = mat.base_color_factor[0];
     materials[i].color[1] = mat.base_color_factor[1];
     materials[i].color[2] = mat.base_color_factor[2];
+    // blended materials are traced as opaque, only masks are alpha tested
+    materials[i].alpha = mat.base_color_factor[3];
+    materials[i].alpha_cutoff =
+      matt.alpha_mode == cgltf_alpha_mode_mask ? matt.alpha_cutoff : 0;
     // TODO:
     if (mat.base_color_texture.texture) {
       materials[i].texture_index = cgltf_texture_index(data, mat.base_color_texture.texture);
     } else {
-      // HACK TODO: this is not a real value and could contain a valid texture
-      // in more complex scenes
-      materials[i].texture_index = 256;
+      materials[i].texture_index = VKRT_NO_TEXTURE;
       printf("material at index %lu has no texture\n", i);
     }
+    float strength = matt.has_emissive_strength ?
+      matt.emissive_strength.emissive_strength : 1;
+    for (uint32_t c = 0; c < 3; ++c) {
+      materials[i].emissive[c] = matt.emissive_factor[c] * strength;
+    }
+    materials[i].emissive_texture_index = matt.emissive_texture.texture ?
+      cgltf_texture_index(data, matt.emissive_texture.texture) : VKRT_NO_TEXTURE;
   }
 
   model.texture_count = data->textures_count;
   model.textures = calloc(sizeof(*model.textures), model.texture_count);
   for (size_t i = 0; i < data->textures_count; ++i) {
     cgltf_texture tex = data->textures[i];
-    // TODO: if the file is a gltf, then the images need to be loaded via their URI
-    // which is relative to the path of the gltf model, so some work reconstructing
-    // the location relative to the exe is needed
+    // images in .glb files live in a buffer view, .gltf files reference them by
+    // a uri relative to the model file
+    uint8_t *pixels = NULL;
+    int w, h, c;
     if (tex.image && tex.image->buffer_view) {
       cgltf_buffer_view *view = tex.image->buffer_view;      
-      int w, h, c;
-      uint8_t *data = stbi_load_from_memory(view->buffer->data + view->offset, view->size,
-					    &w, &h, &c, 4);
+      pixels = stbi_load_from_memory(view->buffer->data + view->offset, view->size,
+				     &w, &h, &c, 4);
+    } else if (tex.image && tex.image->uri && !strstr(tex.image->uri, "://") &&
+	       strncmp(tex.image->uri, "data:", 5) != 0) {
+      const char *slash = strrchr(fp, '/');
+      size_t dir_len = slash ? (size_t)(slash - fp) + 1 : 0;
+      char *path = malloc(dir_len + strlen(tex.image->uri) + 1);
+      memcpy(path, fp, dir_len);
+      strcpy(path + dir_len, tex.image->uri);
+      pixels = stbi_load(path, &w, &h, &c, 4);
+      free(path);
+    }
+    if (pixels) {
       VkExtent3D dims = { w, h, 1 };
       VkImageUsageFlagBits usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
       model.textures[i] =
 	vkw_image_create_data(device, allocator, immediate, scratch_queue, dims,
-			      VK_FORMAT_R8G8B8A8_UNORM, usage, false, data);
+			      VK_FORMAT_R8G8B8A8_UNORM, usage, false, pixels);
       printf("Loaded image with dimensions: %d %d %d\n", w, h, 4);
-      free(data);
+      free(pixels);
     } else {
       fprintf(stderr, "Failed to load texture at index %lu\n", i);
-      if (tex.image->uri) {
+      if (tex.image && tex.image->uri) {
 	fprintf(stderr, "This image should have been loaded from %s\n", tex.image->uri);
       }
       exit(1);
@@ -220,6 +410,7 @@ vkrt_load_gltf_model(VkDevice device, VmaAllocator allocator, VkQueue scratch_qu
   VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
   
+  model.material_count = material_count;
   model.materials_buffer =
     vkrt_allocate_memory(device, allocator, sizeof(vkrt_material) * material_count,
 			 materials, usage);
@@ -227,11 +418,44 @@ vkrt_load_gltf_model(VkDevice device, VmaAllocator allocator, VkQueue scratch_qu
   free(materials);
   
   for (size_t i = 0; i < model.mesh_count; ++i) {
+    // the first node referencing the mesh places it in the world
+    cgltf_node node = { .rotation = {0, 0, 0, 1}, .scale = {1, 1, 1} };
+    uint32_t node_index = UINT32_MAX;
+    for (size_t j = 0; j < data->nodes_count; ++j) {
+      if (data->nodes[j].mesh == &data->meshes[i]) {
+	node = data->nodes[j];
+	node_index = j;
+	break;
+      }
+    }
     model.meshes[i] = vkrt_load_gltf_mesh(device, allocator, data->meshes[i],
-					  data->nodes[i], data);
+					  node, data);
+    model.meshes[i].node_index = node_index;
+    model.meshes[i].dynamic = vkrt_gltf_mesh_is_dynamic(data, &data->meshes[i]);
+    model.meshes[i].skinned = node_index != UINT32_MAX && data->nodes[node_index].skin;
+
+    bool tagged = vkrt_gltf_extras_flag(data, &data->meshes[i].extras, "vkrt_sphere") ||
+      (node_index != UINT32_MAX &&
+       vkrt_gltf_extras_flag(data, &data->nodes[node_index].extras, "vkrt_sphere"));
+    if (tagged) {
+      // a tetrahedron is the least that can be checked against the sphere
+      if (!vkrt_mesh_to_spheres(allocator, &model.meshes[i],
+				VKRT_SPHERE_TAGGED_TOLERANCE, 4, &model)) {
+	fprintf(stderr, "Mesh %lu (%s) is tagged vkrt_sphere but isn't a static sphere, "
+		"keeping its triangles\n", i,
+		data->meshes[i].name ? data->meshes[i].name : "unnamed");
+      }
+    } else if (detect_spheres) {
+      // spheres are tessellated finely enough to be worth swapping
+      vkrt_mesh_to_spheres(allocator, &model.meshes[i], VKRT_SPHERE_DETECT_TOLERANCE, 32,
+			   &model);
+    }
+  }
+  if (model.sphere_count > 0) {
+    printf("Loaded %lu analytic spheres\n", model.sphere_count);
   }
 
-  cgltf_free(data);
+  model.gltf = data;
 
   printf("%lu zero uvs\n", count_zero_uvs);
   
@@ -253,6 +477,8 @@ void vkrt_free_model(VkDevice device, VmaAllocator allocator, vkrt_model model)
     vkw_image_destroy(device, allocator, model.textures[i]);
   }
   vkrt_memory_free(allocator, model.materials_buffer);
+  cgltf_free(model.gltf);
+  free(model.spheres);
   free(model.textures);
   free(model.meshes);
 }
@@ -0,0 +1,538 @@
+#ifndef VK_RT_PIPELINES_H_
+#define VK_RT_PIPELINES_H_
+// the ray tracing pipeline, built once per render configuration. the settings
+// that shape the path loop are specialization constants (shaders/constants.glsl)
+// rather than push constants, so every variant is compiled with them folded
+// in. built variants are kept, switching back to one is free, and a
+// VkPipelineCache saves the driver work when a new one is built. with the ray
+// query backend a variant is a compute pipeline (shaders/ray_query.comp) instead,
+// with the pipeline backend it also has the compute passes of vk_rt_wavefront.h.
+// the hit shaders are also compiled per kind of material (vkrt_hit_group), and
+// the hit records are generated per geometry node to point at its kind
+
+// what traces the rays, picked at startup as the device needs different
+// extensions for each
+typedef enum {
+  vkrt_backend_pipeline, // VK_KHR_ray_tracing_pipeline and a shader binding table
+  vkrt_backend_ray_query, // VK_KHR_ray_query from a compute shader
+  vkrt_backend_count,
+} vkrt_backend;
+
+const char *vkrt_backend_names[vkrt_backend_count] = {
+  "pipeline", "ray-query",
+};
+
+// matches the constant_ids in shaders/constants.glsl
+typedef struct {
+  uint32_t max_depth; // bounces a path can take at most
+  uint32_t samples; // per pixel per launch
+} vkrt_specialization;
+
+// every vkrt_material_* flag, what the stages other than the hit shaders see
+#define VKRT_MATERIAL_ANY 7
+
+// a stage's constants, the variant's and the material flags of its hit group
+// (material_kind, constant_id 2)
+typedef struct {
+  vkrt_specialization spec;
+  uint32_t material_kind;
+} vkrt_stage_specialization;
+
+// every stage gets all of them, the ones a shader doesn't declare are ignored
+const VkSpecializationMapEntry vkrt_specialization_entries[] = {
+  { 0, offsetof(vkrt_stage_specialization, spec.max_depth), sizeof(uint32_t) },
+  { 1, offsetof(vkrt_stage_specialization, spec.samples), sizeof(uint32_t) },
+  { 2, offsetof(vkrt_stage_specialization, material_kind), sizeof(uint32_t) },
+};
+
+// the stages of every variant, the shader groups index into this order
+typedef enum {
+  vkrt_stage_rgen,
+  vkrt_stage_miss,
+  vkrt_stage_closest_hit,
+  vkrt_stage_sphere_hit,
+  vkrt_stage_sphere_int,
+  vkrt_stage_alpha_test,
+  vkrt_stage_shadow_miss,
+  vkrt_stage_wave_extend,
+  vkrt_stage_wave_shadow,
+  vkrt_stage_count,
+} vkrt_stage;
+
+const char *vkrt_stage_paths[vkrt_stage_count] = {
+  "./shaders/ray_gen.spv", "./shaders/miss.spv", "./shaders/closest_hit.spv",
+  "./shaders/sphere_hit.spv", "./shaders/sphere_int.spv", "./shaders/alpha_test.spv",
+  "./shaders/shadow_rmiss.spv", "./shaders/wave_extend.spv", "./shaders/wave_shadow.spv",
+};
+
+const VkShaderStageFlagBits vkrt_stage_flags[vkrt_stage_count] = {
+  VK_SHADER_STAGE_RAYGEN_BIT_KHR, VK_SHADER_STAGE_MISS_BIT_KHR,
+  VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
+  VK_SHADER_STAGE_INTERSECTION_BIT_KHR, VK_SHADER_STAGE_ANY_HIT_BIT_KHR,
+  VK_SHADER_STAGE_MISS_BIT_KHR, VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+  VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+};
+
+// the ray generation shaders a variant can launch, they share the miss and
+// hit groups
+typedef enum {
+  vkrt_raygen_path, // the path loop, shaders/ray_gen.rgen
+  vkrt_raygen_wave_extend, // the ray tracing passes of vk_rt_wavefront.h
+  vkrt_raygen_wave_shadow,
+  vkrt_raygen_count,
+} vkrt_raygen;
+
+const vkrt_stage vkrt_raygen_stages[vkrt_raygen_count] = {
+  vkrt_stage_rgen, vkrt_stage_wave_extend, vkrt_stage_wave_shadow,
+};
+
+// the compute passes of vk_rt_wavefront.h, they include shaders/constants.glsl
+// like the ray tracing stages so every variant has its own
+typedef enum {
+  vkrt_wave_pass_generate,
+  vkrt_wave_pass_sort,
+  vkrt_wave_pass_shade,
+  vkrt_wave_pass_accumulate,
+  vkrt_wave_pass_count,
+} vkrt_wave_pass;
+
+const char *vkrt_wave_pass_paths[vkrt_wave_pass_count] = {
+  "./shaders/wave_generate.spv", "./shaders/wave_sort.spv",
+  "./shaders/wave_shade.spv", "./shaders/wave_accumulate.spv",
+};
+
+// a handful covers flipping between the configurations in use, the slider
+// values passed on the way are evicted again
+#define VKRT_MAX_PIPELINE_VARIANTS 8
+
+typedef struct {
+  vkrt_specialization spec;
+  vkrt_tracer tracers[vkrt_raygen_count];
+  vkrt_memory sbt_rgen[vkrt_raygen_count];
+  vkrt_memory sbt_rmiss;
+  vkrt_memory sbt_rchit;
+  uint8_t *hit_handles; // of each vkrt_hit_group, for regenerating sbt_rchit
+  vkw_compute_pipeline wave_passes[vkrt_wave_pass_count]; // pipeline backend only
+  uint64_t last_used;
+} vkrt_pipeline_variant;
+
+typedef struct {
+  VkDevice device;
+  VmaAllocator allocator;
+  VkPipelineLayout layout;
+  VkDescriptorSet set;
+  VkShaderStageFlags push_constant_stages;
+  // the wavefront passes get a layout of their own on the same set, with the
+  // push constants only in the compute stage
+  VkDescriptorSetLayout set_layout;
+  uint32_t sizeof_push_constants;
+  VkPhysicalDeviceRayTracingPipelinePropertiesKHR props;
+  vkrt_backend backend;
+  uint32_t launch_size_offset; // see vkrt_tracer, for the ray query backend
+  VkShaderModule modules[vkrt_stage_count];
+  VkShaderModule ray_query;
+  VkShaderModule wave_modules[vkrt_wave_pass_count];
+  VkPipelineCache cache;
+  // the vkrt_hit_group of each geometry node, which the hit records follow
+  uint32_t hit_record_count;
+  uint32_t *hit_groups;
+  vkrt_pipeline_variant variants[VKRT_MAX_PIPELINE_VARIANTS];
+  uint32_t count;
+  uint32_t built; // variants built so far, evicted ones included
+  uint64_t uses;
+} vkrt_pipelines;
+
+// layout and push_constant_stages are for the backend's shader stages
+vkrt_pipelines vkrt_pipelines_create(VkDevice device, VmaAllocator allocator,
+				     VkPipelineLayout layout, VkDescriptorSetLayout set_layout,
+				     VkDescriptorSet set, VkShaderStageFlags push_constant_stages,
+				     uint32_t sizeof_push_constants,
+				     VkPhysicalDeviceRayTracingPipelinePropertiesKHR props,
+				     vkrt_backend backend, uint32_t launch_size_offset) {
+  vkrt_pipelines p = {
+    .device = device,
+    .allocator = allocator,
+    .layout = layout,
+    .set = set,
+    .push_constant_stages = push_constant_stages,
+    .set_layout = set_layout,
+    .sizeof_push_constants = sizeof_push_constants,
+    .props = props,
+    .backend = backend,
+    .launch_size_offset = launch_size_offset,
+  };
+  if (backend == vkrt_backend_ray_query &&
+      !vkh_load_shader_module("./shaders/ray_query.spv", device, &p.ray_query)) {
+    fprintf(stderr, "Failed to load the ray query shader - please check it exists\n");
+    exit(1);
+  }
+  // the ray tracing stages can't be loaded without the pipeline extension
+  for (uint32_t i = 0; backend == vkrt_backend_pipeline && i < vkrt_stage_count; ++i) {
+    if (!vkh_load_shader_module(vkrt_stage_paths[i], device, &p.modules[i])) {
+      fprintf(stderr, "Failed to load a raytracing shader - please check they exist\n");
+      exit(1);
+    }
+  }
+  for (uint32_t i = 0; backend == vkrt_backend_pipeline && i < vkrt_wave_pass_count; ++i) {
+    if (!vkh_load_shader_module(vkrt_wave_pass_paths[i], device, &p.wave_modules[i])) {
+      fprintf(stderr, "Failed to load a wavefront shader - please check they exist\n");
+      exit(1);
+    }
+  }
+  VkPipelineCacheCreateInfo cache_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+  };
+  VK_CHECK(vkCreatePipelineCache(device, &cache_info, NULL, &p.cache));
+  return p;
+}
+
+// generates the sbt hit region of a variant: a record per geometry node, in
+// node order, holding the handle of the node's hit group. an instance's
+// records start at its first node (its sbt record offset) and traces step
+// through them by geometry index (an sbt record stride of 1)
+void vkrt_pipeline_variant_write_hits(vkrt_pipelines *p, vkrt_pipeline_variant *v) {
+  uint64_t handle_size = p->props.shaderGroupHandleSize;
+  uint64_t alignment = p->props.shaderGroupHandleAlignment;
+  uint64_t stride = (handle_size + alignment - 1) & ~(alignment - 1);
+  if (v->sbt_rchit.buffer) {
+    vkrt_memory_free(p->allocator, v->sbt_rchit);
+  }
+  // never empty, the buffer can't be
+  uint32_t count = p->hit_record_count > 0 ? p->hit_record_count : 1;
+  uint8_t *records = calloc(count, stride);
+  for (uint32_t i = 0; i < p->hit_record_count; ++i) {
+    memcpy(records + i * stride, v->hit_handles + p->hit_groups[i] * handle_size,
+	   handle_size);
+  }
+  v->sbt_rchit = vkrt_allocate_memory(p->device, p->allocator, count * stride, records,
+				      VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR |
+				      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  free(records);
+  for (uint32_t i = 0; i < vkrt_raygen_count; ++i) {
+    v->tracers[i].rchit = (VkStridedDeviceAddressRegionKHR) {
+      .deviceAddress = v->sbt_rchit.device_address,
+      .size = count * stride,
+      .stride = stride,
+    };
+  }
+}
+
+// builds the pipeline for spec and its shader binding table
+void vkrt_pipeline_variant_build(vkrt_pipelines *p, vkrt_pipeline_variant *v,
+				 vkrt_specialization spec) {
+  *v = (vkrt_pipeline_variant){ .spec = spec };
+  // the material flags the stages are compiled for: every one for the stages
+  // that aren't hit shaders, then the kinds of hit group. the closest hit
+  // shader only cares about emission, the any-hit shader about the alpha test
+  enum { kind_any, kind_plain, kind_emissive, kind_masked, kind_masked_textured,
+	 kind_count };
+  vkrt_stage_specialization kinds[kind_count] = {
+    { spec, VKRT_MATERIAL_ANY }, { spec, 0 }, { spec, vkrt_material_emissive },
+    { spec, vkrt_material_masked }, { spec, vkrt_material_masked | vkrt_material_textured },
+  };
+  VkSpecializationInfo spec_infos[kind_count];
+  for (uint32_t i = 0; i < kind_count; ++i) {
+    spec_infos[i] = (VkSpecializationInfo) {
+      .mapEntryCount = sizeof(vkrt_specialization_entries) /
+      sizeof(vkrt_specialization_entries[0]),
+      .pMapEntries = vkrt_specialization_entries,
+      .dataSize = sizeof(kinds[i]),
+      .pData = &kinds[i],
+    };
+  }
+  if (p->backend == vkrt_backend_ray_query) {
+    VkComputePipelineCreateInfo compute_info = {
+      .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+      .stage = {
+	.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+	.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+	.module = p->ray_query,
+	.pName = "main",
+	.pSpecializationInfo = &spec_infos[kind_any],
+      },
+      .layout = p->layout,
+    };
+    VkPipeline pipeline;
+    VK_CHECK(vkCreateComputePipelines(p->device, p->cache, 1, &compute_info, NULL,
+				      &pipeline));
+    // only the path loop, the wavefront passes need the ray tracing pipeline
+    v->tracers[vkrt_raygen_path] = (vkrt_tracer) {
+      .pipeline = pipeline,
+      .layout = p->layout,
+      .set = p->set,
+      .push_constant_stages = p->push_constant_stages,
+      .compute = true,
+      .launch_size_offset = p->launch_size_offset,
+    };
+    p->built++;
+    return;
+  }
+  // the stages in vkrt_stage order, the closest hit shader compiled for plain
+  // materials, then the hit shaders again for the other kinds. the any-hit
+  // shader of the groups that aren't masked keeps every check: it only runs
+  // when alpha_test_all forces opaque geometry through it, which is meant to
+  // cost what testing everything naively does
+  enum { stage_closest_hit_emissive = vkrt_stage_count, stage_alpha_test_masked,
+	 stage_alpha_test_textured, stage_count };
+  VkPipelineShaderStageCreateInfo stages[stage_count];
+  for (uint32_t i = 0; i < stage_count; ++i) {
+    vkrt_stage module = i;
+    uint32_t kind = kind_any;
+    if (i == vkrt_stage_closest_hit) {
+      kind = kind_plain;
+    } else if (i == stage_closest_hit_emissive) {
+      module = vkrt_stage_closest_hit;
+      kind = kind_emissive;
+    } else if (i >= stage_alpha_test_masked) {
+      module = vkrt_stage_alpha_test;
+      kind = i == stage_alpha_test_masked ? kind_masked : kind_masked_textured;
+    }
+    stages[i] = (VkPipelineShaderStageCreateInfo) {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = vkrt_stage_flags[module],
+      .module = p->modules[module],
+      .pName = "main",
+      .pSpecializationInfo = &spec_infos[kind],
+    };
+  }
+
+  VkRayTracingShaderGroupCreateInfoKHR rgen_groups[vkrt_raygen_count];
+  for (uint32_t i = 0; i < vkrt_raygen_count; ++i) {
+    rgen_groups[i] = (VkRayTracingShaderGroupCreateInfoKHR) {
+      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+      .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
+      .generalShader = vkrt_raygen_stages[i],
+      .closestHitShader = VK_SHADER_UNUSED_KHR,
+      .anyHitShader = VK_SHADER_UNUSED_KHR,
+      .intersectionShader = VK_SHADER_UNUSED_KHR,
+    };
+  }
+
+  VkRayTracingShaderGroupCreateInfoKHR rmiss_group = {
+    .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+    .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
+    .generalShader = vkrt_stage_miss,
+    .closestHitShader = VK_SHADER_UNUSED_KHR,
+    .anyHitShader = VK_SHADER_UNUSED_KHR,
+    .intersectionShader = VK_SHADER_UNUSED_KHR,
+  };
+
+  // miss index 1, for the shadow rays, which reuse the hit groups below with
+  // the closest hit shader skipped
+  VkRayTracingShaderGroupCreateInfoKHR shadow_rmiss_group = {
+    .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+    .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
+    .generalShader = vkrt_stage_shadow_miss,
+    .closestHitShader = VK_SHADER_UNUSED_KHR,
+    .anyHitShader = VK_SHADER_UNUSED_KHR,
+    .intersectionShader = VK_SHADER_UNUSED_KHR,
+  };
+
+  // a triangle hit group per combination of material flags, the group index
+  VkRayTracingShaderGroupCreateInfoKHR hit_groups[vkrt_hit_group_count];
+  for (uint32_t g = 0; g < vkrt_hit_group_spheres; ++g) {
+    uint32_t any_hit = vkrt_stage_alpha_test;
+    if (g & vkrt_material_masked) {
+      any_hit = g & vkrt_material_textured ? stage_alpha_test_textured :
+	stage_alpha_test_masked;
+    }
+    hit_groups[g] = (VkRayTracingShaderGroupCreateInfoKHR) {
+      .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+      .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR,
+      .generalShader = VK_SHADER_UNUSED_KHR,
+      .closestHitShader = g & vkrt_material_emissive ? stage_closest_hit_emissive :
+      vkrt_stage_closest_hit,
+      // only invoked for non-opaque (alpha masked) geometry
+      .anyHitShader = any_hit,
+      .intersectionShader = VK_SHADER_UNUSED_KHR,
+    };
+  }
+
+  // the sphere geometry's records point at this one
+  hit_groups[vkrt_hit_group_spheres] = (VkRayTracingShaderGroupCreateInfoKHR) {
+    .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+    .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_PROCEDURAL_HIT_GROUP_KHR,
+    .generalShader = VK_SHADER_UNUSED_KHR,
+    .closestHitShader = vkrt_stage_sphere_hit,
+    .anyHitShader = VK_SHADER_UNUSED_KHR,
+    .intersectionShader = vkrt_stage_sphere_int,
+  };
+
+  // the rgens, the two misses, then one hit group per vkrt_hit_group
+  uint32_t sbt_miss_count = 2;
+  uint32_t sbt_group_count = vkrt_raygen_count + sbt_miss_count + vkrt_hit_group_count;
+  VkRayTracingShaderGroupCreateInfoKHR shader_groups[sbt_group_count];
+  memcpy(shader_groups, rgen_groups, sizeof(rgen_groups));
+  shader_groups[vkrt_raygen_count] = rmiss_group;
+  shader_groups[vkrt_raygen_count + 1] = shadow_rmiss_group;
+  memcpy(shader_groups + vkrt_raygen_count + sbt_miss_count, hit_groups,
+	 sizeof(hit_groups));
+
+  VkRayTracingPipelineCreateInfoKHR pipeline_info = {
+    .sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR,
+    .stageCount = stage_count,
+    .pStages = stages,
+    .groupCount = sbt_group_count,
+    .pGroups = shader_groups,
+    .maxPipelineRayRecursionDepth = 1, // all rays are traced from raygen
+    .layout = p->layout,
+  };
+  VkPipeline pipeline;
+  VK_CHECK(vkCreateRayTracingPipelinesKHRp(p->device, NULL, p->cache, 1, &pipeline_info,
+					  NULL, &pipeline));
+
+  // shader binding table
+  uint64_t sbt_handle_size = p->props.shaderGroupHandleSize;
+  uint64_t sbt_handle_alignment = p->props.shaderGroupHandleAlignment;
+  uint64_t sbt_handle_size_aligned =
+    (sbt_handle_size + sbt_handle_alignment - 1) & ~(sbt_handle_alignment - 1);
+  uint64_t sbt_size = sbt_group_count * sbt_handle_size_aligned;
+
+  // the handles come back packed, spread them out to the aligned stride
+  uint8_t *sbt_handles = calloc(sbt_group_count, sbt_handle_size);
+  uint8_t *sbt_results = calloc(sbt_size, 1);
+  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR |
+    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+  VK_CHECK(vkGetRayTracingShaderGroupHandlesKHRp(p->device, pipeline, 0, sbt_group_count,
+						sbt_group_count * sbt_handle_size,
+						sbt_handles));
+  for (uint32_t i = 0; i < sbt_group_count; ++i) {
+    memcpy(sbt_results + i * sbt_handle_size_aligned, sbt_handles + i * sbt_handle_size,
+	   sbt_handle_size);
+  }
+  free(sbt_handles);
+
+  // NOTE: these are in the same order as the shader groups above!
+  // a launch's rgen region is the one record, so each gets its own buffer
+  for (uint32_t i = 0; i < vkrt_raygen_count; ++i) {
+    v->sbt_rgen[i] = vkrt_allocate_memory(p->device, p->allocator, sbt_handle_size,
+					  sbt_results + i * sbt_handle_size_aligned, usage);
+  }
+  v->sbt_rmiss = vkrt_allocate_memory(p->device, p->allocator,
+				      sbt_handle_size_aligned * sbt_miss_count,
+				      sbt_results + sbt_handle_size_aligned *
+				      vkrt_raygen_count, usage);
+  // the hit records are generated from the scene's geometry, keep the handles
+  v->hit_handles = calloc(vkrt_hit_group_count, sbt_handle_size);
+  for (uint32_t i = 0; i < vkrt_hit_group_count; ++i) {
+    memcpy(v->hit_handles + i * sbt_handle_size,
+	   sbt_results + (vkrt_raygen_count + sbt_miss_count + i) * sbt_handle_size_aligned,
+	   sbt_handle_size);
+  }
+  free(sbt_results);
+
+  for (uint32_t i = 0; i < vkrt_raygen_count; ++i) {
+    v->tracers[i] = (vkrt_tracer) {
+      .pipeline = pipeline,
+      .layout = p->layout,
+      .set = p->set,
+      .push_constant_stages = p->push_constant_stages,
+      .rgen = {
+	.deviceAddress = v->sbt_rgen[i].device_address,
+	.size = sbt_handle_size_aligned,
+	.stride = sbt_handle_size_aligned,
+      },
+      .rmiss = {
+	.deviceAddress = v->sbt_rmiss.device_address,
+	.size = sbt_handle_size_aligned * sbt_miss_count,
+	.stride = sbt_handle_size_aligned,
+      },
+    };
+  }
+  vkrt_pipeline_variant_write_hits(p, v);
+  // the wavefront's compute passes, with the constants the rgens see
+  for (uint32_t i = 0; i < vkrt_wave_pass_count; ++i) {
+    v->wave_passes[i] =
+      vkw_compute_pipeline_create_specialized(p->device, p->cache, p->set_layout,
+					      p->wave_modules[i], p->sizeof_push_constants,
+					      &spec_infos[kind_any]);
+  }
+  p->built++;
+}
+
+void vkrt_pipeline_variant_destroy(vkrt_pipelines *p, vkrt_pipeline_variant *v) {
+  vkDestroyPipeline(p->device, v->tracers[0].pipeline, NULL);
+  for (uint32_t i = 0; i < vkrt_raygen_count; ++i) {
+    vkrt_memory_free(p->allocator, v->sbt_rgen[i]);
+  }
+  vkrt_memory_free(p->allocator, v->sbt_rmiss);
+  vkrt_memory_free(p->allocator, v->sbt_rchit);
+  free(v->hit_handles);
+  for (uint32_t i = 0; i < vkrt_wave_pass_count; ++i) {
+    vkw_compute_pipeline_destroy(p->device, v->wave_passes[i]);
+  }
+  *v = (vkrt_pipeline_variant){};
+}
+
+// the variant for spec, built if it isn't cached. when the cache is full the
+// least recently used variant makes room, after waiting for the device as
+// frames in flight may still trace with it
+vkrt_pipeline_variant *vkrt_pipelines_get_variant(vkrt_pipelines *p,
+						  vkrt_specialization spec) {
+  p->uses++;
+  for (uint32_t i = 0; i < p->count; ++i) {
+    if (memcmp(&p->variants[i].spec, &spec, sizeof(spec)) == 0) {
+      p->variants[i].last_used = p->uses;
+      return &p->variants[i];
+    }
+  }
+  vkrt_pipeline_variant *v;
+  if (p->count < VKRT_MAX_PIPELINE_VARIANTS) {
+    v = &p->variants[p->count++];
+  } else {
+    v = &p->variants[0];
+    for (uint32_t i = 1; i < p->count; ++i) {
+      if (p->variants[i].last_used < v->last_used) { v = &p->variants[i]; }
+    }
+    vkDeviceWaitIdle(p->device);
+    vkrt_pipeline_variant_destroy(p, v);
+  }
+  vkrt_pipeline_variant_build(p, v, spec);
+  v->last_used = p->uses;
+  return v;
+}
+
+// the tracer launching raygen with spec, see vkrt_pipelines_get_variant
+vkrt_tracer *vkrt_pipelines_get(vkrt_pipelines *p, vkrt_specialization spec,
+				vkrt_raygen raygen) {
+  if (p->backend == vkrt_backend_ray_query && raygen != vkrt_raygen_path) {
+    fprintf(stderr, "The ray query backend only traces the path loop\n");
+    exit(1);
+  }
+  return &vkrt_pipelines_get_variant(p, spec)->tracers[raygen];
+}
+
+// points the hit records at the groups of count geometry nodes (a scene's
+// geom_hit_group), for the variants built so far and those to come. call it
+// again whenever the scene is rebuilt. waits for the device, as frames in
+// flight may still trace with the old records
+void vkrt_pipelines_set_hit_groups(vkrt_pipelines *p, uint32_t count,
+				   const uint32_t *groups) {
+  free(p->hit_groups);
+  p->hit_record_count = count;
+  p->hit_groups = calloc(sizeof(uint32_t), count);
+  memcpy(p->hit_groups, groups, count * sizeof(uint32_t));
+  // ray queries have no shader binding table
+  if (p->backend != vkrt_backend_pipeline || p->count == 0) { return; }
+  vkDeviceWaitIdle(p->device);
+  for (uint32_t i = 0; i < p->count; ++i) {
+    vkrt_pipeline_variant_write_hits(p, &p->variants[i]);
+  }
+}
+
+void vkrt_pipelines_destroy(vkrt_pipelines *p) {
+  for (uint32_t i = 0; i < p->count; ++i) {
+    vkrt_pipeline_variant_destroy(p, &p->variants[i]);
+  }
+  for (uint32_t i = 0; i < vkrt_stage_count; ++i) {
+    vkDestroyShaderModule(p->device, p->modules[i], NULL);
+  }
+  vkDestroyShaderModule(p->device, p->ray_query, NULL);
+  for (uint32_t i = 0; i < vkrt_wave_pass_count; ++i) {
+    vkDestroyShaderModule(p->device, p->wave_modules[i], NULL);
+  }
+  vkDestroyPipelineCache(p->device, p->cache, NULL);
+  free(p->hit_groups);
+  *p = (vkrt_pipelines){};
+}
+#endif // VK_RT_PIPELINES_H_
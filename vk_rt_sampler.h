@@ -0,0 +1,136 @@
+#ifndef VK_RT_SAMPLER_H_
+#define VK_RT_SAMPLER_H_
+// the sequences paths can draw their random numbers from (shaders/sampler.glsl)
+// and the blue noise mask the blue noise one is rotated by, made on the host
+// with the void and cluster method
+
+#include <math.h>
+
+// matches the sampler_ constants in shaders/sampler.glsl
+typedef enum {
+  vkrt_sampler_random, // tea seeded lcg
+  vkrt_sampler_sobol, // owen scrambled sobol, shuffled per pixel
+  vkrt_sampler_blue_noise, // one sobol sequence rotated by a blue noise mask
+  vkrt_sampler_count,
+} vkrt_sampler_mode;
+
+const char *vkrt_sampler_names[vkrt_sampler_count] = {
+  "random", "sobol", "blue-noise",
+};
+
+// width and height of the tiling mask, matches blue_noise_size in the shader
+#define VKRT_BLUE_NOISE_SIZE 64
+
+// adds sign * a gaussian centred on p to the energy of every pixel, wrapping
+// around the edges so the mask tiles
+void vkrt_blue_noise_splat(float *energy, const float *kernel, uint32_t size,
+			   uint32_t p, float sign) {
+  uint32_t px = p % size, py = p / size;
+  for (uint32_t y = 0; y < size; ++y) {
+    uint32_t dy = (y + size - py) % size;
+    for (uint32_t x = 0; x < size; ++x) {
+      uint32_t dx = (x + size - px) % size;
+      energy[y * size + x] += sign * kernel[dy * size + dx];
+    }
+  }
+}
+
+// the set pixel with the most energy (the tightest cluster) or the unset one
+// with the least (the largest void)
+uint32_t vkrt_blue_noise_extreme(const float *energy, const bool *set, uint32_t n,
+				 bool cluster) {
+  uint32_t best = UINT32_MAX;
+  for (uint32_t i = 0; i < n; ++i) {
+    if (set[i] != cluster) { continue; }
+    if (best == UINT32_MAX || (cluster ? energy[i] > energy[best] :
+			       energy[i] < energy[best])) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+// fills out (size * size) with thresholds in (0, 1) that are spread out at
+// every level, so any threshold of the mask gives evenly spaced pixels
+void vkrt_blue_noise_generate(uint32_t size, float *out) {
+  uint32_t n = size * size;
+  float *kernel = calloc(sizeof(float), n);
+  float *energy = calloc(sizeof(float), n);
+  bool *set = calloc(sizeof(bool), n);
+  bool *proto = calloc(sizeof(bool), n);
+  uint32_t *rank = calloc(sizeof(uint32_t), n);
+
+  const float sigma = 1.5f;
+  for (uint32_t y = 0; y < size; ++y) {
+    for (uint32_t x = 0; x < size; ++x) {
+      float dx = (float)(x < size / 2 ? x : size - x);
+      float dy = (float)(y < size / 2 ? y : size - y);
+      kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+    }
+  }
+
+  // a tenth of the pixels set at random, then swapped from the tightest
+  // cluster to the largest void until that stops moving anything
+  uint32_t ones = n / 10;
+  uint32_t state = 0x9E3779B9u;
+  for (uint32_t placed = 0; placed < ones;) {
+    state = state * 1664525u + 1013904223u;
+    uint32_t p = (state >> 8) % n;
+    if (set[p]) { continue; }
+    set[p] = true;
+    vkrt_blue_noise_splat(energy, kernel, size, p, 1);
+    placed++;
+  }
+  for (;;) {
+    uint32_t c = vkrt_blue_noise_extreme(energy, set, n, true);
+    set[c] = false;
+    vkrt_blue_noise_splat(energy, kernel, size, c, -1);
+    uint32_t v = vkrt_blue_noise_extreme(energy, set, n, false);
+    set[v] = true;
+    vkrt_blue_noise_splat(energy, kernel, size, v, 1);
+    if (v == c) { break; }
+  }
+  memcpy(proto, set, n * sizeof(bool));
+  float *proto_energy = calloc(sizeof(float), n);
+  memcpy(proto_energy, energy, n * sizeof(float));
+
+  // the prototype's pixels rank below it, tightest clusters removed first
+  for (uint32_t r = ones; r > 0; --r) {
+    uint32_t c = vkrt_blue_noise_extreme(energy, set, n, true);
+    set[c] = false;
+    vkrt_blue_noise_splat(energy, kernel, size, c, -1);
+    rank[c] = r - 1;
+  }
+  // and the rest above it, largest voids filled first
+  memcpy(set, proto, n * sizeof(bool));
+  memcpy(energy, proto_energy, n * sizeof(float));
+  for (uint32_t r = ones; r < n; ++r) {
+    uint32_t v = vkrt_blue_noise_extreme(energy, set, n, false);
+    set[v] = true;
+    vkrt_blue_noise_splat(energy, kernel, size, v, 1);
+    rank[v] = r;
+  }
+
+  for (uint32_t i = 0; i < n; ++i) {
+    out[i] = (rank[i] + 0.5f) / n;
+  }
+  free(proto_energy);
+  free(rank);
+  free(proto);
+  free(set);
+  free(energy);
+  free(kernel);
+}
+
+vkrt_memory vkrt_blue_noise_create(VkDevice device, VmaAllocator allocator) {
+  uint32_t n = VKRT_BLUE_NOISE_SIZE * VKRT_BLUE_NOISE_SIZE;
+  float *mask = calloc(sizeof(float), n);
+  vkrt_blue_noise_generate(VKRT_BLUE_NOISE_SIZE, mask);
+  vkrt_memory res =
+    vkrt_allocate_memory(device, allocator, n * sizeof(float), mask,
+			 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  free(mask);
+  return res;
+}
+#endif // VK_RT_SAMPLER_H_
@@ -0,0 +1,781 @@
+#ifndef VK_RT_SCENE_H_
+#define VK_RT_SCENE_H_
+// builds the acceleration structures for a loaded vkrt_model, grouping the
+// model's primitives into BLASes according to a selectable policy
+
+#include <math.h>
+
+typedef struct {
+  uint64_t vertex_buffer_address;
+  uint64_t index_buffer_address;
+  uint32_t material_index;
+  uint32_t first_light; // see vkrt_primitive, UINT32_MAX if it doesn't emit
+} geometry_node;
+
+// what a triangle hit group is compiled for (material_kind in
+// shaders/constants.glsl), a geometry's flags are the index of its group
+enum {
+  vkrt_material_emissive = 1, // in the light table, hits look up their light
+  vkrt_material_masked = 2, // alpha masked, the any-hit shader tests it
+  vkrt_material_textured = 4, // has a base colour texture, whose alpha is tested
+};
+
+// hit groups in the order they sit in the pipeline: a triangle group for
+// every combination of the flags above, then the spheres. the sbt hit region
+// is generated with a record per geometry node pointing at the node's group
+// (vkrt_pipelines_set_hit_groups), so the hit shaders a geometry runs are
+// specialised for its material instead of branching on it
+typedef enum {
+  vkrt_hit_group_spheres = 8, // procedural, see shaders/sphere.rint
+  vkrt_hit_group_count,
+} vkrt_hit_group;
+
+typedef enum {
+  vkrt_blas_per_primitive,
+  vkrt_blas_per_mesh,
+  vkrt_blas_per_material,
+  vkrt_blas_spatial,
+  vkrt_blas_whole_scene,
+  vkrt_blas_policy_count,
+} vkrt_blas_policy;
+
+const char *vkrt_blas_policy_names[vkrt_blas_policy_count] = {
+  "primitive", "mesh", "material", "spatial", "scene",
+};
+
+// returns vkrt_blas_policy_count if the name doesn't match a policy
+vkrt_blas_policy vkrt_blas_policy_from_name(const char *name) {
+  for (uint32_t i = 0; i < vkrt_blas_policy_count; ++i) {
+    if (strcmp(name, vkrt_blas_policy_names[i]) == 0) {
+      return i;
+    }
+  }
+  return vkrt_blas_policy_count;
+}
+
+// build flags for the acceleration structures of a scene, blases holding
+// dynamic meshes get their own profile so they can be refit every frame
+typedef struct {
+  VkBuildAccelerationStructureFlagsKHR static_blas;
+  VkBuildAccelerationStructureFlagsKHR dynamic_blas;
+  VkBuildAccelerationStructureFlagsKHR tlas;
+} vkrt_as_profiles;
+
+vkrt_as_profiles vkrt_as_profiles_default(void) {
+  return (vkrt_as_profiles) {
+    .static_blas = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+                   VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+    .dynamic_blas = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR |
+                    VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+    .tlas = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+            VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+  };
+}
+
+typedef struct {
+  vkrt_blas_policy policy;
+  vkrt_as_profiles profiles;
+  uint32_t host_threads; // 0 if the blases were built on the device
+
+  uint32_t blas_count;
+  vkrt_as *blases;
+  // index of the first geometry node of each blas, used as the instance custom
+  // index so hit shaders can find nodes[custom_index + geometry_index], and as
+  // its sbt record offset to pick the hit record of the same node
+  uint32_t *blas_first_geom;
+  // mesh of each dynamic blas (UINT32_MAX for static ones), dynamic meshes
+  // always get a blas of their own so they can be moved by their instance
+  uint32_t *blas_mesh;
+  vkrt_as tlas;
+
+  // instance transforms (one per blas) go on top of the mesh transforms that
+  // are baked into the blases, they are written to the instance buffer of the
+  // frame being recorded and the tlas is refit from that
+  VkTransformMatrixKHR *instance_transforms;
+  vkrt_memory instance_buffers[FRAME_OVERLAP];
+  vkrt_memory tlas_scratch;
+  uint32_t updates_since_rebuild;
+
+  // with an instance generator only the object table is written on the host
+  // and the instance records are made on the gpu (see vk_rt_instances.h),
+  // otherwise instance_buffers are written directly
+  vkrt_instance_generator *instance_gen;
+  vkrt_memory objects[FRAME_OVERLAP];
+  vkrt_memory blas_addresses;
+
+  uint32_t geom_count;
+  vkrt_memory geometry_nodes;
+  uint32_t *geom_hit_group; // vkrt_hit_group of each geometry node
+  vkrt_geom_data_gpu *geom_datas; // in geometry node order, for refits
+
+  // the model's spheres all go in one aabb blas after the triangle ones, its
+  // geometry node points at the sphere buffer instead of vertices
+  uint32_t sphere_count;
+  vkrt_memory spheres;
+  vkrt_memory sphere_aabbs;
+
+  // dynamic blases are refit in parallel, each with its own part of this.
+  // the parts start at minAccelerationStructureScratchOffsetAlignment
+  vkrt_memory blas_scratch;
+  VkDeviceSize *blas_scratch_offsets;
+  VkDeviceSize scratch_alignment;
+
+  double build_ms;
+  VkDeviceSize blas_bytes;
+  VkDeviceSize tlas_bytes;
+} vkrt_scene;
+
+typedef struct {
+  uint32_t mesh;
+  uint32_t primitive;
+  uint32_t dynamic; // never shares a blas with static geometry
+  uint32_t key;
+  uint32_t order; // keeps the sort stable
+} vkrt_geom_ref;
+
+int vkrt_geom_ref_cmp(const void *a, const void *b) {
+  const vkrt_geom_ref *ra = a;
+  const vkrt_geom_ref *rb = b;
+  if (ra->dynamic != rb->dynamic) { return (int)ra->dynamic - (int)rb->dynamic; }
+  if (ra->key != rb->key) { return ra->key < rb->key ? -1 : 1; }
+  return (int)ra->order - (int)rb->order;
+}
+
+uint32_t vkrt_morton_spread(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8))  & 0x0300f00f;
+  x = (x | (x << 4))  & 0x030c30c3;
+  x = (x | (x << 2))  & 0x09249249;
+  return x;
+}
+
+// grows lo/hi by the world space bounding box of a primitive, read back from
+// the (host visible) vertex and transform buffers
+void vkrt_primitive_bounds(vkrt_mesh mesh, vkrt_primitive p, HMM_Vec3 *lo,
+			   HMM_Vec3 *hi) {
+  vkrt_vertex_t *vertices = p.vertex_buffer.info.pMappedData;
+  VkTransformMatrixKHR *t = mesh.transform_buffer.info.pMappedData;
+  for (uint32_t i = 0; i < p.vertex_count; ++i) {
+    HMM_Vec3 v = vertices[i].pos;
+    for (uint32_t r = 0; r < 3; ++r) {
+      float w = t->matrix[r][0] * v.X + t->matrix[r][1] * v.Y +
+	t->matrix[r][2] * v.Z + t->matrix[r][3];
+      if (w < lo->Elements[r]) { lo->Elements[r] = w; }
+      if (w > hi->Elements[r]) { hi->Elements[r] = w; }
+    }
+  }
+}
+
+HMM_Vec3 vkrt_primitive_centroid(vkrt_mesh mesh, vkrt_primitive p) {
+  HMM_Vec3 lo = { INFINITY, INFINITY, INFINITY };
+  HMM_Vec3 hi = { -INFINITY, -INFINITY, -INFINITY };
+  vkrt_primitive_bounds(mesh, p, &lo, &hi);
+  return HMM_MulV3F(HMM_AddV3(lo, hi), 0.5f);
+}
+
+void vkrt_model_bounds(vkrt_model *model, HMM_Vec3 *lo, HMM_Vec3 *hi) {
+  *lo = (HMM_Vec3){ INFINITY, INFINITY, INFINITY };
+  *hi = (HMM_Vec3){ -INFINITY, -INFINITY, -INFINITY };
+  for (size_t i = 0; i < model->mesh_count; ++i) {
+    for (size_t j = 0; j < model->meshes[i].primitive_count; ++j) {
+      vkrt_primitive_bounds(model->meshes[i], model->meshes[i].primitives[j], lo, hi);
+    }
+  }
+  for (size_t i = 0; i < model->sphere_count; ++i) {
+    vkrt_sphere sp = model->spheres[i];
+    for (uint32_t a = 0; a < 3; ++a) {
+      lo->Elements[a] = fminf(lo->Elements[a], sp.centre[a] - sp.radius);
+      hi->Elements[a] = fmaxf(hi->Elements[a], sp.centre[a] + sp.radius);
+    }
+  }
+}
+
+// fills in refs[].key according to the policy, refs are then sorted by key
+// and consecutive runs with the same key share a blas
+void vkrt_scene_assign_keys(vkrt_model *model, vkrt_blas_policy policy,
+			    uint32_t ref_count, vkrt_geom_ref *refs) {
+  switch (policy) {
+  case vkrt_blas_per_primitive:
+  case vkrt_blas_spatial: {
+    for (uint32_t i = 0; i < ref_count; ++i) { refs[i].key = i; }
+  } break;
+  case vkrt_blas_per_mesh: {
+    for (uint32_t i = 0; i < ref_count; ++i) { refs[i].key = refs[i].mesh; }
+  } break;
+  case vkrt_blas_per_material: {
+    for (uint32_t i = 0; i < ref_count; ++i) {
+      refs[i].key = model->meshes[refs[i].mesh].primitives[refs[i].primitive].material_index;
+    }
+  } break;
+  case vkrt_blas_whole_scene:
+  default: {
+    for (uint32_t i = 0; i < ref_count; ++i) { refs[i].key = 0; }
+  } break;
+  }
+
+  if (policy != vkrt_blas_spatial) {
+    for (uint32_t i = 0; i < ref_count; ++i) {
+      if (refs[i].dynamic) { refs[i].key = refs[i].mesh; }
+    }
+    return;
+  }
+
+  // spatial: order primitives along a morton curve through the scene bounds
+  HMM_Vec3 *centroids = calloc(sizeof(*centroids), ref_count);
+  HMM_Vec3 lo = { INFINITY, INFINITY, INFINITY };
+  HMM_Vec3 hi = { -INFINITY, -INFINITY, -INFINITY };
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    vkrt_mesh mesh = model->meshes[refs[i].mesh];
+    centroids[i] = vkrt_primitive_centroid(mesh, mesh.primitives[refs[i].primitive]);
+    for (uint32_t a = 0; a < 3; ++a) {
+      lo.Elements[a] = fminf(lo.Elements[a], centroids[i].Elements[a]);
+      hi.Elements[a] = fmaxf(hi.Elements[a], centroids[i].Elements[a]);
+    }
+  }
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    uint32_t q[3];
+    for (uint32_t a = 0; a < 3; ++a) {
+      float extent = hi.Elements[a] - lo.Elements[a];
+      float n = extent > 0 ? (centroids[i].Elements[a] - lo.Elements[a]) / extent : 0;
+      q[a] = (uint32_t)(n * 1023.f);
+    }
+    refs[i].key = vkrt_morton_spread(q[0]) | (vkrt_morton_spread(q[1]) << 1) |
+      (vkrt_morton_spread(q[2]) << 2);
+    if (refs[i].dynamic) { refs[i].key = refs[i].mesh; }
+  }
+  free(centroids);
+}
+
+// writes the instance transforms into the object table of frame_slot, for
+// scenes using an instance generator
+void vkrt_scene_write_objects(VmaAllocator allocator, vkrt_scene *scene,
+			      uint32_t frame_slot) {
+  vkrt_object *objects = scene->objects[frame_slot].info.pMappedData;
+  for (uint32_t i = 0; i < scene->blas_count; ++i) {
+    objects[i] = (vkrt_object) {
+      .transform = scene->instance_transforms[i],
+      .blas_index = i,
+      .custom_index_mask = vkrt_object_custom_index_mask(scene->blas_first_geom[i], 0xFF),
+    };
+  }
+  VK_CHECK(vmaFlushAllocation(allocator, scene->objects[frame_slot].allocation, 0,
+			      scene->blas_count * sizeof(vkrt_object)));
+}
+
+vkrt_scene vkrt_scene_build(VkDevice device, VmaAllocator allocator, VkQueue queue,
+			    vkw_immediate_submit_buffer immediate, vkrt_model *model,
+			    vkrt_blas_policy policy, vkrt_as_profiles profiles,
+			    uint32_t host_threads, vkrt_instance_generator *instance_gen,
+			    VkDeviceSize scratch_alignment) {
+  double start = vkrt_now_ms();
+  vkrt_scene scene = {
+    .policy = policy,
+    .profiles = profiles,
+    .host_threads = host_threads,
+    .instance_gen = instance_gen,
+    .scratch_alignment = scratch_alignment,
+  };
+
+  // triangle geometries, the spheres' node (if any) comes after them
+  uint32_t ref_count = 0;
+  uint64_t total_tris = 0;
+  for (size_t i = 0; i < model->mesh_count; ++i) {
+    ref_count += model->meshes[i].primitive_count;
+    for (size_t j = 0; j < model->meshes[i].primitive_count; ++j) {
+      total_tris += model->meshes[i].primitives[j].primitive_count;
+    }
+  }
+  scene.sphere_count = model->sphere_count;
+  scene.geom_count = ref_count + (scene.sphere_count > 0);
+  assert(scene.geom_count > 0 && "Model has no geometry");
+
+  vkrt_geom_ref *refs = calloc(sizeof(*refs), scene.geom_count);
+  uint32_t idx = 0;
+  for (uint32_t i = 0; i < model->mesh_count; ++i) {
+    for (uint32_t j = 0; j < model->meshes[i].primitive_count; ++j) {
+      refs[idx] = (vkrt_geom_ref) {
+	.mesh = i,
+	.primitive = j,
+	.dynamic = model->meshes[i].dynamic,
+	.order = idx,
+      };
+      idx++;
+    }
+  }
+  vkrt_scene_assign_keys(model, policy, ref_count, refs);
+  qsort(refs, ref_count, sizeof(*refs), vkrt_geom_ref_cmp);
+
+  // spatial clusters are cut from the morton order once they hold roughly
+  // total / sqrt(n) triangles, giving about sqrt(n) blases for n primitives
+  uint64_t cluster_tris = total_tris / (uint64_t)ceil(sqrt(ref_count ? ref_count : 1));
+  if (cluster_tris == 0) { cluster_tris = 1; }
+
+  // work out where each blas starts in the sorted refs
+  scene.blas_first_geom = calloc(sizeof(uint32_t), scene.geom_count);
+  uint64_t group_tris = 0;
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    vkrt_primitive p = model->meshes[refs[i].mesh].primitives[refs[i].primitive];
+    bool split = (i == 0) || refs[i].dynamic != refs[i - 1].dynamic;
+    if (policy == vkrt_blas_spatial && !refs[i].dynamic) {
+      split |= group_tris >= cluster_tris;
+    } else {
+      split |= refs[i].key != refs[i - (i > 0)].key;
+    }
+    if (split) {
+      scene.blas_first_geom[scene.blas_count++] = i;
+      group_tris = 0;
+    }
+    group_tris += p.primitive_count;
+  }
+  uint32_t tri_blas_count = scene.blas_count;
+  if (scene.sphere_count > 0) {
+    scene.blas_first_geom[scene.blas_count++] = ref_count;
+  }
+
+  geometry_node *geom_nodes = calloc(sizeof(*geom_nodes), scene.geom_count);
+  scene.geom_datas = calloc(sizeof(vkrt_geom_data_gpu), scene.geom_count);
+  vkrt_geom_data_gpu *geom_datas = scene.geom_datas;
+  scene.geom_hit_group = calloc(sizeof(uint32_t), scene.geom_count);
+  vkrt_material *materials = model->materials_buffer.info.pMappedData;
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    vkrt_mesh mesh = model->meshes[refs[i].mesh];
+    vkrt_primitive p = mesh.primitives[refs[i].primitive];
+    geom_nodes[i] = (geometry_node) {
+      p.vertex_buffer.device_address,
+      p.index_buffer.device_address,
+      p.material_index,
+      p.first_light,
+    };
+    scene.geom_hit_group[i] =
+      (p.first_light != UINT32_MAX ? vkrt_material_emissive : 0) |
+      (p.alpha_masked ? vkrt_material_masked : 0) |
+      (materials[p.material_index].texture_index != VKRT_NO_TEXTURE ?
+       vkrt_material_textured : 0);
+    geom_datas[i] = (vkrt_geom_data_gpu) {
+      .vertex_buffer = p.vertex_buffer,
+      .index_buffer = p.index_buffer,
+      .vertex_count = p.vertex_count,
+      .vertex_stride = sizeof(vkrt_vertex_t),
+      .primitive_count = p.primitive_count,
+      .transform_buffer = mesh.transform_buffer,
+      .non_opaque = p.alpha_masked,
+    };
+  }
+
+  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  if (scene.sphere_count > 0) {
+    // 20 bytes of sphere and 24 of aabb each, rather than a tessellated mesh
+    VkAabbPositionsKHR *aabbs = calloc(sizeof(*aabbs), scene.sphere_count);
+    for (uint32_t i = 0; i < scene.sphere_count; ++i) {
+      vkrt_sphere sp = model->spheres[i];
+      aabbs[i] = (VkAabbPositionsKHR) {
+	sp.centre[0] - sp.radius, sp.centre[1] - sp.radius, sp.centre[2] - sp.radius,
+	sp.centre[0] + sp.radius, sp.centre[1] + sp.radius, sp.centre[2] + sp.radius,
+      };
+    }
+    scene.spheres =
+      vkrt_allocate_memory(device, allocator, scene.sphere_count * sizeof(vkrt_sphere),
+			   model->spheres, usage);
+    scene.sphere_aabbs =
+      vkrt_allocate_memory(device, allocator, scene.sphere_count * sizeof(*aabbs), aabbs,
+			   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+			   VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
+    free(aabbs);
+    geom_nodes[ref_count] = (geometry_node) {
+      .vertex_buffer_address = scene.spheres.device_address,
+      .material_index = model->spheres[0].material_index,
+      .first_light = UINT32_MAX, // spheres aren't in the light table
+    };
+    scene.geom_hit_group[ref_count] = vkrt_hit_group_spheres;
+  }
+  scene.geometry_nodes =
+    vkrt_allocate_memory(device, allocator, scene.geom_count * sizeof(*geom_nodes),
+			 geom_nodes, usage);
+
+  scene.blases = calloc(sizeof(vkrt_as), scene.blas_count);
+  scene.blas_mesh = calloc(sizeof(uint32_t), scene.blas_count);
+  VkBuildAccelerationStructureFlagsKHR *blas_flags =
+    calloc(sizeof(*blas_flags), scene.blas_count);
+  for (uint32_t i = 0; i < tri_blas_count; ++i) {
+    uint32_t first = scene.blas_first_geom[i];
+    scene.blas_mesh[i] = refs[first].dynamic ? refs[first].mesh : UINT32_MAX;
+    // dynamic blases are refit (or rebuilt) in place so can't be compacted
+    blas_flags[i] = refs[first].dynamic ?
+      profiles.dynamic_blas & ~VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR :
+      profiles.static_blas;
+  }
+  if (host_threads > 0) {
+    vkrt_host_build_blases(device, allocator, host_threads, tri_blas_count,
+			   scene.blas_first_geom, ref_count, geom_datas,
+			   blas_flags, scene.blases);
+  } else {
+    for (uint32_t i = 0; i < tri_blas_count; ++i) {
+      uint32_t first = scene.blas_first_geom[i];
+      uint32_t end = (i + 1 < tri_blas_count) ? scene.blas_first_geom[i + 1] : ref_count;
+      scene.blases[i] = vkrt_create_blas2(device, allocator, queue, immediate,
+					  end - first, &geom_datas[first], blas_flags[i]);
+    }
+  }
+  if (scene.sphere_count > 0) {
+    // one small build, always on the device. the spheres never move, so
+    // whatever the static profile is their blas is built for tracing, only
+    // taking compaction from the profile
+    uint32_t i = tri_blas_count;
+    scene.blas_mesh[i] = UINT32_MAX;
+    scene.blases[i] = vkrt_create_aabb_blas(device, allocator, queue, immediate,
+					    scene.sphere_aabbs, scene.sphere_count,
+					    VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+					    (profiles.static_blas &
+					     VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR));
+  }
+  for (uint32_t i = 0; i < scene.blas_count; ++i) {
+    scene.blas_bytes += scene.blases[i].size;
+  }
+  free(blas_flags);
+
+  scene.blas_scratch_offsets = calloc(sizeof(VkDeviceSize), scene.blas_count);
+  VkDeviceSize blas_scratch_size = 0;
+  for (uint32_t i = 0; i < scene.blas_count; ++i) {
+    if (scene.blas_mesh[i] == UINT32_MAX) { continue; }
+    scene.blas_scratch_offsets[i] = blas_scratch_size;
+    blas_scratch_size += (scene.blases[i].scratch_size + scratch_alignment - 1) &
+      ~(scratch_alignment - 1);
+  }
+  if (blas_scratch_size > 0) {
+    scene.blas_scratch =
+      vkrt_allocate_memory(device, allocator, blas_scratch_size, NULL,
+			   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  }
+
+  VkTransformMatrixKHR transform = {
+    .matrix = {
+      1, 0, 0, 0,
+      0, 1, 0, 0,
+      0, 0, 1, 0,
+    },
+  };
+  scene.instance_transforms = calloc(sizeof(VkTransformMatrixKHR), scene.blas_count);
+  for (uint32_t i = 0; i < scene.blas_count; ++i) {
+    scene.instance_transforms[i] = transform;
+  }
+  for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
+    scene.instance_buffers[i] =
+      vkrt_allocate_tlas_instances(device, allocator, scene.blas_count);
+  }
+
+  // the tlas gets rebuilt in place, so it has to keep its full size
+  profiles.tlas &= ~VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+  if (instance_gen) {
+    for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
+      scene.objects[i] = vkrt_allocate_objects(device, allocator, scene.blas_count);
+    }
+    scene.blas_addresses = vkrt_allocate_blas_addresses(device, allocator,
+							scene.blas_count, scene.blases);
+    vkrt_scene_write_objects(allocator, &scene, 0);
+
+    // the instances are generated and consumed in the same command buffer
+    scene.tlas = vkrt_allocate_tlas(device, allocator, scene.blas_count, profiles.tlas);
+    scene.tlas_scratch =
+      vkrt_allocate_memory(device, allocator, scene.tlas.scratch_size, NULL,
+			   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+    VkCommandBuffer cmd = vkw_immediate_begin(device, immediate);
+    vkrt_instance_generator_record(cmd, instance_gen, scene.objects[0].device_address,
+				   scene.blas_addresses.device_address,
+				   scene.instance_buffers[0].device_address,
+				   scene.blas_count,
+				   VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+    vkrt_record_tlas_build(cmd, &scene.tlas, scene.blas_count,
+			   scene.instance_buffers[0].device_address,
+			   scene.tlas_scratch.device_address, false);
+    vkw_immediate_end(device, immediate, queue);
+  } else {
+    vkrt_write_tlas_instances(allocator, scene.instance_buffers[0], scene.blas_count,
+			      scene.blases, scene.instance_transforms,
+			      scene.blas_first_geom, scene.blas_first_geom);
+    scene.tlas = vkrt_create_tlas2(device, allocator, queue, immediate, scene.blas_count,
+				   scene.instance_buffers[0], profiles.tlas);
+    scene.tlas_scratch =
+      vkrt_allocate_memory(device, allocator,
+			   vkrt_tlas_scratch_size(device, scene.blas_count, profiles.tlas),
+			   NULL, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+			   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  }
+  scene.tlas_bytes = scene.tlas.size;
+
+  free(geom_nodes);
+  free(refs);
+
+  scene.build_ms = vkrt_now_ms() - start;
+  return scene;
+}
+
+void vkrt_scene_write_descriptors(VkDevice device, VkDescriptorSet set,
+				  vkrt_scene *scene, uint32_t as_binding,
+				  uint32_t nodes_binding) {
+  uint32_t count = (as_binding > nodes_binding ? as_binding : nodes_binding) + 1;
+  vkrt_ds_writer writer = vkrt_ds_writer_create(count, set);
+  vkrt_ds_writer_add_as(&writer, as_binding, &scene->tlas.as);
+  vkrt_ds_writer_add_buffer(&writer, nodes_binding, scene->geometry_nodes.buffer,
+			    0, VK_WHOLE_SIZE);
+  vkrt_ds_writer_write(device, writer);
+  vkrt_ds_writer_free(&writer);
+}
+
+VkTransformMatrixKHR vkrt_transform_from_m4(HMM_Mat4 m) {
+  VkTransformMatrixKHR t;
+  for (uint32_t r = 0; r < 3; ++r) {
+    for (uint32_t c = 0; c < 4; ++c) {
+      t.matrix[r][c] = m.Elements[c][r];
+    }
+  }
+  return t;
+}
+
+// moves the instances of dynamic blases to where the animator has put their
+// nodes, returns false if the scene has nothing to animate
+bool vkrt_scene_animate(vkrt_scene *scene, vkrt_model *model, vkrt_animator *anim) {
+  bool moved = false;
+  for (uint32_t i = 0; i < scene->blas_count; ++i) {
+    if (scene->blas_mesh[i] == UINT32_MAX) { continue; }
+    vkrt_mesh mesh = model->meshes[scene->blas_mesh[i]];
+    // skinned meshes are placed by their joints (see vk_rt_skin.h)
+    if (mesh.node_index == UINT32_MAX || mesh.skinned) { continue; }
+    // the rest transform is already in the blas, so only apply the change
+    HMM_Mat4 delta = HMM_MulM4(anim->world[mesh.node_index],
+			       HMM_InvGeneralM4(mesh.rest_world));
+    scene->instance_transforms[i] = vkrt_transform_from_m4(delta);
+    moved = true;
+  }
+  return moved;
+}
+
+// writes the instance transforms into this frame's instance buffer (or object
+// table, which is expanded on the gpu) and records a refit of the tlas into
+// cmd, every rebuild_interval updates (or every time, if the tlas doesn't
+// allow updates) it is rebuilt instead since refits make the tlas slower to
+// trace as things move further from where they were built
+// returns true if it recorded a rebuild
+bool vkrt_scene_record_tlas_update(VmaAllocator allocator, VkCommandBuffer cmd,
+				   vkrt_scene *scene, uint32_t frame_slot,
+				   uint32_t rebuild_interval) {
+  vkrt_memory instances = scene->instance_buffers[frame_slot];
+  if (scene->instance_gen) {
+    vkrt_scene_write_objects(allocator, scene, frame_slot);
+  } else {
+    vkrt_write_tlas_instances(allocator, instances, scene->blas_count, scene->blases,
+			      scene->instance_transforms, scene->blas_first_geom,
+			      scene->blas_first_geom);
+  }
+
+  bool can_update = scene->tlas.flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+  bool rebuild = !can_update || ++scene->updates_since_rebuild >= rebuild_interval;
+  if (rebuild) { scene->updates_since_rebuild = 0; }
+
+  // the previous frame may still be tracing against the tlas, or building it
+  // with the same scratch buffer
+  vkh_memory_barrier(cmd, vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+  if (scene->instance_gen) {
+    vkrt_instance_generator_record(cmd, scene->instance_gen,
+				   scene->objects[frame_slot].device_address,
+				   scene->blas_addresses.device_address,
+				   instances.device_address, scene->blas_count,
+				   VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+  }
+  vkrt_record_tlas_build(cmd, &scene->tlas, scene->blas_count, instances.device_address,
+			 scene->tlas_scratch.device_address, !rebuild);
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		     vkrt_trace_stage,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+  return rebuild;
+}
+
+// records refits of the blases of meshes whose vertices were rewritten this
+// frame (mesh_deformed is indexed by model mesh), returns how many were refit
+uint32_t vkrt_scene_record_blas_refits(VkCommandBuffer cmd, vkrt_scene *scene,
+				       bool *mesh_deformed) {
+  uint32_t refits = 0;
+  for (uint32_t i = 0; i < scene->blas_count; ++i) {
+    if (scene->blas_mesh[i] == UINT32_MAX || !mesh_deformed[scene->blas_mesh[i]]) {
+      continue;
+    }
+    if (refits++ == 0) {
+      // the previous frame may still be tracing against the blases
+      vkh_memory_barrier(cmd, vkrt_trace_stage |
+			 VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			 VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+			 VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+			 VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+			 VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+			 VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+    }
+    uint32_t first = scene->blas_first_geom[i];
+    uint32_t end = (i + 1 < scene->blas_count) ?
+      scene->blas_first_geom[i + 1] : scene->geom_count;
+    bool can_update = scene->blases[i].flags &
+      VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR;
+    vkrt_record_blas_build(cmd, &scene->blases[i], end - first,
+			   &scene->geom_datas[first],
+			   scene->blas_scratch.device_address +
+			   scene->blas_scratch_offsets[i], can_update);
+  }
+  if (refits > 0) {
+    // the tlas build reads the new blas bounds
+    vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		       VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		       VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+		       vkrt_trace_stage,
+		       VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+  }
+  return refits;
+}
+
+// a tlas over copies of the whole scene, used to measure how tlas builds and
+// traversal scale with the instance count: instance i is blas
+// i % blas_count of copy i / blas_count
+typedef struct {
+  uint32_t count;
+  vkrt_memory objects; // only with an instance generator
+  vkrt_memory instances;
+  vkrt_memory scratch;
+  vkrt_as tlas;
+} vkrt_instanced_tlas;
+
+vkrt_instanced_tlas vkrt_instanced_tlas_create(VkDevice device, VmaAllocator allocator,
+					       vkrt_scene *scene, uint32_t count,
+					       VkTransformMatrixKHR *copy_transforms) {
+  vkrt_instanced_tlas t = { .count = count };
+  t.instances = vkrt_allocate_tlas_instances(device, allocator, count);
+  if (scene->instance_gen) {
+    t.objects = vkrt_allocate_objects(device, allocator, count);
+    vkrt_object *objects = t.objects.info.pMappedData;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t blas = i % scene->blas_count;
+      objects[i] = (vkrt_object) {
+	.transform = copy_transforms[i / scene->blas_count],
+	.blas_index = blas,
+	.custom_index_mask =
+	vkrt_object_custom_index_mask(scene->blas_first_geom[blas], 0xFF),
+      };
+    }
+    VK_CHECK(vmaFlushAllocation(allocator, t.objects.allocation, 0, VK_WHOLE_SIZE));
+  } else {
+    VkAccelerationStructureInstanceKHR *instances = t.instances.info.pMappedData;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t blas = i % scene->blas_count;
+      instances[i] = (VkAccelerationStructureInstanceKHR) {
+	.transform = copy_transforms[i / scene->blas_count],
+	.instanceCustomIndex = scene->blas_first_geom[blas],
+	.mask = 0xFF,
+	.instanceShaderBindingTableRecordOffset = scene->blas_first_geom[blas],
+	.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
+	.accelerationStructureReference = scene->blases[blas].handle,
+      };
+    }
+    VK_CHECK(vmaFlushAllocation(allocator, t.instances.allocation, 0, VK_WHOLE_SIZE));
+  }
+  t.tlas = vkrt_allocate_tlas(device, allocator, count, scene->profiles.tlas &
+			      ~VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR);
+  t.scratch = vkrt_allocate_memory(device, allocator, t.tlas.scratch_size, NULL,
+				   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+				   | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  return t;
+}
+
+// records a build (or refit) of the instanced tlas, generating its instances
+// first if the scene has a generator
+void vkrt_instanced_tlas_record_build(VkCommandBuffer cmd, vkrt_scene *scene,
+				      vkrt_instanced_tlas *t, bool update) {
+  // earlier builds may still be reading the instances and scratch
+  vkh_memory_barrier(cmd, vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_SHADER_WRITE_BIT |
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR);
+  if (scene->instance_gen) {
+    vkrt_instance_generator_record(cmd, scene->instance_gen, t->objects.device_address,
+				   scene->blas_addresses.device_address,
+				   t->instances.device_address, t->count,
+				   VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+  }
+  vkrt_record_tlas_build(cmd, &t->tlas, t->count, t->instances.device_address,
+			 t->scratch.device_address, update);
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+		     vkrt_trace_stage,
+		     VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR);
+}
+
+void vkrt_instanced_tlas_destroy(VkDevice device, VmaAllocator allocator,
+				 vkrt_instanced_tlas *t) {
+  vkrt_destroy_as(device, allocator, t->tlas);
+  vkrt_memory_free(allocator, t->scratch);
+  vkrt_memory_free(allocator, t->instances);
+  if (t->objects.buffer) {
+    vkrt_memory_free(allocator, t->objects);
+  }
+  *t = (vkrt_instanced_tlas){};
+}
+
+void vkrt_scene_destroy(VkDevice device, VmaAllocator allocator, vkrt_scene *scene) {
+  vkrt_destroy_as(device, allocator, scene->tlas);
+  for (uint32_t i = 0; i < scene->blas_count; ++i) {
+    vkrt_destroy_as(device, allocator, scene->blases[i]);
+  }
+  for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
+    vkrt_memory_free(allocator, scene->instance_buffers[i]);
+  }
+  vkrt_memory_free(allocator, scene->tlas_scratch);
+  if (scene->instance_gen) {
+    for (uint32_t i = 0; i < FRAME_OVERLAP; ++i) {
+      vkrt_memory_free(allocator, scene->objects[i]);
+    }
+    vkrt_memory_free(allocator, scene->blas_addresses);
+  }
+  if (scene->blas_scratch.buffer) {
+    vkrt_memory_free(allocator, scene->blas_scratch);
+  }
+  free(scene->blas_scratch_offsets);
+  free(scene->geom_datas);
+  vkrt_memory_free(allocator, scene->geometry_nodes);
+  if (scene->sphere_count > 0) {
+    vkrt_memory_free(allocator, scene->spheres);
+    vkrt_memory_free(allocator, scene->sphere_aabbs);
+  }
+  free(scene->blases);
+  free(scene->blas_first_geom);
+  free(scene->blas_mesh);
+  free(scene->geom_hit_group);
+  free(scene->instance_transforms);
+  *scene = (vkrt_scene){};
+}
+
+// waits for the device to go idle, so only use this outside of a frame. the
+// scratch alignment is kept from the old scene
+void vkrt_scene_rebuild(VkDevice device, VmaAllocator allocator, VkQueue queue,
+			vkw_immediate_submit_buffer immediate, vkrt_model *model,
+			vkrt_scene *scene, vkrt_blas_policy policy,
+			vkrt_as_profiles profiles, uint32_t host_threads,
+			vkrt_instance_generator *instance_gen) {
+  vkDeviceWaitIdle(device);
+  VkDeviceSize scratch_alignment = scene->scratch_alignment;
+  vkrt_scene_destroy(device, allocator, scene);
+  *scene = vkrt_scene_build(device, allocator, queue, immediate, model, policy,
+			    profiles, host_threads, instance_gen, scratch_alignment);
+}
+#endif // VK_RT_SCENE_H_
@@ -0,0 +1,283 @@
+#ifndef VK_RT_SKIN_H_
+#define VK_RT_SKIN_H_
+// skinning and morph targets for animated gltf meshes: a compute pass rewrites
+// the vertex buffers of deformed primitives from an untouched rest copy each
+// frame, then the blases using them are refit (vkrt_scene_record_blas_refits)
+
+// matches the push constants in shaders/deform.comp
+typedef struct {
+  VkDeviceAddress src_vertices;
+  VkDeviceAddress dst_vertices;
+  VkDeviceAddress skin;    // 0 if the primitive isn't skinned
+  VkDeviceAddress joints;
+  VkDeviceAddress morphs;  // 0 if the primitive has no morph targets
+  VkDeviceAddress weights;
+  uint32_t vertex_count;
+  uint32_t target_count;
+} vkrt_deform_push_constants;
+
+// per vertex skinning data, matches skin_t in shaders/deform.comp
+typedef struct {
+  uint32_t joints[4];
+  float weights[4];
+} vkrt_skin_vertex;
+
+// per vertex per target morph offsets, matches morph_t in shaders/deform.comp
+typedef struct {
+  HMM_Vec3 pos;
+  HMM_Vec3 norm;
+} vkrt_morph_vertex;
+
+typedef struct {
+  uint32_t mesh; // index into model meshes
+  uint32_t node;
+  cgltf_skin *skin;
+  uint32_t joint_count;
+  uint32_t target_count;
+  // written on the host for the frame being recorded
+  vkrt_memory joints[FRAME_OVERLAP];
+  vkrt_memory weights[FRAME_OVERLAP];
+} vkrt_deform_mesh;
+
+typedef struct {
+  uint32_t deform_mesh; // index into vkrt_deformer.meshes
+  uint32_t primitive;
+  uint32_t vertex_count;
+  vkrt_memory rest_vertices;
+  vkrt_memory skin;
+  vkrt_memory morphs;
+} vkrt_deform_primitive;
+
+typedef struct {
+  vkw_compute_pipeline pipeline;
+  VkDescriptorSetLayout layout; // empty, everything goes through addresses
+
+  uint32_t mesh_count;
+  vkrt_deform_mesh *meshes;
+  uint32_t primitive_count;
+  vkrt_deform_primitive *primitives;
+
+  bool *mesh_deformed; // indexed by model mesh, for vkrt_scene_record_blas_refits
+} vkrt_deformer;
+
+vkrt_deform_primitive
+vkrt_deform_primitive_create(VkDevice device, VmaAllocator allocator,
+			     vkrt_primitive p, cgltf_primitive *prim) {
+  vkrt_deform_primitive res = { .vertex_count = p.vertex_count };
+  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+  // the vertex buffer gets overwritten every frame, so keep the rest pose
+  res.rest_vertices =
+    vkrt_allocate_memory(device, allocator, p.vertex_count * sizeof(vkrt_vertex_t),
+			 p.vertex_buffer.info.pMappedData, usage);
+
+  cgltf_accessor *joints = NULL, *weights = NULL;
+  for (size_t i = 0; i < prim->attributes_count; ++i) {
+    cgltf_attribute attr = prim->attributes[i];
+    if (attr.index != 0) { continue; }
+    if (attr.type == cgltf_attribute_type_joints) { joints = attr.data; }
+    if (attr.type == cgltf_attribute_type_weights) { weights = attr.data; }
+  }
+  if (joints && weights) {
+    vkrt_skin_vertex *skin = calloc(sizeof(*skin), p.vertex_count);
+    for (uint32_t v = 0; v < p.vertex_count; ++v) {
+      cgltf_accessor_read_uint(joints, v, skin[v].joints, 4);
+      cgltf_accessor_read_float(weights, v, skin[v].weights, 4);
+    }
+    res.skin = vkrt_allocate_memory(device, allocator, p.vertex_count * sizeof(*skin),
+				    skin, usage);
+    free(skin);
+  }
+
+  if (prim->targets_count > 0) {
+    vkrt_morph_vertex *morphs = calloc(sizeof(*morphs),
+				       prim->targets_count * p.vertex_count);
+    for (size_t t = 0; t < prim->targets_count; ++t) {
+      cgltf_morph_target target = prim->targets[t];
+      vkrt_morph_vertex *dst = &morphs[t * p.vertex_count];
+      for (size_t i = 0; i < target.attributes_count; ++i) {
+	cgltf_attribute attr = target.attributes[i];
+	HMM_Vec3 *field = NULL;
+	for (uint32_t v = 0; v < p.vertex_count; ++v) {
+	  if (attr.type == cgltf_attribute_type_position) {
+	    field = &dst[v].pos;
+	  } else if (attr.type == cgltf_attribute_type_normal) {
+	    field = &dst[v].norm;
+	  } else {
+	    break;
+	  }
+	  cgltf_accessor_read_float(attr.data, v, field->Elements, 3);
+	}
+      }
+    }
+    res.morphs =
+      vkrt_allocate_memory(device, allocator,
+			   prim->targets_count * p.vertex_count * sizeof(*morphs),
+			   morphs, usage);
+    free(morphs);
+  }
+  return res;
+}
+
+vkrt_deformer vkrt_deformer_create(VkDevice device, VmaAllocator allocator,
+				   vkrt_model *model) {
+  cgltf_data *data = model->gltf;
+  vkrt_deformer d = {
+    .meshes = calloc(sizeof(vkrt_deform_mesh), model->mesh_count),
+    .mesh_deformed = calloc(sizeof(bool), model->mesh_count),
+  };
+  VkBufferUsageFlagBits usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+  for (uint32_t i = 0; i < model->mesh_count; ++i) {
+    vkrt_mesh mesh = model->meshes[i];
+    cgltf_mesh *gmesh = &data->meshes[i];
+    uint32_t targets = gmesh->primitives_count ? gmesh->primitives[0].targets_count : 0;
+    if (!mesh.skinned && targets == 0) { continue; }
+
+    vkrt_deform_mesh dm = {
+      .mesh = i,
+      .node = mesh.node_index,
+      .skin = mesh.skinned ? data->nodes[mesh.node_index].skin : NULL,
+      .target_count = targets,
+    };
+    dm.joint_count = dm.skin ? dm.skin->joints_count : 0;
+    for (uint32_t f = 0; f < FRAME_OVERLAP; ++f) {
+      // +1 so meshes without joints or targets still get a valid buffer
+      dm.joints[f] = vkrt_allocate_memory(device, allocator,
+					  (dm.joint_count + 1) * sizeof(HMM_Mat4),
+					  NULL, usage);
+      dm.weights[f] = vkrt_allocate_memory(device, allocator,
+					   (dm.target_count + 1) * sizeof(float),
+					   NULL, usage);
+    }
+    d.meshes[d.mesh_count++] = dm;
+    d.primitive_count += mesh.primitive_count;
+  }
+
+  d.primitives = calloc(sizeof(vkrt_deform_primitive), d.primitive_count + 1);
+  uint32_t idx = 0;
+  for (uint32_t i = 0; i < d.mesh_count; ++i) {
+    vkrt_mesh mesh = model->meshes[d.meshes[i].mesh];
+    for (uint32_t j = 0; j < mesh.primitive_count; ++j) {
+      d.primitives[idx] =
+	vkrt_deform_primitive_create(device, allocator, mesh.primitives[j],
+				     &data->meshes[d.meshes[i].mesh].primitives[j]);
+      d.primitives[idx].deform_mesh = i;
+      d.primitives[idx].primitive = j;
+      idx++;
+    }
+  }
+
+  if (d.mesh_count == 0) { return d; }
+
+  vkw_descriptor_layout_builder b = {};
+  d.layout = vkw_descriptor_layout_build(&b, device, VK_SHADER_STAGE_COMPUTE_BIT);
+  VkShaderModule shader;
+  if (!vkh_load_shader_module("./shaders/deform.spv", device, &shader)) {
+    fprintf(stderr, "Failed to load the deform shader - please check it exists\n");
+    exit(1);
+  }
+  d.pipeline = vkw_compute_pipeline_create(device, d.layout, shader,
+					   sizeof(vkrt_deform_push_constants));
+  vkDestroyShaderModule(device, shader, NULL);
+
+  printf("%u animated meshes are skinned or morphed on the gpu\n", d.mesh_count);
+  return d;
+}
+
+// writes this frame's joint matrices and morph weights from the animator
+void vkrt_deformer_update(VmaAllocator allocator, vkrt_deformer *d, vkrt_model *model,
+			  vkrt_animator *anim, uint32_t frame_slot) {
+  for (uint32_t i = 0; i < d->mesh_count; ++i) {
+    vkrt_deform_mesh *dm = &d->meshes[i];
+    if (dm->skin) {
+      // skinned vertices end up in the mesh's rest space, since the rest
+      // transform is applied again by the blas
+      HMM_Mat4 to_rest = HMM_InvGeneralM4(model->meshes[dm->mesh].rest_world);
+      HMM_Mat4 *joints = dm->joints[frame_slot].info.pMappedData;
+      for (uint32_t j = 0; j < dm->joint_count; ++j) {
+	HMM_Mat4 inverse_bind = HMM_M4D(1);
+	if (dm->skin->inverse_bind_matrices) {
+	  cgltf_accessor_read_float(dm->skin->inverse_bind_matrices, j,
+				    (float *)inverse_bind.Elements, 16);
+	}
+	size_t joint_node = cgltf_node_index(model->gltf, dm->skin->joints[j]);
+	joints[j] = HMM_MulM4(to_rest, HMM_MulM4(anim->world[joint_node], inverse_bind));
+      }
+      VK_CHECK(vmaFlushAllocation(allocator, dm->joints[frame_slot].allocation, 0,
+				  VK_WHOLE_SIZE));
+    }
+    if (dm->target_count > 0 && dm->node != UINT32_MAX) {
+      memcpy(dm->weights[frame_slot].info.pMappedData,
+	     &anim->weights[dm->node * anim->max_targets],
+	     dm->target_count * sizeof(float));
+      VK_CHECK(vmaFlushAllocation(allocator, dm->weights[frame_slot].allocation, 0,
+				  VK_WHOLE_SIZE));
+    }
+    d->mesh_deformed[dm->mesh] = true;
+  }
+}
+
+// records the deform dispatches with barriers against the previous frame's
+// reads of the vertex buffers and for the blas refits that follow
+void vkrt_deformer_record(VkCommandBuffer cmd, vkrt_deformer *d, vkrt_model *model,
+			  uint32_t frame_slot) {
+  if (d->primitive_count == 0) { return; }
+
+  vkh_memory_barrier(cmd, vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+		     VK_ACCESS_2_SHADER_READ_BIT,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_WRITE_BIT);
+
+  vkw_compute_pipeline_bind(cmd, d->pipeline, VK_NULL_HANDLE);
+  for (uint32_t i = 0; i < d->primitive_count; ++i) {
+    vkrt_deform_primitive *dp = &d->primitives[i];
+    vkrt_deform_mesh *dm = &d->meshes[dp->deform_mesh];
+    vkrt_primitive p = model->meshes[dm->mesh].primitives[dp->primitive];
+    vkrt_deform_push_constants pcs = {
+      .src_vertices = dp->rest_vertices.device_address,
+      .dst_vertices = p.vertex_buffer.device_address,
+      .skin = dp->skin.buffer ? dp->skin.device_address : 0,
+      .joints = dm->joints[frame_slot].device_address,
+      .morphs = dp->morphs.buffer ? dp->morphs.device_address : 0,
+      .weights = dm->weights[frame_slot].device_address,
+      .vertex_count = dp->vertex_count,
+      .target_count = dp->morphs.buffer ? dm->target_count : 0,
+    };
+    vkw_compute_pipeline_push_constants(cmd, d->pipeline, &pcs);
+    vkCmdDispatch(cmd, (dp->vertex_count + 63) / 64, 1, 1);
+  }
+
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+		     vkrt_trace_stage,
+		     VK_ACCESS_2_SHADER_READ_BIT);
+}
+
+void vkrt_deformer_destroy(VkDevice device, VmaAllocator allocator, vkrt_deformer *d) {
+  for (uint32_t i = 0; i < d->primitive_count; ++i) {
+    vkrt_deform_primitive dp = d->primitives[i];
+    vkrt_memory_free(allocator, dp.rest_vertices);
+    if (dp.skin.buffer) { vkrt_memory_free(allocator, dp.skin); }
+    if (dp.morphs.buffer) { vkrt_memory_free(allocator, dp.morphs); }
+  }
+  for (uint32_t i = 0; i < d->mesh_count; ++i) {
+    for (uint32_t f = 0; f < FRAME_OVERLAP; ++f) {
+      vkrt_memory_free(allocator, d->meshes[i].joints[f]);
+      vkrt_memory_free(allocator, d->meshes[i].weights[f]);
+    }
+  }
+  if (d->mesh_count > 0) {
+    vkw_compute_pipeline_destroy(device, d->pipeline);
+    vkDestroyDescriptorSetLayout(device, d->layout, NULL);
+  }
+  free(d->primitives);
+  free(d->meshes);
+  free(d->mesh_deformed);
+  *d = (vkrt_deformer){};
+}
+#endif // VK_RT_SKIN_H_
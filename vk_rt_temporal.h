@@ -0,0 +1,104 @@
+#ifndef VK_RT_TEMPORAL_H_
+#define VK_RT_TEMPORAL_H_
+// temporal reprojection, so moving the camera doesn't throw the accumulated
+// image away. when it moves, the image and its normal/depth are copied aside
+// and the next launch fetches every pixel's history from where the previous
+// camera saw that surface, dropping it where the depth or normal disagree
+
+// one frame slot of the camera buffer (trace set binding 10), matches
+// camera_t in shaders/ray_gen.rgen
+typedef struct {
+  float view_proj[16]; // world to clip space
+  float prev_view_proj[16]; // the same for the camera the history was seen from
+  float prev_pos[4];
+} vkrt_history_camera;
+
+typedef struct {
+  vkw_image colour; // rgb, a the frames each pixel has accumulated
+  vkw_image normal_depth;
+  vkrt_memory cameras; // a vkrt_history_camera per frame slot
+  uint32_t slots;
+} vkrt_history;
+
+vkrt_history vkrt_history_create(VkDevice device, VmaAllocator allocator,
+				 vkw_immediate_submit_buffer immediate, VkQueue queue,
+				 VkExtent2D extent, uint32_t slots) {
+  vkrt_history h = { .slots = slots };
+  VkExtent3D dims = { extent.width, extent.height, 1 };
+  VkImageUsageFlags usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  h.colour = vkw_image_create(device, allocator, dims, VK_FORMAT_R32G32B32A32_SFLOAT,
+			      usage, false);
+  h.normal_depth = vkw_image_create(device, allocator, dims,
+				    VK_FORMAT_R32G32B32A32_SFLOAT, usage, false);
+  VkCommandBuffer cmd = vkw_immediate_begin(device, immediate);
+  vkh_transition_image(cmd, h.colour.image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkh_transition_image(cmd, h.normal_depth.image, VK_IMAGE_LAYOUT_UNDEFINED,
+		       VK_IMAGE_LAYOUT_GENERAL);
+  vkw_immediate_end(device, immediate, queue);
+
+  vkrt_history_camera *cameras = calloc(sizeof(vkrt_history_camera), slots);
+  h.cameras = vkrt_allocate_memory(device, allocator, slots * sizeof(vkrt_history_camera),
+				   cameras, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+				   VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+  free(cameras);
+  return h;
+}
+
+// world to clip space for the camera of update_camera in main.c, which
+// hands the shaders camera to world (view) and the inverse projection
+HMM_Mat4 vkrt_history_view_proj(const float view[16], const float inv_proj[16]) {
+  HMM_Mat4 v, ip;
+  memcpy(&v, view, sizeof(v));
+  memcpy(&ip, inv_proj, sizeof(ip));
+  return HMM_InvGeneralM4(HMM_MulM4(v, ip));
+}
+
+// writes the cameras a frame slot's launches reproject between
+void vkrt_history_set_camera(VmaAllocator allocator, vkrt_history *h, uint32_t slot,
+			     const float view[16], const float inv_proj[16],
+			     const float prev_view[16], const float prev_inv_proj[16]) {
+  vkrt_history_camera *c = (vkrt_history_camera *)h->cameras.info.pMappedData + slot;
+  HMM_Mat4 vp = vkrt_history_view_proj(view, inv_proj);
+  HMM_Mat4 prev_vp = vkrt_history_view_proj(prev_view, prev_inv_proj);
+  memcpy(c->view_proj, &vp, sizeof(c->view_proj));
+  memcpy(c->prev_view_proj, &prev_vp, sizeof(c->prev_view_proj));
+  // the translation column
+  memcpy(c->prev_pos, &prev_view[12], 3 * sizeof(float));
+  c->prev_pos[3] = 1;
+  VK_CHECK(vmaFlushAllocation(allocator, h->cameras.allocation,
+			      slot * sizeof(vkrt_history_camera),
+			      sizeof(vkrt_history_camera)));
+}
+
+// copies the accumulated image and its normal/depth aside, barriers included,
+// before a launch that reprojects from them
+void vkrt_history_record_save(VkCommandBuffer cmd, vkrt_history *h, VkImage colour,
+			      VkImage normal_depth, VkExtent2D extent) {
+  vkh_memory_barrier(cmd, vkrt_trace_stage,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		     VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT);
+  VkImageCopy region = {
+    .srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+    .dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 },
+    .extent = { extent.width, extent.height, 1 },
+  };
+  vkCmdCopyImage(cmd, colour, VK_IMAGE_LAYOUT_GENERAL, h->colour.image,
+		 VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+  vkCmdCopyImage(cmd, normal_depth, VK_IMAGE_LAYOUT_GENERAL, h->normal_depth.image,
+		 VK_IMAGE_LAYOUT_GENERAL, 1, &region);
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		     VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		     vkrt_trace_stage,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+}
+
+void vkrt_history_destroy(VkDevice device, VmaAllocator allocator, vkrt_history *h) {
+  vkw_image_destroy(device, allocator, h->colour);
+  vkw_image_destroy(device, allocator, h->normal_depth);
+  vkrt_memory_free(allocator, h->cameras);
+  *h = (vkrt_history){};
+}
+#endif // VK_RT_TEMPORAL_H_
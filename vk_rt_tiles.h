@@ -0,0 +1,99 @@
+#ifndef VK_RT_TILES_H_
+#define VK_RT_TILES_H_
+// splits the image into tiles that are traced a few per frame, so expensive
+// settings (lots of samples per pixel) don't stall the ui or trip the gpu
+// watchdog. every tile is traced once per pass, in an order picked at the
+// start of the pass
+
+typedef enum {
+  vkrt_tile_order_scanline,
+  vkrt_tile_order_center_out,
+  vkrt_tile_order_mouse, // outwards from the cursor
+  vkrt_tile_order_count,
+} vkrt_tile_order;
+
+const char *vkrt_tile_order_names[vkrt_tile_order_count] = {
+  "scanline", "center", "mouse",
+};
+
+// a tile and what it's ordered by, sorted together so the comparison needs
+// nothing but the two pairs
+typedef struct {
+  float key;
+  uint32_t index;
+} vkrt_tile_key;
+
+typedef struct {
+  VkExtent2D extent;
+  uint32_t tile_size;
+  uint32_t cols, rows;
+  uint32_t count;
+  uint32_t *order; // tile indices in the order they're traced this pass
+  vkrt_tile_key *keys; // only used while ordering
+  uint32_t next; // position in order, count once the pass is done
+} vkrt_tiler;
+
+vkrt_tiler vkrt_tiler_create(VkExtent2D extent, uint32_t tile_size) {
+  vkrt_tiler t = { .extent = extent, .tile_size = tile_size };
+  t.cols = (extent.width + tile_size - 1) / tile_size;
+  t.rows = (extent.height + tile_size - 1) / tile_size;
+  t.count = t.cols * t.rows;
+  t.order = calloc(sizeof(uint32_t), t.count);
+  t.keys = calloc(sizeof(vkrt_tile_key), t.count);
+  for (uint32_t i = 0; i < t.count; ++i) { t.order[i] = i; }
+  return t;
+}
+
+// equal keys keep the scanline order, qsort isn't stable
+int vkrt_tile_cmp(const void *a, const void *b) {
+  const vkrt_tile_key *ka = a, *kb = b;
+  if (ka->key != kb->key) { return ka->key < kb->key ? -1 : 1; }
+  return (int)ka->index - (int)kb->index;
+}
+
+// starts a new pass, the focus (in pixels) is only used by the mouse order
+void vkrt_tiler_begin_pass(vkrt_tiler *t, vkrt_tile_order order, float focus_x,
+			   float focus_y) {
+  if (order == vkrt_tile_order_center_out) {
+    focus_x = t->extent.width * 0.5f;
+    focus_y = t->extent.height * 0.5f;
+  }
+  for (uint32_t i = 0; i < t->count; ++i) {
+    float dx = ((i % t->cols) + 0.5f) * t->tile_size - focus_x;
+    float dy = ((i / t->cols) + 0.5f) * t->tile_size - focus_y;
+    t->keys[i] = (vkrt_tile_key) {
+      .key = order == vkrt_tile_order_scanline ? (float)i : dx * dx + dy * dy,
+      .index = i,
+    };
+  }
+  qsort(t->keys, t->count, sizeof(vkrt_tile_key), vkrt_tile_cmp);
+  for (uint32_t i = 0; i < t->count; ++i) { t->order[i] = t->keys[i].index; }
+  t->next = 0;
+}
+
+bool vkrt_tiler_pass_done(vkrt_tiler *t) {
+  return t->next >= t->count;
+}
+
+// the next tile of the pass, clipped to the image, false once they're all out
+bool vkrt_tiler_next(vkrt_tiler *t, VkRect2D *tile) {
+  if (vkrt_tiler_pass_done(t)) { return false; }
+  uint32_t i = t->order[t->next++];
+  uint32_t x = (i % t->cols) * t->tile_size;
+  uint32_t y = (i / t->cols) * t->tile_size;
+  *tile = (VkRect2D) {
+    .offset = { x, y },
+    .extent = {
+      t->extent.width - x < t->tile_size ? t->extent.width - x : t->tile_size,
+      t->extent.height - y < t->tile_size ? t->extent.height - y : t->tile_size,
+    },
+  };
+  return true;
+}
+
+void vkrt_tiler_destroy(vkrt_tiler *t) {
+  free(t->keys);
+  free(t->order);
+  *t = (vkrt_tiler){};
+}
+#endif // VK_RT_TILES_H_
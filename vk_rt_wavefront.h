@@ -0,0 +1,244 @@
+#ifndef VK_RT_WAVEFRONT_H_
+#define VK_RT_WAVEFRONT_H_
+// a wavefront path tracer, the alternative to the path loop in
+// shaders/ray_gen.rgen, where every thread follows its path through all its
+// bounces and the subgroup diverges after the first. here a bounce is a round
+// of passes over queues of the paths still going:
+//  generate (compute) starts a path per pixel and queues those that trace
+//  extend (an indirect ray tracing launch) traces the queued rays
+//  sort (compute, optional) orders the queue by the material that was hit
+//  shade (indirect compute) shades the hits, queueing the shadow rays and the
+//    paths that carry on, compacted so finished paths take no threads
+//  shadow (an indirect ray tracing launch) traces the shadow rays
+// then accumulate (compute) adds the finished paths to the image. the passes
+// share the trace set (trace set bindings 15 and 16 hold the state) and the
+// push constants, which end with a vkrt_wave_push_constants. the compute passes
+// see the specialization constants too, so they're built with each pipeline
+// variant (vkrt_pipeline_variant::wave_passes)
+
+// matches the end of the push constants in shaders/push_constants.glsl
+typedef struct {
+  uint32_t queue; // ray queue the pass reads
+  uint32_t sample; // sample of the launch being traced
+  uint32_t sorted; // shade reads the queue sorted by material
+  uint32_t sort_stage; // see shaders/wave_sort.comp
+} vkrt_wave_push_constants;
+
+// the queues, as in shaders/wavefront.glsl
+typedef enum {
+  vkrt_wave_rays, // and the next one, bounces alternate between them
+  vkrt_wave_shadow_rays = 2,
+  vkrt_wave_sorted_rays,
+  vkrt_wave_queue_count,
+} vkrt_wave_queue;
+
+// sizeof wave_path_t in shaders/wavefront.glsl (scalar layout), in words
+#define VKRT_WAVE_PATH_WORDS 49
+// bytes of a queue's header, the launch then the dispatch
+#define VKRT_WAVE_QUEUE_HEADER 32
+// rounds of the first sample whose queue length count_depths keeps
+#define VKRT_WAVE_COUNTED_ROUNDS 32
+
+typedef struct {
+  vkrt_memory paths; // a wave_path_t per pixel (trace set binding 15)
+  // the queue headers, then a pixel count long slice of paths per queue and
+  // a counter per material for the sort (trace set binding 16)
+  vkrt_memory queues;
+  VkDescriptorSet set;
+  VkExtent2D extent;
+  uint32_t material_count;
+  bool sort_materials;
+  // copies the length of the ray queue each round of a launch's first sample
+  // starts with into depth_counts (host visible), for the benchmark to see
+  // how many of the recorded rounds had nothing left to trace
+  bool count_depths;
+  vkrt_memory depth_counts;
+} vkrt_wavefront;
+
+// the compute passes use the trace set, so its layout has to include the
+// compute stage
+vkrt_wavefront vkrt_wavefront_create(VkDevice device, VmaAllocator allocator,
+				     VkDescriptorSet set, VkExtent2D extent,
+				     uint32_t material_count) {
+  vkrt_wavefront w = {
+    .set = set,
+    .extent = extent,
+    .material_count = material_count,
+  };
+  uint64_t pixels = (uint64_t)extent.width * extent.height;
+  w.paths = vkrt_allocate_device_memory(device, allocator,
+					pixels * VKRT_WAVE_PATH_WORDS * sizeof(uint32_t),
+					VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+					VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  w.queues = vkrt_allocate_device_memory(device, allocator,
+					 vkrt_wave_queue_count * VKRT_WAVE_QUEUE_HEADER +
+					 (vkrt_wave_queue_count * pixels +
+					  material_count + 1) * sizeof(uint32_t),
+					 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+					 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+					 VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+					 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  w.depth_counts = vkrt_allocate_memory(device, allocator,
+					VKRT_WAVE_COUNTED_ROUNDS * sizeof(uint32_t), NULL,
+					VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+					VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+  return w;
+}
+
+// orders each pass after everything the previous ones wrote, including the
+// queue sizes read by the indirect launches and dispatches
+void vkrt_wavefront_barrier(VkCommandBuffer cmd) {
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+		     vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT,
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+		     vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_TRANSFER_BIT |
+		     VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+		     VK_ACCESS_2_TRANSFER_READ_BIT |
+		     VK_ACCESS_2_TRANSFER_WRITE_BIT |
+		     VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT);
+}
+
+// empties a queue, its launch one high and deep and carrying the slice length
+void vkrt_wavefront_record_clear(VkCommandBuffer cmd, vkrt_wavefront *w,
+				 vkrt_wave_queue queue) {
+  uint32_t header[8] = { 0, 1, 1, w->extent.width * w->extent.height, 0, 1, 1, 0 };
+  vkCmdUpdateBuffer(cmd, w->queues.buffer, queue * VKRT_WAVE_QUEUE_HEADER,
+		    sizeof(header), header);
+}
+
+void vkrt_wavefront_dispatch(VkCommandBuffer cmd, vkrt_wavefront *w,
+			     vkw_compute_pipeline pipeline, void *pcs,
+			     vkrt_wave_queue queue) {
+  vkw_compute_pipeline_bind(cmd, pipeline, w->set);
+  vkw_compute_pipeline_push_constants(cmd, pipeline, pcs);
+  vkCmdDispatchIndirect(cmd, w->queues.buffer,
+			queue * VKRT_WAVE_QUEUE_HEADER + 4 * sizeof(uint32_t));
+}
+
+// orders the ray queue by material into the sorted queue
+void vkrt_wavefront_record_sort(VkCommandBuffer cmd, vkrt_wavefront *w,
+				vkw_compute_pipeline sort, void *pcs,
+				vkrt_wave_push_constants *wave) {
+  uint64_t pixels = (uint64_t)w->extent.width * w->extent.height;
+  vkCmdFillBuffer(cmd, w->queues.buffer,
+		  vkrt_wave_queue_count * (VKRT_WAVE_QUEUE_HEADER +
+					   pixels * sizeof(uint32_t)),
+		  (w->material_count + 1) * sizeof(uint32_t), 0);
+  vkrt_wavefront_barrier(cmd);
+  wave->sort_stage = 0;
+  vkrt_wavefront_dispatch(cmd, w, sort, pcs, wave->queue);
+  vkrt_wavefront_barrier(cmd);
+  wave->sort_stage = 1;
+  vkw_compute_pipeline_push_constants(cmd, sort, pcs);
+  vkCmdDispatch(cmd, 1, 1, 1);
+  vkrt_wavefront_barrier(cmd);
+  wave->sort_stage = 2;
+  vkrt_wavefront_dispatch(cmd, w, sort, pcs, wave->queue);
+  vkrt_wavefront_barrier(cmd);
+}
+
+// traces a launch of the whole image the wavefront way, barriers included,
+// with the passes of v (see vkrt_pipelines_get_variant). the push constants
+// (sizeof_pcs long) are those of the ray tracing pipeline, wave points to the
+// vkrt_wave_push_constants in them
+void vkrt_wavefront_record(VkCommandBuffer cmd, vkrt_wavefront *w,
+			   vkrt_pipeline_variant *v, void *pcs, uint32_t sizeof_pcs,
+			   vkrt_wave_push_constants *wave) {
+  VkDeviceAddress queues = w->queues.device_address;
+  vkrt_specialization spec = v->spec;
+  vkrt_tracer *extend = &v->tracers[vkrt_raygen_wave_extend];
+  vkrt_tracer *shadow = &v->tracers[vkrt_raygen_wave_shadow];
+  vkw_compute_pipeline *passes = v->wave_passes;
+  if (w->count_depths) {
+    vkCmdFillBuffer(cmd, w->depth_counts.buffer, 0, VK_WHOLE_SIZE, 0);
+  }
+  // the previous launch wrote the image and read the paths
+  vkrt_wavefront_barrier(cmd);
+  for (uint32_t s = 0; s < spec.samples; ++s) {
+    *wave = (vkrt_wave_push_constants){ .queue = vkrt_wave_rays, .sample = s };
+    vkrt_wavefront_record_clear(cmd, w, vkrt_wave_rays);
+    vkrt_wavefront_barrier(cmd);
+    vkw_compute_pipeline_bind(cmd, passes[vkrt_wave_pass_generate], w->set);
+    vkw_compute_pipeline_push_constants(cmd, passes[vkrt_wave_pass_generate], pcs);
+    vkCmdDispatch(cmd, (w->extent.width + 7) / 8, (w->extent.height + 7) / 8, 1);
+
+    // no path traces more than max_depth rays, so that many rounds are
+    // recorded. the host can't see how many paths are left, so the rounds
+    // past the point every path has finished are recorded all the same. they
+    // trace nothing, but each still costs three barriers, two queue clears,
+    // two empty indirect trace launches and an empty shade dispatch (sorting
+    // adds a fill, four barriers and three dispatches). with roulette most
+    // paths end long before max_depth, so a high max depth pays for rounds
+    // that do nothing on every sample. the benchmark reports how many there
+    // were (count_depths)
+    for (uint32_t d = 0; d < spec.max_depth; ++d) {
+      vkrt_wave_queue next = wave->queue ^ 1;
+      vkrt_wavefront_barrier(cmd);
+      if (w->count_depths && s == 0 && d < VKRT_WAVE_COUNTED_ROUNDS) {
+	VkBufferCopy count = {
+	  .srcOffset = wave->queue * VKRT_WAVE_QUEUE_HEADER,
+	  .dstOffset = d * sizeof(uint32_t),
+	  .size = sizeof(uint32_t),
+	};
+	vkCmdCopyBuffer(cmd, w->queues.buffer, w->depth_counts.buffer, 1, &count);
+      }
+      vkrt_tracer_record_indirect(cmd, extend, pcs, sizeof_pcs,
+				  queues + wave->queue * VKRT_WAVE_QUEUE_HEADER);
+      vkrt_wavefront_record_clear(cmd, w, next);
+      vkrt_wavefront_record_clear(cmd, w, vkrt_wave_shadow_rays);
+      vkrt_wavefront_barrier(cmd);
+      if (w->sort_materials) {
+	vkrt_wavefront_record_sort(cmd, w, passes[vkrt_wave_pass_sort], pcs, wave);
+	wave->sorted = 1;
+      }
+      vkrt_wavefront_dispatch(cmd, w, passes[vkrt_wave_pass_shade], pcs, wave->queue);
+      vkrt_wavefront_barrier(cmd);
+      vkrt_tracer_record_indirect(cmd, shadow, pcs, sizeof_pcs,
+				  queues + vkrt_wave_shadow_rays * VKRT_WAVE_QUEUE_HEADER);
+      wave->queue = next;
+      wave->sorted = 0;
+    }
+  }
+  vkrt_wavefront_barrier(cmd);
+  vkw_compute_pipeline_bind(cmd, passes[vkrt_wave_pass_accumulate], w->set);
+  vkw_compute_pipeline_push_constants(cmd, passes[vkrt_wave_pass_accumulate], pcs);
+  vkCmdDispatch(cmd, (w->extent.width + 7) / 8, (w->extent.height + 7) / 8, 1);
+  // what follows a launch waits on the ray tracing stage, chain onto that
+  vkh_memory_barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+		     vkrt_trace_stage |
+		     VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+		     VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+		     VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+		     VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+		     VK_ACCESS_2_TRANSFER_READ_BIT);
+  *wave = (vkrt_wave_push_constants){};
+}
+
+// the rounds of the last launch's first sample that started with an empty ray
+// queue, out of its max_depth (rounds past VKRT_WAVE_COUNTED_ROUNDS aren't
+// counted). needs count_depths, and the launch to have finished
+uint32_t vkrt_wavefront_empty_rounds(VmaAllocator allocator, vkrt_wavefront *w,
+				     uint32_t max_depth) {
+  VK_CHECK(vmaInvalidateAllocation(allocator, w->depth_counts.allocation, 0,
+				   VK_WHOLE_SIZE));
+  const uint32_t *counts = w->depth_counts.info.pMappedData;
+  uint32_t empty = 0;
+  for (uint32_t d = 0; d < max_depth && d < VKRT_WAVE_COUNTED_ROUNDS; ++d) {
+    empty += counts[d] == 0;
+  }
+  return empty;
+}
+
+void vkrt_wavefront_destroy(VmaAllocator allocator, vkrt_wavefront *w) {
+  vkrt_memory_free(allocator, w->paths);
+  vkrt_memory_free(allocator, w->queues);
+  vkrt_memory_free(allocator, w->depth_counts);
+  *w = (vkrt_wavefront){};
+}
+#endif // VK_RT_WAVEFRONT_H_
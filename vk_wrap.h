@@ -147,6 +147,14 @@ vkw_compute_pipeline vkw_compute_pipeline_create(VkDevice device,
 						 VkShaderModule shader,
 						 size_t sizeof_push_constants);
 
+// spec (may be NULL) sets the shader's specialization constants
+vkw_compute_pipeline
+vkw_compute_pipeline_create_specialized(VkDevice device, VkPipelineCache cache,
+					VkDescriptorSetLayout layout,
+					VkShaderModule shader,
+					size_t sizeof_push_constants,
+					const VkSpecializationInfo *spec);
+
 void vkw_compute_pipeline_bind(VkCommandBuffer cmd,
 			       vkw_compute_pipeline pipeline,
 			       VkDescriptorSet descriptor_set);
@@ -177,6 +185,29 @@ void vkw_frame_cmd_begin(VkDevice device, vkw_frame_data data,
 void vkw_frame_end_and_submit(VkDevice device, VkQueue queue,
 			      vkw_frame_data data);
 
+// timestamp query pool, marks are written in pairs and read back once the
+// command buffer that wrote them has finished
+typedef struct {
+  VkQueryPool pool;
+  uint32_t count;
+  float period_ns;
+  bool written;
+} vkw_gpu_timer;
+
+vkw_gpu_timer vkw_gpu_timer_create(VkDevice device, VkPhysicalDevice physical_device,
+				   uint32_t count);
+
+void vkw_gpu_timer_reset(VkCommandBuffer cmd, vkw_gpu_timer *timer);
+
+void vkw_gpu_timer_mark(VkCommandBuffer cmd, vkw_gpu_timer *timer, uint32_t idx);
+
+bool vkw_gpu_timer_read(VkDevice device, vkw_gpu_timer *timer, uint64_t *ticks);
+
+double vkw_gpu_timer_ms(vkw_gpu_timer timer, uint64_t *ticks, uint32_t begin,
+			uint32_t end);
+
+void vkw_gpu_timer_destroy(VkDevice device, vkw_gpu_timer timer);
+
 #endif
 #ifdef VK_WRAP_IMPL
 #define VK_HELP_IMPL
@@ -244,7 +275,7 @@ vkw_immediate_end(VkDevice device, vkw_immediate_submit_buffer imm, VkQueue queu
   };
   VK_CHECK(vkQueueSubmit2(queue, 1, &submit, imm.fence));
 
-  VK_CHECK(vkWaitForFences(device, 1, &imm.fence, true, 99999999));
+  VK_CHECK(vkWaitForFences(device, 1, &imm.fence, true, UINT64_MAX));
 }
 
 void vkw_immediate_submit_buffer_destroy(VkDevice device,
@@ -538,6 +569,16 @@ vkw_compute_pipeline vkw_compute_pipeline_create(VkDevice device,
 						 VkDescriptorSetLayout layout,
 						 VkShaderModule shader,
 						 size_t sizeof_push_constants) {
+  return vkw_compute_pipeline_create_specialized(device, VK_NULL_HANDLE, layout, shader,
+						 sizeof_push_constants, NULL);
+}
+
+vkw_compute_pipeline
+vkw_compute_pipeline_create_specialized(VkDevice device, VkPipelineCache cache,
+					VkDescriptorSetLayout layout,
+					VkShaderModule shader,
+					size_t sizeof_push_constants,
+					const VkSpecializationInfo *spec) {
   vkw_compute_pipeline res = {
     .sizeof_push_constants = sizeof_push_constants,
   };
@@ -561,6 +602,7 @@ vkw_compute_pipeline vkw_compute_pipeline_create(VkDevice device,
     .stage = VK_SHADER_STAGE_COMPUTE_BIT,
     .module = shader,
     .pName = "main",
+    .pSpecializationInfo = spec,
   };
   
   VkComputePipelineCreateInfo compute_info = {
@@ -569,7 +611,7 @@ vkw_compute_pipeline vkw_compute_pipeline_create(VkDevice device,
     .stage = stage_info,
   };
   
-  VK_CHECK(vkCreateComputePipelines(device, VK_NULL_HANDLE, 1, &compute_info,
+  VK_CHECK(vkCreateComputePipelines(device, cache, 1, &compute_info,
 				    NULL, &res.pipeline));
   return res;
 }
@@ -578,6 +620,8 @@ void vkw_compute_pipeline_bind(VkCommandBuffer cmd,
 			       vkw_compute_pipeline pipeline,
 			       VkDescriptorSet descriptor_set) {
   vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.pipeline);
+  // pipelines that only use push constants have nothing to bind
+  if (descriptor_set == VK_NULL_HANDLE) { return; }
   vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.layout,
 			  0, 1, &descriptor_set, 0, NULL);
 }
@@ -683,4 +727,49 @@ void vkw_frame_end_and_submit(VkDevice device, VkQueue queue,
     VK_CHECK(vkQueueSubmit2(queue, 1, &submit_info,
 			    data.render_fence));
 }
+
+vkw_gpu_timer vkw_gpu_timer_create(VkDevice device, VkPhysicalDevice physical_device,
+				   uint32_t count) {
+  VkPhysicalDeviceProperties props;
+  vkGetPhysicalDeviceProperties(physical_device, &props);
+
+  vkw_gpu_timer res = {
+    .count = count,
+    .period_ns = props.limits.timestampPeriod,
+  };
+  VkQueryPoolCreateInfo info = {
+    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+    .queryType = VK_QUERY_TYPE_TIMESTAMP,
+    .queryCount = count,
+  };
+  VK_CHECK(vkCreateQueryPool(device, &info, NULL, &res.pool));
+  return res;
+}
+
+void vkw_gpu_timer_reset(VkCommandBuffer cmd, vkw_gpu_timer *timer) {
+  vkCmdResetQueryPool(cmd, timer->pool, 0, timer->count);
+  timer->written = true;
+}
+
+void vkw_gpu_timer_mark(VkCommandBuffer cmd, vkw_gpu_timer *timer, uint32_t idx) {
+  vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, timer->pool, idx);
+}
+
+// returns false if nothing has been recorded into the pool yet
+bool vkw_gpu_timer_read(VkDevice device, vkw_gpu_timer *timer, uint64_t *ticks) {
+  if (!timer->written) { return false; }
+  VkResult res = vkGetQueryPoolResults(device, timer->pool, 0, timer->count,
+				       timer->count * sizeof(uint64_t), ticks,
+				       sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+  return res == VK_SUCCESS;
+}
+
+double vkw_gpu_timer_ms(vkw_gpu_timer timer, uint64_t *ticks, uint32_t begin,
+			uint32_t end) {
+  return (double)(ticks[end] - ticks[begin]) * timer.period_ns / 1000000.0;
+}
+
+void vkw_gpu_timer_destroy(VkDevice device, vkw_gpu_timer timer) {
+  vkDestroyQueryPool(device, timer.pool, NULL);
+}
 #endif